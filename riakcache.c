@@ -0,0 +1,1117 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakcache.c
+ *
+ * Client-side object cache.
+ *
+ * Cache is split into shards, each with its own lock, hash table and byte limit. Entries of shard form
+ * a ring swept by CLOCK hand: hit only sets referenced bit, eviction skips (and clears) referenced entries.
+ * Every entry is a single allocation holding names, value and metadata.
+ *
+ * Not-found results (negative entries) share hash table with objects, but have their own ring, limited
+ * to part of shard, so that lookups of many absent keys can't push hot objects out.
+ *
+ * Misses are coalesced: first thread missing an object leads a flight (get sent to Riak), threads missing
+ * the same object meanwhile wait for it and get copies of its result instead of sending their own requests.
+ *
+ * Cache created by riak_cache_new_shared keeps entries in shared memory instead (see riakshm.c); its shards
+ * only hold flights and counters of the process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "riakdrv.h"
+#include "riakcache.h"
+#include "riakshm.h"
+
+/** Number of shards; must be power of two. */
+#define RIAK_CACHE_SHARDS 16
+/** Initial size of hash table of shard; must be power of two. */
+#define RIAK_CACHE_MIN_TABLE 64
+/** Negative entries take at most 1/RIAK_CACHE_NEGATIVE_SHARE of cache. */
+#define RIAK_CACHE_NEGATIVE_SHARE 8
+/** Ring of objects. */
+#define RIAK_CACHE_POSITIVE 0
+/** Ring of not-found results. */
+#define RIAK_CACHE_NEGATIVE 1
+/** TTL of bucket which wasn't set - default of cache is used. */
+#define RIAK_CACHE_TTL_DEFAULT UINT_MAX
+/** Result of flight which hasn't finished yet. */
+#define RIAK_CACHE_PENDING -1
+/** "RKCF" - magic of file written by riak_cache_save. */
+#define RIAK_CACHE_FILE_MAGIC 0x524B4346u
+/** Version of layout of file written by riak_cache_save. */
+#define RIAK_CACHE_FILE_VERSION 1
+
+/**
+ * \brief Cached object.
+ */
+struct riak_cache_entry {
+	/** Hash of bucket and key. */
+	__uint64_t hash;
+	/** Next entry in hash chain. */
+	struct riak_cache_entry * next;
+	/** Previous entry in CLOCK ring. */
+	struct riak_cache_entry * ring_prev;
+	/** Next entry in CLOCK ring. */
+	struct riak_cache_entry * ring_next;
+	/** Expiration time (monotonic, ms). */
+	long long expires;
+	/** Set by hits, cleared by CLOCK hand. */
+	int referenced;
+	/** Ring of entry: RIAK_CACHE_POSITIVE or RIAK_CACHE_NEGATIVE. */
+	int ring;
+	/** Bytes accounted for entry. */
+	size_t bytes;
+	/** Length of bucket name. */
+	size_t bucket_len;
+	/** Length of key. */
+	size_t key_len;
+	/** Object; its strings point into data. Not used by negative entries. */
+	RIAK_OBJECT obj;
+	/** Bucket name, key, then strings of obj. */
+	char data[];
+};
+
+/**
+ * \brief Header of file written by riak_cache_save.
+ */
+struct riak_cache_file_header {
+	/** RIAK_CACHE_FILE_MAGIC */
+	__uint32_t magic;
+	/** RIAK_CACHE_FILE_VERSION */
+	__uint32_t version;
+	/** Number of records. */
+	__uint64_t n_records;
+};
+
+/**
+ * \brief Object in file written by riak_cache_save.
+ *
+ * Followed by data of entry: bucket name, key, value with terminator, content type and vtag (both with terminators),
+ * vclock. Records are padded to 8 bytes.
+ */
+struct riak_cache_record {
+	/** Expiration time (wall clock, ms). */
+	long long expires;
+	/** Number of siblings of object. */
+	__uint64_t n_siblings;
+	/** Last modification time (seconds part). */
+	__uint32_t last_mod;
+	/** Last modification time (microseconds part). */
+	__uint32_t last_mod_usecs;
+	/** Length of bucket name. */
+	__uint32_t bucket_len;
+	/** Length of key. */
+	__uint32_t key_len;
+	/** Length of value. */
+	__uint32_t value_len;
+	/** Length of content type with terminator; 0 if not set. */
+	__uint32_t content_type_len;
+	/** Length of vtag with terminator; 0 if not set. */
+	__uint32_t vtag_len;
+	/** Length of vclock; 0 if not set. */
+	__uint32_t vclock_len;
+};
+
+/**
+ * \brief Get of object in progress, waited for by other threads which missed the same object.
+ */
+struct riak_cache_flight {
+	/** Hash of bucket and key. */
+	__uint64_t hash;
+	/** Next flight of shard. */
+	struct riak_cache_flight * next;
+	/** Broadcast when result is set. */
+	pthread_cond_t done;
+	/** RIAK_CACHE_PENDING, then RIAK_CACHE_HIT, RIAK_CACHE_ABSENT or RIAK_CACHE_MISS (get failed). */
+	int result;
+	/** Non-zero while flight is on list of shard and can be joined. */
+	int listed;
+	/** Number of threads holding flight (leader and waiters); last one frees it. */
+	int refs;
+	/** Fetched object; copied only if anyone waits. */
+	RIAK_OBJECT * obj;
+	/** Length of bucket name. */
+	size_t bucket_len;
+	/** Length of key. */
+	size_t key_len;
+	/** Bucket name, then key. */
+	char data[];
+};
+
+/**
+ * \brief Entries of one kind in shard, swept by CLOCK hand.
+ */
+struct riak_cache_ring {
+	/** CLOCK hand; NULL if ring is empty. */
+	struct riak_cache_entry * hand;
+	/** Number of entries. */
+	size_t n_entries;
+	/** Bytes used by entries. */
+	size_t bytes;
+};
+
+/**
+ * \brief Independently locked part of cache.
+ */
+struct riak_cache_shard {
+	pthread_mutex_t lock;
+	/** Hash table. */
+	struct riak_cache_entry ** table;
+	/** Size of table; power of two. */
+	size_t table_size;
+	/** Rings of objects and negative entries. */
+	struct riak_cache_ring rings[2];
+	/** Gets in progress. */
+	struct riak_cache_flight * flights;
+	/** Limit of bytes of both rings. */
+	size_t max_bytes;
+	/** Incremented by every invalidation. */
+	unsigned int epoch;
+	/** Number of hits. */
+	unsigned long long hits;
+	/** Number of hits of negative entries. */
+	unsigned long long negative_hits;
+	/** Number of misses. */
+	unsigned long long misses;
+	/** Number of misses served by flight of other thread. */
+	unsigned long long coalesced;
+	/** Number of entries evicted to make room. */
+	unsigned long long evictions;
+} __attribute__((aligned(64)));
+
+/**
+ * \brief Time to live of objects from one bucket.
+ */
+struct riak_cache_ttl {
+	/** Name of bucket. */
+	char * bucket;
+	/** Length of bucket name. */
+	size_t bucket_len;
+	/** TTL of objects in milliseconds; 0 if objects aren't cached, RIAK_CACHE_TTL_DEFAULT if not set. */
+	unsigned int ttl_ms;
+	/** TTL of not-found results, as above. */
+	unsigned int negative_ttl_ms;
+};
+
+struct riak_cache {
+	/** Shards, selected by hash. */
+	struct riak_cache_shard shards[RIAK_CACHE_SHARDS];
+	/** Guards ttls. */
+	pthread_rwlock_t ttl_lock;
+	/** TTLs set for particular buckets. */
+	struct riak_cache_ttl * ttls;
+	/** Number of ttls. */
+	size_t n_ttls;
+	/** TTL of objects of other buckets. */
+	unsigned int default_ttl_ms;
+	/** TTL of not-found results of other buckets. */
+	unsigned int default_negative_ttl_ms;
+	/** Table in shared memory holding entries instead of shards; NULL for cache of process. */
+	RIAK_SHM * shm;
+};
+
+/**	\fn long long riak_cache_now(void)
+ * 	\brief Returns monotonic time in milliseconds.
+ */
+static inline long long riak_cache_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**	\fn long long riak_cache_wall(void)
+ * 	\brief Returns wall clock time in milliseconds, which expiration times are saved as.
+ */
+static inline long long riak_cache_wall(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**	\fn __uint64_t riak_cache_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief FNV-1a hash of bucket and key, with final mixing.
+ */
+static inline __uint64_t riak_cache_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < bucket_len; i++)
+		hash = (hash ^ (unsigned char)bucket[i]) * 1099511628211ULL;
+	/* Separator, so that ("ab", "c") and ("a", "bc") differ */
+	hash = (hash ^ 0xFF) * 1099511628211ULL;
+	for(i = 0; i < key_len; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+	/* Last bytes hardly affect top bits, which select shard - mix them */
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/**	\fn struct riak_cache_shard * riak_cache_shard(RIAK_CACHE * cache, __uint64_t hash)
+ * 	\brief Returns shard holding objects of given hash. Top bits are used, bottom ones index hash table.
+ */
+static inline struct riak_cache_shard * riak_cache_shard(RIAK_CACHE * cache, __uint64_t hash) {
+	return &cache->shards[(hash >> 58) & (RIAK_CACHE_SHARDS-1)];
+}
+
+/**	\fn struct riak_cache_entry ** riak_cache_find(struct riak_cache_shard * shard, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Finds entry in hash table of shard. Shard must be locked.
+ *
+ * @return pointer to link pointing at entry (so that entry can be unlinked); link holding NULL if entry doesn't exist
+ */
+static struct riak_cache_entry ** riak_cache_find(struct riak_cache_shard * shard, __uint64_t hash,
+		const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	struct riak_cache_entry ** link;
+	struct riak_cache_entry * e;
+
+	for(link = &shard->table[hash & (shard->table_size-1)]; (e = *link) != NULL; link = &e->next) {
+		if(e->hash == hash && e->bucket_len == bucket_len && e->key_len == key_len
+				&& memcmp(e->data, bucket, bucket_len) == 0 && memcmp(e->data+bucket_len, key, key_len) == 0)
+			break;
+	}
+
+	return link;
+}
+
+/**	\fn void riak_cache_unlink(struct riak_cache_shard * shard, struct riak_cache_entry ** link)
+ * 	\brief Removes entry from shard and frees it. Shard must be locked.
+ *
+ * @param link link pointing at entry, as returned by riak_cache_find
+ */
+static void riak_cache_unlink(struct riak_cache_shard * shard, struct riak_cache_entry ** link) {
+	struct riak_cache_entry * e = *link;
+	struct riak_cache_ring * ring = &shard->rings[e->ring];
+
+	*link = e->next;
+	if(e->ring_next == e) {
+		ring->hand = NULL;
+	} else {
+		e->ring_prev->ring_next = e->ring_next;
+		e->ring_next->ring_prev = e->ring_prev;
+		if(ring->hand == e)
+			ring->hand = e->ring_next;
+	}
+	ring->n_entries--;
+	ring->bytes -= e->bytes;
+	free(e);
+}
+
+/**	\fn void riak_cache_evict(struct riak_cache_shard * shard, int ring)
+ * 	\brief Evicts one entry of ring chosen by CLOCK hand. Shard must be locked and ring not empty.
+ */
+static void riak_cache_evict(struct riak_cache_shard * shard, int ring) {
+	struct riak_cache_ring * r = &shard->rings[ring];
+	struct riak_cache_entry * e;
+
+	while(r->hand->referenced) {
+		r->hand->referenced = 0;
+		r->hand = r->hand->ring_next;
+	}
+	e = r->hand;
+	riak_cache_unlink(shard, riak_cache_find(shard, e->hash, e->data, e->bucket_len, e->data+e->bucket_len, e->key_len));
+	shard->evictions++;
+}
+
+/**	\fn void riak_cache_grow(struct riak_cache_shard * shard)
+ * 	\brief Doubles hash table of shard. Shard must be locked. Table is left as it is if memory is short.
+ */
+static void riak_cache_grow(struct riak_cache_shard * shard) {
+	struct riak_cache_entry ** table, * e, * next;
+	size_t i, size = 2*shard->table_size;
+
+	if((table = calloc(size, sizeof(struct riak_cache_entry *))) == NULL)
+		return;
+	for(i = 0; i < shard->table_size; i++) {
+		for(e = shard->table[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = table[e->hash & (size-1)];
+			table[e->hash & (size-1)] = e;
+		}
+	}
+	free(shard->table);
+	shard->table = table;
+	shard->table_size = size;
+}
+
+/**	\fn unsigned int riak_cache_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, int negative)
+ * 	\brief Returns TTL of objects (or not-found results, if negative is set) from bucket.
+ */
+static unsigned int riak_cache_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, int negative) {
+	unsigned int ttl = RIAK_CACHE_TTL_DEFAULT;
+	size_t i;
+
+	pthread_rwlock_rdlock(&cache->ttl_lock);
+	for(i = 0; i < cache->n_ttls; i++) {
+		if(cache->ttls[i].bucket_len == bucket_len && memcmp(cache->ttls[i].bucket, bucket, bucket_len) == 0) {
+			ttl = negative ? cache->ttls[i].negative_ttl_ms : cache->ttls[i].ttl_ms;
+			break;
+		}
+	}
+	if(ttl == RIAK_CACHE_TTL_DEFAULT)
+		ttl = negative ? cache->default_negative_ttl_ms : cache->default_ttl_ms;
+	pthread_rwlock_unlock(&cache->ttl_lock);
+
+	return ttl;
+}
+
+/**	\fn int riak_cache_set(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms, int negative)
+ * 	\brief Common implementation of riak_cache_set_ttl and riak_cache_set_negative_ttl.
+ */
+static int riak_cache_set(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms, int negative) {
+	struct riak_cache_ttl * tmp;
+	size_t i;
+	int ret = 0;
+
+	if(ttl_ms == RIAK_CACHE_TTL_DEFAULT)
+		ttl_ms--;
+
+	pthread_rwlock_wrlock(&cache->ttl_lock);
+	if(bucket == NULL) {
+		if(negative)
+			cache->default_negative_ttl_ms = ttl_ms;
+		else
+			cache->default_ttl_ms = ttl_ms;
+		pthread_rwlock_unlock(&cache->ttl_lock);
+		return 0;
+	}
+
+	for(i = 0; i < cache->n_ttls; i++) {
+		if(cache->ttls[i].bucket_len == bucket_len && memcmp(cache->ttls[i].bucket, bucket, bucket_len) == 0)
+			break;
+	}
+	if(i == cache->n_ttls) {
+		if((tmp = realloc(cache->ttls, (cache->n_ttls+1)*sizeof(struct riak_cache_ttl))) == NULL) {
+			ret = 1;
+		} else {
+			cache->ttls = tmp;
+			if((tmp[i].bucket = malloc(bucket_len > 0 ? bucket_len : 1)) == NULL) {
+				ret = 1;
+			} else {
+				memcpy(tmp[i].bucket, bucket, bucket_len);
+				tmp[i].bucket_len = bucket_len;
+				tmp[i].ttl_ms = RIAK_CACHE_TTL_DEFAULT;
+				tmp[i].negative_ttl_ms = RIAK_CACHE_TTL_DEFAULT;
+				cache->n_ttls++;
+			}
+		}
+	}
+	if(ret == 0) {
+		if(negative)
+			cache->ttls[i].negative_ttl_ms = ttl_ms;
+		else
+			cache->ttls[i].ttl_ms = ttl_ms;
+	}
+	pthread_rwlock_unlock(&cache->ttl_lock);
+
+	return ret;
+}
+
+/**	\fn char * riak_cache_dup(const char * src, size_t len)
+ * 	\brief Copies len bytes and appends null terminator. Returns NULL for NULL src.
+ */
+static inline char * riak_cache_dup(const char * src, size_t len) {
+	char * dst;
+
+	if(src == NULL || (dst = malloc(len+1)) == NULL)
+		return NULL;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	return dst;
+}
+
+/**	\fn RIAK_OBJECT * riak_cache_copy(const RIAK_OBJECT * src)
+ * 	\brief Returns newly allocated deep copy of object; NULL if out of memory.
+ */
+static RIAK_OBJECT * riak_cache_copy(const RIAK_OBJECT * src) {
+	RIAK_OBJECT * copy;
+
+	if((copy = malloc(sizeof(RIAK_OBJECT))) == NULL)
+		return NULL;
+	*copy = *src;
+	copy->value = riak_cache_dup(src->value, src->value_len);
+	copy->content_type = riak_cache_dup(src->content_type, src->content_type ? strlen(src->content_type) : 0);
+	copy->vtag = riak_cache_dup(src->vtag, src->vtag ? strlen(src->vtag) : 0);
+	copy->vclock = riak_cache_dup(src->vclock, src->vclock_len);
+	if(copy->value == NULL || (src->content_type && !copy->content_type) || (src->vtag && !copy->vtag)
+			|| (src->vclock && !copy->vclock)) {
+		riak_object_free(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+/**	\fn void riak_cache_unlist(struct riak_cache_shard * shard, struct riak_cache_flight * f)
+ * 	\brief Removes flight from list of shard, so that nobody else joins it. Shard must be locked.
+ */
+static void riak_cache_unlist(struct riak_cache_shard * shard, struct riak_cache_flight * f) {
+	struct riak_cache_flight ** link;
+
+	for(link = &shard->flights; *link != f; link = &(*link)->next)
+		;
+	*link = f->next;
+	f->listed = 0;
+}
+
+/**	\fn void riak_cache_release(struct riak_cache_flight * f)
+ * 	\brief Drops reference to flight, freeing it if it was the last one. Shard must be locked.
+ */
+static void riak_cache_release(struct riak_cache_flight * f) {
+	if(--f->refs > 0)
+		return;
+	riak_object_free(f->obj);
+	pthread_cond_destroy(&f->done);
+	free(f);
+}
+
+/**	\fn int riak_cache_join(struct riak_cache_shard * shard, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT ** obj, RIAK_CACHE_TICKET * ticket)
+ * 	\brief Waits for flight getting the same object, or starts one if there is none. Shard must be locked.
+ *
+ * @param obj set to copy of object fetched by flight
+ * @param ticket flight field set if new flight was started
+ *
+ * @return result of flight which was waited for; RIAK_CACHE_MISS if it failed or caller became leader
+ */
+static int riak_cache_join(struct riak_cache_shard * shard, __uint64_t hash, const char * bucket, size_t bucket_len,
+		const char * key, size_t key_len, RIAK_OBJECT ** obj, RIAK_CACHE_TICKET * ticket) {
+	struct riak_cache_flight * f;
+	int ret;
+
+	for(f = shard->flights; f != NULL; f = f->next) {
+		if(f->hash == hash && f->bucket_len == bucket_len && f->key_len == key_len
+				&& memcmp(f->data, bucket, bucket_len) == 0 && memcmp(f->data+bucket_len, key, key_len) == 0)
+			break;
+	}
+
+	if(f == NULL) {
+		/* Without flight get just isn't shared */
+		if((f = malloc(sizeof(struct riak_cache_flight) + bucket_len + key_len)) == NULL)
+			return RIAK_CACHE_MISS;
+		f->hash = hash;
+		pthread_cond_init(&f->done, NULL);
+		f->result = RIAK_CACHE_PENDING;
+		f->listed = 1;
+		f->refs = 1;
+		f->obj = NULL;
+		f->bucket_len = bucket_len;
+		f->key_len = key_len;
+		memcpy(f->data, bucket, bucket_len);
+		memcpy(f->data+bucket_len, key, key_len);
+		f->next = shard->flights;
+		shard->flights = f;
+		ticket->flight = f;
+		return RIAK_CACHE_MISS;
+	}
+
+	f->refs++;
+	while(f->result == RIAK_CACHE_PENDING)
+		pthread_cond_wait(&f->done, &shard->lock);
+	ret = f->result;
+	if(ret == RIAK_CACHE_HIT) {
+		/* Object of finished flight doesn't change, and is kept by our reference */
+		pthread_mutex_unlock(&shard->lock);
+		*obj = riak_cache_copy(f->obj);
+		pthread_mutex_lock(&shard->lock);
+		if(*obj == NULL)
+			ret = RIAK_CACHE_MISS;
+	}
+	riak_cache_release(f);
+	if(ret != RIAK_CACHE_MISS)
+		shard->coalesced++;
+
+	/* If leader failed, caller sends its own request; it shouldn't wait for another failure */
+	return ret;
+}
+
+/**	\fn void riak_cache_land(RIAK_CACHE * cache, RIAK_CACHE_TICKET * ticket, const RIAK_OBJECT * obj, int result)
+ * 	\brief Finishes flight led by caller (if any) and wakes threads waiting for it.
+ */
+static void riak_cache_land(RIAK_CACHE * cache, RIAK_CACHE_TICKET * ticket, const RIAK_OBJECT * obj, int result) {
+	struct riak_cache_flight * f = ticket->flight;
+	struct riak_cache_shard * shard;
+	int waiting;
+
+	if(f == NULL)
+		return;
+	ticket->flight = NULL;
+	shard = riak_cache_shard(cache, f->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if(f->listed)
+		riak_cache_unlist(shard, f);
+	waiting = f->refs > 1;
+	pthread_mutex_unlock(&shard->lock);
+
+	/* Nobody can join any more, so object is copied only if somebody needs it, and outside of lock */
+	if(result == RIAK_CACHE_HIT && waiting && (f->obj = riak_cache_copy(obj)) == NULL)
+		result = RIAK_CACHE_MISS;
+
+	pthread_mutex_lock(&shard->lock);
+	f->result = result;
+	pthread_cond_broadcast(&f->done);
+	riak_cache_release(f);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+RIAK_CACHE * riak_cache_new(size_t max_bytes, unsigned int ttl_ms) {
+	RIAK_CACHE * cache;
+	int i;
+
+	/* Shards are aligned to cache lines */
+	if(posix_memalign((void **)&cache, 64, sizeof(RIAK_CACHE)) != 0)
+		return NULL;
+	memset(cache, 0, sizeof(RIAK_CACHE));
+	for(i = 0; i < RIAK_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+		cache->shards[i].max_bytes = max_bytes / RIAK_CACHE_SHARDS;
+		cache->shards[i].table_size = RIAK_CACHE_MIN_TABLE;
+		if((cache->shards[i].table = calloc(RIAK_CACHE_MIN_TABLE, sizeof(struct riak_cache_entry *))) == NULL) {
+			while(i >= 0)
+				free(cache->shards[i--].table);
+			free(cache);
+			return NULL;
+		}
+	}
+	pthread_rwlock_init(&cache->ttl_lock, NULL);
+	cache->default_ttl_ms = ttl_ms;
+
+	return cache;
+}
+
+RIAK_CACHE * riak_cache_new_shared(const char * path, size_t max_bytes, size_t max_object, unsigned int ttl_ms) {
+	RIAK_CACHE * cache;
+
+	if((cache = riak_cache_new(0, ttl_ms)) == NULL)
+		return NULL;
+	if((cache->shm = riak_shm_open(path, max_bytes, max_object)) == NULL) {
+		riak_cache_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+int riak_cache_set_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms) {
+	return riak_cache_set(cache, bucket, bucket_len, ttl_ms, 0);
+}
+
+int riak_cache_set_negative_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms) {
+	return riak_cache_set(cache, bucket, bucket_len, ttl_ms, 1);
+}
+
+int riak_cache_lookup(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj, int coalesce, RIAK_CACHE_TICKET * ticket) {
+	__uint64_t hash = riak_cache_hash(bucket, bucket_len, key, key_len);
+	struct riak_cache_shard * shard = riak_cache_shard(cache, hash);
+	struct riak_cache_entry ** link, * e;
+	RIAK_OBJECT * copy;
+	int ret = RIAK_CACHE_MISS;
+
+	if(cache->shm != NULL
+			&& (ret = riak_shm_lookup(cache->shm, hash, bucket, bucket_len, key, key_len, obj)) != RIAK_CACHE_MISS) {
+		/* Shared entries are read without locks, shard only counts hits */
+		__atomic_add_fetch(ret == RIAK_CACHE_HIT ? &shard->hits : &shard->negative_hits, 1, __ATOMIC_RELAXED);
+		return ret;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	e = NULL;
+	if(cache->shm == NULL) {
+		link = riak_cache_find(shard, hash, bucket, bucket_len, key, key_len);
+		if((e = *link) != NULL && e->expires <= riak_cache_now()) {
+			riak_cache_unlink(shard, link);
+			e = NULL;
+		}
+	}
+	if(e != NULL && e->ring == RIAK_CACHE_NEGATIVE) {
+		e->referenced = 1;
+		ret = RIAK_CACHE_ABSENT;
+	} else if(e != NULL && (copy = riak_cache_copy(&e->obj)) != NULL) {
+		e->referenced = 1;
+		*obj = copy;
+		ret = RIAK_CACHE_HIT;
+	}
+	if(ret == RIAK_CACHE_HIT) {
+		shard->hits++;
+	} else if(ret == RIAK_CACHE_ABSENT) {
+		shard->negative_hits++;
+	} else {
+		shard->misses++;
+		ticket->flight = NULL;
+		if(coalesce)
+			ret = riak_cache_join(shard, hash, bucket, bucket_len, key, key_len, obj, ticket);
+		/* Read after waiting, as that is when caller's own get starts */
+		ticket->epoch = cache->shm != NULL ? riak_shm_epoch(cache->shm, hash) : shard->epoch;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+/**	\fn size_t riak_cache_limit(struct riak_cache_shard * shard, int kind)
+ * 	\brief Returns limit of bytes of ring of given kind in shard.
+ */
+static inline size_t riak_cache_limit(struct riak_cache_shard * shard, int kind) {
+	return kind == RIAK_CACHE_NEGATIVE ? shard->max_bytes/RIAK_CACHE_NEGATIVE_SHARE : shard->max_bytes;
+}
+
+/**	\fn struct riak_cache_entry * riak_cache_entry_new(__uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const RIAK_OBJECT * obj, long long expires, size_t max_bytes)
+ * 	\brief Builds entry holding copy of object, or not-found result if obj is NULL.
+ *
+ * @param expires expiration time (monotonic, ms)
+ *
+ * @return new entry; NULL if it would take more than max_bytes or memory ran out
+ */
+static struct riak_cache_entry * riak_cache_entry_new(__uint64_t hash, const char * bucket, size_t bucket_len,
+		const char * key, size_t key_len, const RIAK_OBJECT * obj, long long expires, size_t max_bytes) {
+	size_t ctype_len = 0, vtag_len = 0, bytes;
+	struct riak_cache_entry * e;
+	char * p;
+
+	bytes = sizeof(struct riak_cache_entry) + bucket_len + key_len;
+	if(obj != NULL) {
+		ctype_len = obj->content_type ? strlen(obj->content_type)+1 : 0;
+		vtag_len = obj->vtag ? strlen(obj->vtag)+1 : 0;
+		bytes += obj->value_len+1 + ctype_len + vtag_len + obj->vclock_len;
+	}
+	if(bytes > max_bytes || (e = malloc(bytes)) == NULL)
+		return NULL;
+
+	e->hash = hash;
+	e->expires = expires;
+	e->referenced = 0;
+	e->ring = obj != NULL ? RIAK_CACHE_POSITIVE : RIAK_CACHE_NEGATIVE;
+	e->bytes = bytes;
+	e->bucket_len = bucket_len;
+	e->key_len = key_len;
+	p = e->data;
+	memcpy(p, bucket, bucket_len);
+	p += bucket_len;
+	memcpy(p, key, key_len);
+	p += key_len;
+	if(obj == NULL) {
+		memset(&e->obj, 0, sizeof(RIAK_OBJECT));
+		return e;
+	}
+	e->obj = *obj;
+	e->obj.value = p;
+	memcpy(p, obj->value, obj->value_len);
+	p[obj->value_len] = '\0';
+	p += obj->value_len+1;
+	if(obj->content_type != NULL) {
+		e->obj.content_type = p;
+		memcpy(p, obj->content_type, ctype_len);
+		p += ctype_len;
+	}
+	if(obj->vtag != NULL) {
+		e->obj.vtag = p;
+		memcpy(p, obj->vtag, vtag_len);
+		p += vtag_len;
+	}
+	if(obj->vclock != NULL) {
+		e->obj.vclock = p;
+		memcpy(p, obj->vclock, obj->vclock_len);
+	}
+
+	return e;
+}
+
+/**	\fn void riak_cache_insert(struct riak_cache_shard * shard, struct riak_cache_entry * e, const RIAK_CACHE_TICKET * ticket)
+ * 	\brief Puts entry into shard, evicting others to make room. Entry is freed if it isn't inserted.
+ *
+ * @param ticket ticket of get which fetched object, whose entry replaces cached one unless it is stale; NULL
+ * 	for entry loaded from file, which is inserted only if object isn't cached yet
+ */
+static void riak_cache_insert(struct riak_cache_shard * shard, struct riak_cache_entry * e, const RIAK_CACHE_TICKET * ticket) {
+	struct riak_cache_ring * ring = &shard->rings[e->ring];
+	size_t max_bytes = riak_cache_limit(shard, e->ring);
+	struct riak_cache_entry ** link;
+
+	pthread_mutex_lock(&shard->lock);
+	/* Object was fetched before some write was noticed - it may be stale */
+	if(ticket != NULL && shard->epoch != ticket->epoch) {
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return;
+	}
+	link = riak_cache_find(shard, e->hash, e->data, e->bucket_len, e->data+e->bucket_len, e->key_len);
+	if(*link != NULL) {
+		if(ticket == NULL) {
+			pthread_mutex_unlock(&shard->lock);
+			free(e);
+			return;
+		}
+		riak_cache_unlink(shard, link);
+	}
+	while(ring->bytes + e->bytes > max_bytes
+			|| shard->rings[RIAK_CACHE_POSITIVE].bytes + shard->rings[RIAK_CACHE_NEGATIVE].bytes + e->bytes > shard->max_bytes) {
+		if(ring->hand != NULL) {
+			riak_cache_evict(shard, e->ring);
+		} else if(e->ring == RIAK_CACHE_POSITIVE) {
+			riak_cache_evict(shard, RIAK_CACHE_NEGATIVE);
+		} else {
+			/* Negative entries never push objects out */
+			pthread_mutex_unlock(&shard->lock);
+			free(e);
+			return;
+		}
+	}
+	if(shard->rings[RIAK_CACHE_POSITIVE].n_entries + shard->rings[RIAK_CACHE_NEGATIVE].n_entries >= shard->table_size)
+		riak_cache_grow(shard);
+
+	link = &shard->table[e->hash & (shard->table_size-1)];
+	e->next = *link;
+	*link = e;
+	/* New entry goes just behind the hand, so it is the last one to be checked */
+	if(ring->hand == NULL) {
+		e->ring_prev = e->ring_next = e;
+		ring->hand = e;
+	} else {
+		e->ring_next = ring->hand;
+		e->ring_prev = ring->hand->ring_prev;
+		e->ring_prev->ring_next = e;
+		ring->hand->ring_prev = e;
+	}
+	ring->n_entries++;
+	ring->bytes += e->bytes;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void riak_cache_store(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const RIAK_OBJECT * obj, RIAK_CACHE_TICKET * ticket) {
+	__uint64_t hash = riak_cache_hash(bucket, bucket_len, key, key_len);
+	struct riak_cache_shard * shard = riak_cache_shard(cache, hash);
+	int kind = obj != NULL ? RIAK_CACHE_POSITIVE : RIAK_CACHE_NEGATIVE;
+	struct riak_cache_entry * e;
+	unsigned int ttl;
+
+	riak_cache_land(cache, ticket, obj, obj != NULL ? RIAK_CACHE_HIT : RIAK_CACHE_ABSENT);
+
+	if((ttl = riak_cache_ttl(cache, bucket, bucket_len, kind == RIAK_CACHE_NEGATIVE)) == 0)
+		return;
+
+	if(cache->shm != NULL) {
+		if(riak_shm_store(cache->shm, hash, bucket, bucket_len, key, key_len, obj, ttl, ticket->epoch)) {
+			pthread_mutex_lock(&shard->lock);
+			shard->evictions++;
+			pthread_mutex_unlock(&shard->lock);
+		}
+		return;
+	}
+
+	if((e = riak_cache_entry_new(hash, bucket, bucket_len, key, key_len, obj, riak_cache_now() + ttl,
+			riak_cache_limit(shard, kind))) != NULL)
+		riak_cache_insert(shard, e, ticket);
+}
+
+void riak_cache_fail(RIAK_CACHE * cache, RIAK_CACHE_TICKET * ticket) {
+	riak_cache_land(cache, ticket, NULL, RIAK_CACHE_MISS);
+}
+
+void riak_cache_invalidate(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t hash = riak_cache_hash(bucket, bucket_len, key, key_len);
+	struct riak_cache_shard * shard = riak_cache_shard(cache, hash);
+	struct riak_cache_entry ** link;
+	struct riak_cache_flight * f;
+
+	if(cache->shm != NULL)
+		riak_shm_invalidate(cache->shm, hash, bucket, bucket_len, key, key_len);
+
+	pthread_mutex_lock(&shard->lock);
+	shard->epoch++;
+	link = riak_cache_find(shard, hash, bucket, bucket_len, key, key_len);
+	if(*link != NULL)
+		riak_cache_unlink(shard, link);
+	/* Get in progress may return value from before the write - threads missing object from now on
+	 * must not wait for it */
+	for(f = shard->flights; f != NULL; f = f->next) {
+		if(f->hash == hash && f->bucket_len == bucket_len && f->key_len == key_len
+				&& memcmp(f->data, bucket, bucket_len) == 0 && memcmp(f->data+bucket_len, key, key_len) == 0) {
+			riak_cache_unlist(shard, f);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void riak_cache_clear(RIAK_CACHE * cache) {
+	struct riak_cache_shard * shard;
+	struct riak_cache_entry * e;
+	int i, ring;
+
+	if(cache->shm != NULL)
+		riak_shm_clear(cache->shm);
+
+	for(i = 0; i < RIAK_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		shard->epoch++;
+		for(ring = 0; ring < 2; ring++) {
+			while((e = shard->rings[ring].hand) != NULL)
+				riak_cache_unlink(shard, riak_cache_find(shard, e->hash, e->data, e->bucket_len, e->data+e->bucket_len, e->key_len));
+		}
+		while(shard->flights != NULL)
+			riak_cache_unlist(shard, shard->flights);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void riak_cache_stats(RIAK_CACHE * cache, RIAK_CACHE_STATS * stats) {
+	struct riak_cache_shard * shard;
+	int i;
+
+	memset(stats, 0, sizeof(RIAK_CACHE_STATS));
+	for(i = 0; i < RIAK_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		stats->entries += shard->rings[RIAK_CACHE_POSITIVE].n_entries;
+		stats->bytes += shard->rings[RIAK_CACHE_POSITIVE].bytes + shard->rings[RIAK_CACHE_NEGATIVE].bytes;
+		stats->negative_entries += shard->rings[RIAK_CACHE_NEGATIVE].n_entries;
+		stats->hits += shard->hits;
+		stats->negative_hits += shard->negative_hits;
+		stats->misses += shard->misses;
+		stats->coalesced += shard->coalesced;
+		stats->evictions += shard->evictions;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	if(cache->shm != NULL)
+		riak_shm_stats(cache->shm, stats);
+}
+
+int riak_cache_save(RIAK_CACHE * cache, const char * path) {
+	struct riak_cache_file_header hdr;
+	struct riak_cache_record r;
+	struct riak_cache_shard * shard;
+	struct riak_cache_entry * e;
+	size_t len, size = 0, data_len, rec_size, tmp_len;
+	char * buf = NULL, * tmp, * tmp_path;
+	long long now, wall;
+	FILE * f = NULL;
+	int fd, i, ret = 1;
+
+	/* Entries of shared cache are in its file already */
+	if(cache->shm != NULL)
+		return 1;
+
+	/* New file is written aside and renamed over old one, so that crash doesn't leave half of it */
+	tmp_len = strlen(path);
+	if((tmp_path = malloc(tmp_len + 8)) == NULL)
+		return 1;
+	memcpy(tmp_path, path, tmp_len);
+	memcpy(tmp_path + tmp_len, ".XXXXXX", 8);
+	if((fd = mkstemp(tmp_path)) < 0) {
+		free(tmp_path);
+		return 1;
+	}
+	if((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto out;
+	}
+
+	hdr.magic = RIAK_CACHE_FILE_MAGIC;
+	hdr.version = RIAK_CACHE_FILE_VERSION;
+	hdr.n_records = 0;
+	if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out;
+
+	for(i = 0; i < RIAK_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		len = 0;
+		/* Shard is copied to buffer, and written after it is unlocked */
+		pthread_mutex_lock(&shard->lock);
+		now = riak_cache_now();
+		wall = riak_cache_wall();
+		if((e = shard->rings[RIAK_CACHE_POSITIVE].hand) != NULL) {
+			do {
+				if(e->expires <= now || e->obj.value_len >= UINT_MAX) {
+					e = e->ring_next;
+					continue;
+				}
+				memset(&r, 0, sizeof(r));
+				r.expires = wall + (e->expires - now);
+				r.n_siblings = e->obj.n_siblings;
+				r.last_mod = e->obj.last_mod;
+				r.last_mod_usecs = e->obj.last_mod_usecs;
+				r.bucket_len = e->bucket_len;
+				r.key_len = e->key_len;
+				r.value_len = e->obj.value_len;
+				r.content_type_len = e->obj.content_type ? strlen(e->obj.content_type)+1 : 0;
+				r.vtag_len = e->obj.vtag ? strlen(e->obj.vtag)+1 : 0;
+				r.vclock_len = e->obj.vclock ? e->obj.vclock_len : 0;
+				data_len = (size_t)r.bucket_len + r.key_len + r.value_len+1 + r.content_type_len + r.vtag_len + r.vclock_len;
+				rec_size = (sizeof(struct riak_cache_record) + data_len + 7) & ~(size_t)7;
+				if(len + rec_size > size) {
+					if((tmp = realloc(buf, (len + rec_size)*2)) == NULL) {
+						pthread_mutex_unlock(&shard->lock);
+						goto out;
+					}
+					buf = tmp;
+					size = (len + rec_size)*2;
+				}
+				memset(buf + len, 0, rec_size);
+				memcpy(buf + len, &r, sizeof(r));
+				/* Data of entry is laid out as record needs it */
+				memcpy(buf + len + sizeof(r), e->data, data_len);
+				len += rec_size;
+				hdr.n_records++;
+				e = e->ring_next;
+			} while(e != shard->rings[RIAK_CACHE_POSITIVE].hand);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		if(len > 0 && fwrite(buf, 1, len, f) != len)
+			goto out;
+	}
+
+	if(fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fflush(f) == 0 && fsync(fd) == 0)
+		ret = 0;
+
+out:
+	if(f != NULL && fclose(f) != 0)
+		ret = 1;
+	if(ret == 0 && rename(tmp_path, path) != 0)
+		ret = 1;
+	if(ret != 0)
+		unlink(tmp_path);
+	free(tmp_path);
+	free(buf);
+	return ret;
+}
+
+int riak_cache_load(RIAK_CACHE * cache, const char * path) {
+	const struct riak_cache_file_header * hdr;
+	const struct riak_cache_record * rec;
+	const char * p, * end, * data;
+	struct riak_cache_shard * shard;
+	struct riak_cache_entry * e;
+	long long now, wall, remaining;
+	size_t data_len;
+	__uint64_t i, hash;
+	RIAK_OBJECT obj;
+	unsigned int ttl;
+	struct stat st;
+	void * map;
+	int fd, ret = 0;
+
+	if(cache->shm != NULL)
+		return 1;
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct riak_cache_file_header)
+			|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (const struct riak_cache_file_header *)map;
+	if(hdr->magic != RIAK_CACHE_FILE_MAGIC || hdr->version != RIAK_CACHE_FILE_VERSION) {
+		munmap(map, st.st_size);
+		return 1;
+	}
+	p = (const char *)(hdr+1);
+	end = (const char *)map + st.st_size;
+	now = riak_cache_now();
+	wall = riak_cache_wall();
+
+	for(i = 0; i < hdr->n_records; i++) {
+		rec = (const struct riak_cache_record *)p;
+		if(p > end || (size_t)(end - p) < sizeof(struct riak_cache_record)) {
+			ret = 1;
+			break;
+		}
+		data = (const char *)(rec+1);
+		data_len = (size_t)rec->bucket_len + rec->key_len + rec->value_len+1 + rec->content_type_len + rec->vtag_len
+				+ rec->vclock_len;
+		/* Strings must be terminated where record says, so that they can be used as they are */
+		if(data_len > (size_t)(end - data)
+				|| data[rec->bucket_len + rec->key_len + rec->value_len] != '\0'
+				|| (rec->content_type_len > 0 && data[rec->bucket_len + rec->key_len + rec->value_len + rec->content_type_len] != '\0')
+				|| (rec->vtag_len > 0 && data[data_len - rec->vclock_len - 1] != '\0')) {
+			ret = 1;
+			break;
+		}
+		p += (sizeof(struct riak_cache_record) + data_len + 7) & ~(size_t)7;
+
+		/* Entry keeps time it had left, but not more than TTL now set for its bucket */
+		remaining = rec->expires - wall;
+		if(remaining <= 0 || (ttl = riak_cache_ttl(cache, data, rec->bucket_len, 0)) == 0)
+			continue;
+		if(remaining > ttl)
+			remaining = ttl;
+
+		memset(&obj, 0, sizeof(obj));
+		obj.value = (char *)data + rec->bucket_len + rec->key_len;
+		obj.value_len = rec->value_len;
+		if(rec->content_type_len > 0)
+			obj.content_type = obj.value + rec->value_len+1;
+		if(rec->vtag_len > 0)
+			obj.vtag = obj.value + rec->value_len+1 + rec->content_type_len;
+		if(rec->vclock_len > 0)
+			obj.vclock = obj.value + rec->value_len+1 + rec->content_type_len + rec->vtag_len;
+		obj.vclock_len = rec->vclock_len;
+		obj.last_mod = rec->last_mod;
+		obj.last_mod_usecs = rec->last_mod_usecs;
+		obj.n_siblings = rec->n_siblings;
+
+		hash = riak_cache_hash(data, rec->bucket_len, data + rec->bucket_len, rec->key_len);
+		shard = riak_cache_shard(cache, hash);
+		if((e = riak_cache_entry_new(hash, data, rec->bucket_len, data + rec->bucket_len, rec->key_len, &obj,
+				now + remaining, riak_cache_limit(shard, RIAK_CACHE_POSITIVE))) != NULL)
+			riak_cache_insert(shard, e, NULL);
+	}
+
+	munmap(map, st.st_size);
+	return ret;
+}
+
+void riak_cache_free(RIAK_CACHE * cache) {
+	size_t i;
+
+	if(cache == NULL)
+		return;
+	if(cache->shm != NULL) {
+		/* Entries are left for other processes */
+		riak_shm_close(cache->shm);
+		cache->shm = NULL;
+	}
+	riak_cache_clear(cache);
+	for(i = 0; i < RIAK_CACHE_SHARDS; i++) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].table);
+	}
+	for(i = 0; i < cache->n_ttls; i++)
+		free(cache->ttls[i].bucket);
+	free(cache->ttls);
+	pthread_rwlock_destroy(&cache->ttl_lock);
+	free(cache);
+}
@@ -0,0 +1,75 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakcache.h
+ *
+ * Internal interface of object cache used by get functions. Not installed.
+ */
+
+#ifndef __RIAKCACHE_H__
+
+#define __RIAKCACHE_H__
+
+#include "riakdrv.h"
+
+/** Object isn't known to cache. */
+#define RIAK_CACHE_MISS 0
+/** Cached object was returned. */
+#define RIAK_CACHE_HIT 1
+/** Object is known not to exist. */
+#define RIAK_CACHE_ABSENT 2
+
+/**
+ * \brief Handed out by riak_cache_lookup on miss; passed to riak_cache_store or riak_cache_fail with result of get.
+ */
+typedef struct {
+	/** Invalidation epoch of shard at time of miss. */
+	unsigned int epoch;
+	/** Get led by caller, which other threads missing the same object wait for; NULL if there is none. */
+	struct riak_cache_flight * flight;
+} RIAK_CACHE_TICKET;
+
+/** \fn int riak_cache_lookup(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT ** obj, int coalesce, RIAK_CACHE_TICKET * ticket)
+ *  \brief Looks object up in cache.
+ *
+ *  If object isn't cached, but other thread is already getting it, waits for that get and returns its result.
+ *  Otherwise caller becomes leader of get which later callers wait for. Either way, on miss caller must finish
+ *  its get with riak_cache_store or riak_cache_fail.
+ *
+ *  @param obj on hit, set to newly allocated copy of object (to be freed with riak_object_free)
+ *  @param coalesce if 0, caller neither waits for other gets nor lets others wait for its own
+ *  @param ticket on miss, filled with data which should be passed to riak_cache_store or riak_cache_fail
+ *
+ *  @return RIAK_CACHE_HIT, RIAK_CACHE_ABSENT or RIAK_CACHE_MISS (also when entry expired)
+ */
+int riak_cache_lookup(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj, int coalesce, RIAK_CACHE_TICKET * ticket);
+
+/** \fn void riak_cache_store(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const RIAK_OBJECT * obj, RIAK_CACHE_TICKET * ticket)
+ *  \brief Puts copy of fetched object, or not-found result if obj is NULL, into cache and hands it to waiting threads.
+ *
+ *  Object isn't stored if something was invalidated in its part of cache since riak_cache_lookup filled ticket,
+ *  because it might be older than the write which caused invalidation.
+ */
+void riak_cache_store(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const RIAK_OBJECT * obj, RIAK_CACHE_TICKET * ticket);
+
+/** \fn void riak_cache_fail(RIAK_CACHE * cache, RIAK_CACHE_TICKET * ticket)
+ *  \brief Reports that get failed. Threads waiting for it send their own requests.
+ */
+void riak_cache_fail(RIAK_CACHE * cache, RIAK_CACHE_TICKET * ticket);
+
+#endif
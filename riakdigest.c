@@ -0,0 +1,170 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakdigest.c
+ *
+ * Table of hashes of values last written, used to skip puts which wouldn't change anything.
+ *
+ * Table is direct-mapped: every object has exactly one slot (chosen by hash of bucket and key), holding
+ * full hash of bucket and key and hash of value. Object using the same slot simply replaces previous one,
+ * so memory use is fixed (16 bytes per slot). Slots are guarded by striped locks, so that slot is never
+ * seen half-written - mismatched hashes could make a changed value look unchanged.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "riakdrv.h"
+#include "riakdigest.h"
+
+/** Number of locks guarding slots; must be power of two. */
+#define RIAK_DIGEST_LOCKS 64
+
+/**
+ * \brief Slot of table.
+ */
+struct riak_digest_slot {
+	/** Hash of bucket and key; 0 if slot is empty. */
+	__uint64_t key_hash;
+	/** Hash of value. */
+	__uint64_t value_hash;
+};
+
+struct riak_digests {
+	/** Slots; number is power of two. */
+	struct riak_digest_slot * slots;
+	/** Number of slots minus one. */
+	size_t mask;
+	/** Lock of slot i is locks[i % RIAK_DIGEST_LOCKS]. */
+	pthread_mutex_t locks[RIAK_DIGEST_LOCKS];
+};
+
+/**	\fn __uint64_t riak_digest_mix(__uint64_t h)
+ * 	\brief Final mixing of hash, so that all bits depend on all input bits.
+ */
+static inline __uint64_t riak_digest_mix(__uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**	\fn __uint64_t riak_digest_key(const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Hash of bucket and key; never 0, which marks empty slot.
+ */
+static inline __uint64_t riak_digest_key(const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t h = riak_digest_value(bucket, bucket_len);
+
+	h = riak_digest_mix(h ^ riak_digest_value(key, key_len) ^ ((__uint64_t)bucket_len << 32));
+	return h != 0 ? h : 1;
+}
+
+__uint64_t riak_digest_value(const char * data, size_t len) {
+	__uint64_t h = 0x9E3779B97F4A7C15ULL ^ len, w;
+
+	/* 8 bytes per step; values may be large, so this is the part which matters */
+	while(len >= 8) {
+		memcpy(&w, data, 8);
+		h = (h ^ riak_digest_mix(w)) * 0x9E3779B97F4A7C15ULL;
+		h = (h << 31) | (h >> 33);
+		data += 8;
+		len -= 8;
+	}
+	w = 0;
+	memcpy(&w, data, len);
+	h = (h ^ riak_digest_mix(w)) * 0x9E3779B97F4A7C15ULL;
+
+	return riak_digest_mix(h);
+}
+
+RIAK_DIGESTS * riak_digests_new(size_t n_keys) {
+	RIAK_DIGESTS * digests;
+	size_t size = 64;
+	int i;
+
+	while(size < n_keys)
+		size *= 2;
+
+	if((digests = malloc(sizeof(RIAK_DIGESTS))) == NULL)
+		return NULL;
+	if((digests->slots = calloc(size, sizeof(struct riak_digest_slot))) == NULL) {
+		free(digests);
+		return NULL;
+	}
+	digests->mask = size-1;
+	for(i = 0; i < RIAK_DIGEST_LOCKS; i++)
+		pthread_mutex_init(&digests->locks[i], NULL);
+
+	return digests;
+}
+
+int riak_digest_same(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		__uint64_t value_hash) {
+	__uint64_t key_hash = riak_digest_key(bucket, bucket_len, key, key_len);
+	size_t i = key_hash & digests->mask;
+	int same;
+
+	pthread_mutex_lock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+	same = digests->slots[i].key_hash == key_hash && digests->slots[i].value_hash == value_hash;
+	pthread_mutex_unlock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+
+	return same;
+}
+
+void riak_digest_set(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		__uint64_t value_hash) {
+	__uint64_t key_hash = riak_digest_key(bucket, bucket_len, key, key_len);
+	size_t i = key_hash & digests->mask;
+
+	pthread_mutex_lock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+	digests->slots[i].key_hash = key_hash;
+	digests->slots[i].value_hash = value_hash;
+	pthread_mutex_unlock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+}
+
+void riak_digest_forget(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t key_hash = riak_digest_key(bucket, bucket_len, key, key_len);
+	size_t i = key_hash & digests->mask;
+
+	pthread_mutex_lock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+	if(digests->slots[i].key_hash == key_hash)
+		digests->slots[i].key_hash = 0;
+	pthread_mutex_unlock(&digests->locks[i & (RIAK_DIGEST_LOCKS-1)]);
+}
+
+void riak_digests_clear(RIAK_DIGESTS * digests) {
+	int i;
+
+	for(i = 0; i < RIAK_DIGEST_LOCKS; i++)
+		pthread_mutex_lock(&digests->locks[i]);
+	memset(digests->slots, 0, (digests->mask+1)*sizeof(struct riak_digest_slot));
+	for(i = RIAK_DIGEST_LOCKS-1; i >= 0; i--)
+		pthread_mutex_unlock(&digests->locks[i]);
+}
+
+void riak_digests_free(RIAK_DIGESTS * digests) {
+	int i;
+
+	if(digests == NULL)
+		return;
+	for(i = 0; i < RIAK_DIGEST_LOCKS; i++)
+		pthread_mutex_destroy(&digests->locks[i]);
+	free(digests->slots);
+	free(digests);
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakdigest.h
+ *
+ * Internal interface of table of value hashes used by put and get functions. Not installed.
+ */
+
+#ifndef __RIAKDIGEST_H__
+
+#define __RIAKDIGEST_H__
+
+#include "riakdrv.h"
+
+/** \fn __uint64_t riak_digest_value(const char * data, size_t len)
+ *  \brief Returns hash of value.
+ */
+__uint64_t riak_digest_value(const char * data, size_t len);
+
+/** \fn int riak_digest_same(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len, __uint64_t value_hash)
+ *  \brief Checks whether value of given hash was the last one written for object.
+ *
+ *  @return 1 if it was, 0 if value differs or object isn't known
+ */
+int riak_digest_same(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		__uint64_t value_hash);
+
+/** \fn void riak_digest_set(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len, __uint64_t value_hash)
+ *  \brief Remembers hash of value written for object, possibly replacing other object.
+ */
+void riak_digest_set(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		__uint64_t value_hash);
+
+/** \fn void riak_digest_forget(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Forgets value of object, e.g. after delete or failed put.
+ */
+void riak_digest_forget(RIAK_DIGESTS * digests, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+#endif
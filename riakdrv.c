@@ -21,30 +21,72 @@
  *      Company: Erlang Solutions Ltd.
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <stdlib.h>
-#include <json/json_tokener.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "riakdrv.h"
+#include "riakhttp.h"
+#include "riakcache.h"
+#include "riakdigest.h"
 
 #include "riakproto/riakmessages.pb-c.h"
 #include "riakproto/riakcodes.h"
 
-/**
- * \brief Helper structure for exchanging data with cURL.
- */
-struct buffered_char {
-	/** Null-terminated string. */
-	char * buffer;
-	/** Current position in buffer */
-	int pointer;
+/** Error messages, indexed by error codes from riakerrors.h. */
+const char * (RIAK_ERR_MSGS[]) = {
+		"Success",
+		/* Errors for riak_init */
+		"Socket creation error",
+		"Can't fetch host name",
+		"Couldn't connect to PB socket",
+		"Couldn't initialize cURL handle",
+		/* Errors for riak_exec_op */
+		"Error when sending data via PB socket",
+		"Error when receiving length of response via PB socket",
+		"Error when receiving command code via PB socket",
+		"Error when receiving command message via PB socket",
+		/* Errors for riak_list_buckets */
+		"Error when fetching bucket list",
+		/* Errors for riak_list_keys */
+		"Error when fetching key list",
+		/* Errors for riak_get */
+		"Error when fetching object",
+		"Object not found",
+		/* Errors for riak_put */
+		"Error when putting object",
+		/* Errors for riak_del */
+		"Error when deleting object",
+		/* Errors for large object I/O */
+		"Buffer too small for object value",
+		"Error when reading or writing file descriptor",
+		/* Errors for HTTP operations */
+		"HTTP request failed",
+		"Error when parsing JSON response",
+		"Request cancelled",
+		/* Transport errors */
+		"Operation not available on any transport of connection",
+		"HTTP module couldn't be loaded",
+		/* Informational codes */
+		"Value unchanged (put skipped or copy still current)"
 };
 
-/** We should initialize cURL only once so this is the flag indicating whether initialization is necessary. */
-int first_time = 1;
+static const RIAK_HTTP_OPS * riak_http(RIAK_CONN * connstruct);
 
 /**	\fn void riak_copy_error(RIAK_CONN * connstruct, RpbErrorResp * errorResp)
  * 	\brief Helper function for copying error message from PB structure to RIAK_CONN.
@@ -69,6 +111,17 @@ void riak_copy_error(RIAK_CONN * connstruct, RpbErrorResp * errorResp) {
 	free(tmp);
 }
 
+/**	\fn ProtobufCBinaryData riak_bin(const char * data, size_t len)
+ * 	\brief Helper function wrapping pointer and length into ProtobufCBinaryData.
+ */
+static inline ProtobufCBinaryData riak_bin(const char * data, size_t len) {
+	ProtobufCBinaryData bin;
+
+	bin.data = (__uint8_t *)data;
+	bin.len = len;
+	return bin;
+}
+
 RIAK_CONN * riak_init(char * hostname, int pb_port, int curl_port, RIAK_CONN * connstruct) {
 	int sockfd;
 	struct sockaddr_in serv_addr;
@@ -76,11 +129,14 @@ RIAK_CONN * riak_init(char * hostname, int pb_port, int curl_port, RIAK_CONN * c
 
 	char * buffer;
 
-	if(connstruct == NULL)
-		connstruct = malloc(sizeof(RIAK_CONN));
+	if(connstruct == NULL && (connstruct = malloc(sizeof(RIAK_CONN))) == NULL)
+		return NULL;
 
+	/* Everything riak_close looks at has to be set before first error return */
+	memset(connstruct, 0, sizeof(RIAK_CONN));
 	connstruct->last_error = RERR_OK;
-	connstruct->error_msg = NULL;
+	connstruct->compression = 1;
+	connstruct->coalesce = 1;
 
 	/* Protocol Buffers part */
 	if(pb_port != 0) {
@@ -107,47 +163,67 @@ RIAK_CONN * riak_init(char * hostname, int pb_port, int curl_port, RIAK_CONN * c
 		}
 
 		connstruct->socket = sockfd;
-	} else {
-		connstruct->socket = 0;
+		connstruct->transports |= RIAK_TRANSPORT_PB;
 	}
 
-	/* cURL part */
+	/* cURL part - HTTP module and cURL handle are loaded on first HTTP operation */
 	if(curl_port != 0) {
-		if(first_time) {
-			curl_global_init(CURL_GLOBAL_ALL);
-			first_time = 0;
-		}
-
 		buffer = malloc(strlen(hostname)+strlen("http://:")+30);
 		sprintf(buffer, "http://%s:%d", hostname, curl_port);
 		connstruct->addr = malloc(strlen(buffer)+1);
 		strcpy(connstruct->addr, buffer);
 		free(buffer);
-		if((connstruct->curlh = curl_easy_init()) == NULL) {
-			if(connstruct->socket != 0) {
-				close(connstruct->socket);
-				free(connstruct->addr);
-				connstruct->last_error = RERR_CURL_INIT;
-				return connstruct;
-			}
-		}
-	} else {
-		connstruct->addr = NULL;
-		connstruct->curlh = NULL;
+		connstruct->addr_len = strlen(connstruct->addr);
+		connstruct->transports |= RIAK_TRANSPORT_HTTP;
 	}
 	return connstruct;
 }
 
-int riak_exec_op(RIAK_CONN * connstruct, RIAK_OP * command, RIAK_OP * result) {
+/**	\fn int riak_send_raw(RIAK_CONN * connstruct, const char * frame, size_t len)
+ * 	\brief Writes already framed message (length, message code and data) to Protocol Buffers socket.
+ *
+ * @param connstruct connection handle
+ * @param frame complete frame
+ * @param len length of frame
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_send_raw(RIAK_CONN * connstruct, const char * frame, size_t len) {
+	ssize_t n;
+
+	while(len > 0) {
+		n = write(connstruct->socket, frame, len);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			connstruct->last_error = RERR_OP_SEND;
+			return RERR_OP_SEND;
+		}
+		frame += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**	\fn int riak_send_op(RIAK_CONN * connstruct, RIAK_OP * command)
+ * 	\brief Sends Riak operation via Protocol Buffers socket.
+ *
+ * First half of riak_exec_op. Separated because some operations (e.g. listing keys) receive many responses
+ * for single request.
+ *
+ * @param connstruct connection handle
+ * @param command command to be sent to Riak
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_send_op(RIAK_CONN * connstruct, RIAK_OP * command) {
 	__uint32_t length;
-	__uint8_t cmdcode;
-	int n;
+	int err;
 	char * msg;
 
-	connstruct->last_error = RERR_OK;
-
 	/* Preparing message for sending */
-	msg = malloc(4+command->length);
+	msg = riak_buf_alloc(4+command->length);
 	length = htonl(command->length);
 	memcpy(msg, &length, 4);
 
@@ -157,18 +233,32 @@ int riak_exec_op(RIAK_CONN * connstruct, RIAK_OP * command, RIAK_OP * result) {
 		memcpy(msg+5, command->msg, command->length-1);
 
 	/* Sending message! */
-	n = write(connstruct->socket,msg,4+command->length);
-	if (n != 4+command->length) {
-		connstruct->last_error = RERR_OP_SEND;
-		free(msg);
-		return RERR_OP_SEND;
-	}
+	err = riak_send_raw(connstruct, msg, 4+command->length);
+	riak_buf_free(msg);
+
+	return err;
+}
+
+/**	\fn int riak_recv_op(RIAK_CONN * connstruct, RIAK_OP * result)
+ * 	\brief Receives single Riak response via Protocol Buffers socket.
+ *
+ * Second half of riak_exec_op. If result->msg is not NULL, it is freed before receiving new data,
+ * so the same structure can be passed many times in a row.
+ *
+ * @param connstruct connection handle
+ * @param result structure for response
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_recv_op(RIAK_CONN * connstruct, RIAK_OP * result) {
+	__uint32_t length;
+	__uint8_t cmdcode;
+	int n;
 
 	/* Receive response length */
 	n = recv(connstruct->socket, &length, 4, MSG_WAITALL);
 	if (n != 4) {
 		connstruct->last_error = RERR_OP_RECV_LEN;
-		free(msg);
 		return RERR_OP_RECV_LEN;
 	}
 
@@ -179,35 +269,387 @@ int riak_exec_op(RIAK_CONN * connstruct, RIAK_OP * command, RIAK_OP * result) {
 	n = recv(connstruct->socket, &cmdcode, 1, MSG_WAITALL);
 	if (n != 1) {
 		connstruct->last_error = RERR_OP_RECV_OPCODE;
-		free(msg);
 		return RERR_OP_RECV_OPCODE;
 	}
 
 	result->msgcode = cmdcode;
 
 	if(result->msg != NULL) {
-		free(result->msg);
+		riak_buf_free(result->msg);
 		result->msg = NULL;
 	}
 	/* Receive additional data, if such exists. */
 	if(length>1) {
-		result->msg = malloc(length-1);
+		result->msg = riak_buf_alloc(length-1);
 		n = recv(connstruct->socket, result->msg, length-1, MSG_WAITALL);
 		if (n != length-1) {
 			connstruct->last_error = RERR_OP_RECV_DATA;
-			free(msg);
-			free(result->msg);
+			riak_buf_free(result->msg);
+			result->msg = NULL;
 			return RERR_OP_RECV_DATA;
 		}
 	}
 
-	free(msg);
 	return 0;
 }
 
+/**	\fn int riak_pb_required(RIAK_CONN * connstruct)
+ * 	\brief Checks that connection has Protocol Buffers socket, for operations which have no HTTP equivalent.
+ *
+ * Without PB port socket is 0, so request would otherwise be written to and response read from stdin.
+ *
+ * @return 0 if PB is available, not 0 otherwise (RERR_NO_TRANSPORT)
+ */
+static inline int riak_pb_required(RIAK_CONN * connstruct) {
+	if(connstruct->transports & RIAK_TRANSPORT_PB)
+		return 0;
+	connstruct->last_error = RERR_NO_TRANSPORT;
+	return 1;
+}
+
+int riak_exec_op(RIAK_CONN * connstruct, RIAK_OP * command, RIAK_OP * result) {
+	int err;
+
+	connstruct->last_error = RERR_OK;
+	if(riak_pb_required(connstruct))
+		return RERR_NO_TRANSPORT;
+
+	if((err = riak_send_op(connstruct, command)) != 0)
+		return err;
+
+	return riak_recv_op(connstruct, result);
+}
+
+/**	\fn int riak_pb_varint(const __uint8_t * buf, size_t len, size_t * pos, __uint64_t * value)
+ * 	\brief Decodes single Protocol Buffers varint.
+ *
+ * One-byte varints (which are majority of tags and lengths in list responses) are decoded without entering the loop.
+ *
+ * @param buf encoded message
+ * @param len length of message
+ * @param pos position of varint in message; on success it is moved past decoded varint
+ * @param value place where decoded value will be written
+ *
+ * @return 0 if success, 1 if varint is malformed or truncated
+ */
+static inline int riak_pb_varint(const __uint8_t * buf, size_t len, size_t * pos, __uint64_t * value) {
+	size_t p = *pos;
+	__uint64_t v = 0;
+	int shift;
+
+	if(p < len && buf[p] < 0x80) {
+		*value = buf[p];
+		*pos = p+1;
+		return 0;
+	}
+	for(shift = 0; p < len && shift < 64; shift += 7, p++) {
+		v |= (__uint64_t)(buf[p] & 0x7F) << shift;
+		if(buf[p] < 0x80) {
+			*value = v;
+			*pos = p+1;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**	\fn int riak_pb_index_bytes(const __uint8_t * buf, size_t len, __uint32_t field, RIAK_SLICE ** index, size_t * index_size, size_t * n_index, __uint32_t * flags)
+ * 	\brief Builds index of all entries of repeated bytes field in one pass.
+ *
+ * Fast path for responses like RpbListKeysResp and RpbListBucketsResp, which are long runs of one repeated bytes field.
+ * Instead of generic protobuf-c unpack (one allocation and copy per entry) it only records offset and length of
+ * each entry. Other fields are skipped, but for varint fields with number < 32 having non-zero value
+ * bit (1 << field number) is set in flags, so e.g. "done" flag of RpbListKeysResp can be checked.
+ *
+ * Index array is grown when necessary, so it can be reused between calls to avoid reallocations.
+ *
+ * @param buf encoded message
+ * @param len length of message
+ * @param field number of repeated bytes field to index
+ * @param index pointer to index array (may point to NULL)
+ * @param index_size pointer to allocated size of index array (in entries)
+ * @param n_index place where number of found entries will be written
+ * @param flags place where flags of varint fields will be written; may be NULL
+ *
+ * @return 0 if success, 1 if message is malformed
+ */
+static int riak_pb_index_bytes(const __uint8_t * buf, size_t len, __uint32_t field,
+		RIAK_SLICE ** index, size_t * index_size, size_t * n_index, __uint32_t * flags) {
+	size_t pos = 0, n = 0;
+	__uint64_t tag, value;
+	__uint32_t found_flags = 0;
+	__uint8_t short_tag = (field << 3) | 2;
+	RIAK_SLICE * tmp;
+
+	while(pos < len) {
+		/* Fast path: expected field with tag and length encoded in one byte each */
+		if(buf[pos] == short_tag && field < 16 && pos+1 < len && buf[pos+1] < 0x80) {
+			value = buf[pos+1];
+			pos += 2;
+			tag = short_tag;
+		} else {
+			if(riak_pb_varint(buf, len, &pos, &tag) != 0)
+				return 1;
+			switch(tag & 7) {
+			case 0:
+				if(riak_pb_varint(buf, len, &pos, &value) != 0)
+					return 1;
+				if((tag >> 3) < 32 && value != 0)
+					found_flags |= 1u << (tag >> 3);
+				continue;
+			case 1:
+				pos += 8;
+				continue;
+			case 5:
+				pos += 4;
+				continue;
+			case 2:
+				if(riak_pb_varint(buf, len, &pos, &value) != 0)
+					return 1;
+				break;
+			default:
+				return 1;
+			}
+		}
+
+		if(value > len - pos)
+			return 1;
+		if((tag >> 3) == field) {
+			if(n == *index_size) {
+				*index_size = *index_size ? *index_size*2 : 64;
+				tmp = realloc(*index, *index_size*sizeof(RIAK_SLICE));
+				if(tmp == NULL)
+					return 1;
+				*index = tmp;
+			}
+			(*index)[n].offset = pos;
+			(*index)[n].len = value;
+			n++;
+		}
+		pos += value;
+	}
+	if(pos > len)
+		return 1;
+
+	*n_index = n;
+	if(flags != NULL)
+		*flags = found_flags;
+	return 0;
+}
+
+/**	\fn size_t riak_pb_varint_size(__uint64_t value)
+ * 	\brief Returns number of bytes needed to encode value as Protocol Buffers varint.
+ */
+static inline size_t riak_pb_varint_size(__uint64_t value) {
+	size_t n = 1;
+
+	while(value >= 0x80) {
+		value >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/**	\fn size_t riak_pb_put_varint(char * out, __uint64_t value)
+ * 	\brief Encodes Protocol Buffers varint.
+ *
+ * @return number of bytes written
+ */
+static inline size_t riak_pb_put_varint(char * out, __uint64_t value) {
+	size_t n = 0;
+
+	while(value >= 0x80) {
+		out[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+/**	\fn size_t riak_pb_bytes_size(__uint32_t field, size_t len)
+ * 	\brief Returns encoded size of bytes field (tag, length and data).
+ */
+static inline size_t riak_pb_bytes_size(__uint32_t field, size_t len) {
+	return riak_pb_varint_size(field << 3) + riak_pb_varint_size(len) + len;
+}
+
+/**	\fn size_t riak_pb_put_bytes(char * out, __uint32_t field, const char * data, size_t len)
+ * 	\brief Encodes bytes field (tag, length and data).
+ *
+ * @return number of bytes written
+ */
+static inline size_t riak_pb_put_bytes(char * out, __uint32_t field, const char * data, size_t len) {
+	size_t n;
+
+	n = riak_pb_put_varint(out, (field << 3) | 2);
+	n += riak_pb_put_varint(out+n, len);
+	if(len > 0)
+		memcpy(out+n, data, len);
+	return n+len;
+}
+
+/**	\fn size_t riak_pb_put_uint(char * out, __uint32_t field, __uint64_t value)
+ * 	\brief Encodes varint field (tag and value).
+ *
+ * @return number of bytes written
+ */
+static inline size_t riak_pb_put_uint(char * out, __uint32_t field, __uint64_t value) {
+	size_t n;
+
+	n = riak_pb_put_varint(out, field << 3);
+	return n + riak_pb_put_varint(out+n, value);
+}
+
+/**	\fn int riak_check_resp(RIAK_CONN * connstruct, RIAK_OP * result, __uint8_t expected, int err)
+ * 	\brief Checks response of operation which returns no data on success (put, delete etc.).
+ *
+ * If Riak reported an error, its message is copied to connstruct and last_error is set to err.
+ *
+ * @return 0 if response has expected message code, 1 otherwise
+ */
+static int riak_check_resp(RIAK_CONN * connstruct, RIAK_OP * result, __uint8_t expected, int err) {
+	RpbErrorResp * errorResp;
+
+	/* Received correct response */
+	if(result->msgcode == expected)
+		return 0;
+
+	/* Riak reported an error */
+	if(result->msgcode == RPB_ERROR_RESP) {
+		errorResp = rpb_error_resp__unpack(NULL, result->length-1, (__uint8_t *)result->msg);
+
+		connstruct->last_error = err;
+		if(errorResp != NULL) {
+			riak_copy_error(connstruct, errorResp);
+			rpb_error_resp__free_unpacked(errorResp, NULL);
+		}
+	/* Something really bad happened. :( */
+	} else {
+		connstruct->last_error = RERR_UNKNOWN;
+	}
+	return 1;
+}
+
+/**	\fn int riak_written(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int ret)
+ * 	\brief Drops cached copy of object after write or delete made through connection.
+ *
+ * Called when request is finished (also when it failed, because it might have been applied anyway), so that
+ * get running in parallel can't put old value back into cache.
+ *
+ * @param ret result of request
+ *
+ * @return ret
+ */
+static inline int riak_written(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int ret) {
+	if(connstruct->cache != NULL)
+		riak_cache_invalidate(connstruct->cache, bucket, bucket_len, key, key_len);
+	if(connstruct->digests != NULL)
+		riak_digest_forget(connstruct->digests, bucket, bucket_len, key, key_len);
+	return ret;
+}
+
+/**	\fn int riak_deleted(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int ret)
+ * 	\brief Like riak_written, for deletes: if delete succeeded, key is removed from key index.
+ *
+ * @param ret result of request
+ *
+ * @return ret
+ */
+static inline int riak_deleted(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int ret) {
+	riak_written(connstruct, bucket, bucket_len, key, key_len, ret);
+	if(connstruct->key_index != NULL && ret == 0)
+		riak_key_index_remove(connstruct->key_index, bucket, bucket_len, key, key_len);
+	return ret;
+}
+
+/**	\fn int riak_added(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int ret)
+ * 	\brief Like riak_written, for puts: if put succeeded, key is added to filter of existing keys and to key index.
+ *
+ * @param ret result of request
+ *
+ * @return ret
+ */
+static inline int riak_added(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int ret) {
+	riak_written(connstruct, bucket, bucket_len, key, key_len, ret);
+	if(connstruct->key_filter != NULL && ret == 0)
+		riak_key_filter_add(connstruct->key_filter, bucket, bucket_len, key, key_len);
+	if(connstruct->key_index != NULL && ret == 0)
+		riak_key_index_add(connstruct->key_index, bucket, bucket_len, key, key_len);
+	return ret;
+}
+
+/**	\fn int riak_stored(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, __uint64_t value_hash, int ret)
+ * 	\brief Like riak_added, but for puts of value known to caller: if put succeeded, hash of value is remembered.
+ *
+ * @param value_hash hash of value (from riak_unchanged)
+ * @param ret result of request
+ *
+ * @return ret
+ */
+static inline int riak_stored(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		__uint64_t value_hash, int ret) {
+	riak_added(connstruct, bucket, bucket_len, key, key_len, ret);
+	if(connstruct->digests != NULL && ret == 0)
+		riak_digest_set(connstruct->digests, bucket, bucket_len, key, key_len, value_hash);
+	return ret;
+}
+
+/**	\fn RIAK_OBJECT * riak_fetched(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT * obj, RIAK_CACHE_TICKET * ticket)
+ * 	\brief Hands result of get which missed cache to cache and threads waiting for it; may make table of value hashes forget object.
+ *
+ * Object and not-found result are stored; on other errors waiting threads are told to send their own gets.
+ *
+ * @param obj fetched object; NULL if get failed (reason in connstruct->last_error)
+ *
+ * @return obj
+ */
+static inline RIAK_OBJECT * riak_fetched(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key,
+		size_t key_len, RIAK_OBJECT * obj, RIAK_CACHE_TICKET * ticket) {
+	/* Gets never set hashes: response sent before a put finished would replace its hash with stale one. Object which
+	 * differs from remembered value, has siblings (which put of any value must resolve) or is gone is forgotten. */
+	if(connstruct->digests != NULL && (obj != NULL ? obj->n_siblings > 1
+				|| !riak_digest_same(connstruct->digests, bucket, bucket_len, key, key_len, riak_digest_value(obj->value, obj->value_len))
+			: connstruct->last_error == RERR_NOT_FOUND))
+		riak_digest_forget(connstruct->digests, bucket, bucket_len, key, key_len);
+	if(connstruct->cache == NULL)
+		return obj;
+	if(obj != NULL || connstruct->last_error == RERR_NOT_FOUND)
+		riak_cache_store(connstruct->cache, bucket, bucket_len, key, key_len, obj, ticket);
+	else
+		riak_cache_fail(connstruct->cache, ticket);
+	return obj;
+}
+
+/**	\fn RIAK_OBJECT * riak_http_get(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Fetches object via HTTP module, for gets on connection without PB socket.
+ *
+ * @return newly allocated object; NULL on error or if object wasn't found (last_error is RERR_NOT_FOUND then)
+ */
+static RIAK_OBJECT * riak_http_get(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	RIAK_OBJECT * obj = NULL;
+
+	if(!(connstruct->transports & RIAK_TRANSPORT_HTTP)) {
+		connstruct->last_error = RERR_NO_TRANSPORT;
+		return NULL;
+	}
+	if(riak_http(connstruct) == NULL)
+		return NULL;
+	/* Without copy to compare against, server shouldn't answer "not modified"; if it does, there is no object */
+	if((riak_http(connstruct)->get_cond(connstruct, bucket, bucket_len, key, key_len, &obj) != 0 || obj == NULL)
+			&& (connstruct->last_error == RERR_OK || connstruct->last_error == RERR_UNCHANGED))
+		connstruct->last_error = RERR_GET;
+	return obj;
+}
+
 int riak_ping(RIAK_CONN * connstruct) {
 	RIAK_OP command, res;
 
+	if(riak_pb_required(connstruct))
+		return 1;
+
 	command.length = 1;
 	command.msgcode = RPB_PING_REQ;
 	command.msg = NULL;
@@ -223,11 +665,14 @@ int riak_ping(RIAK_CONN * connstruct) {
 
 char ** riak_list_buckets(RIAK_CONN * connstruct, int * n_buckets) {
 	RIAK_OP command, res;
-	RpbListBucketsResp * bucketsResp;
 	RpbErrorResp * errorResp;
-	int i;
+	RIAK_SLICE * index = NULL;
+	size_t index_size = 0, n_index, i;
 	char ** bucketList = NULL;
 
+	if(riak_pb_required(connstruct))
+		return NULL;
+
 	command.length = 1;
 	command.msgcode = RPB_LIST_BUCKETS_REQ;
 	command.msg = NULL;
@@ -240,17 +685,18 @@ char ** riak_list_buckets(RIAK_CONN * connstruct, int * n_buckets) {
 
 	/* Received correct response */
 	if(res.msgcode == RPB_LIST_BUCKETS_RESP) {
-		bucketsResp = rpb_list_buckets_resp__unpack(NULL, res.length-1, res.msg);
-
-		*n_buckets = bucketsResp->n_buckets;
-		bucketList = malloc(*n_buckets*sizeof(char*));
-		for(i=0; i<*n_buckets; i++) {
-			bucketList[i] = malloc(bucketsResp->buckets[i].len+1);
-			memcpy(bucketList[i], bucketsResp->buckets[i].data, bucketsResp->buckets[i].len);
-			bucketList[i][bucketsResp->buckets[i].len] = '\0';
+		if(riak_pb_index_bytes((__uint8_t *)res.msg, res.length-1, 1, &index, &index_size, &n_index, NULL) != 0) {
+			connstruct->last_error = RERR_BUCKET_LIST;
+		} else {
+			*n_buckets = n_index;
+			bucketList = malloc(n_index*sizeof(char*));
+			for(i=0; i<n_index; i++) {
+				bucketList[i] = malloc(index[i].len+1);
+				memcpy(bucketList[i], res.msg+index[i].offset, index[i].len);
+				bucketList[i][index[i].len] = '\0';
+			}
 		}
-
-		rpb_list_buckets_resp__free_unpacked(bucketsResp, NULL);
+		free(index);
 	/* Riak reported an error */
 	} else if(res.msgcode == RPB_ERROR_RESP) {
 		errorResp = rpb_error_resp__unpack(NULL, res.length-1, res.msg);
@@ -264,260 +710,1836 @@ char ** riak_list_buckets(RIAK_CONN * connstruct, int * n_buckets) {
 		connstruct->last_error = RERR_UNKNOWN;
 	}
 
+	riak_buf_free(res.msg);
 	return bucketList;
 }
 
-/** \fn size_t readfunc(void *ptr, size_t size, size_t nmemb, void *userdata)
- * 	\brief Helper function for cURL, reads data from buffer
- *
- * This is helper function for cURL, which takes userdata and ptr (internal field where cURL stores data to be sent)
- * and then copies contents of userdata to ptr. This function assumes that userdata is of type struct buffered_char.
- *
- * @param ptr internal cURL location
- * @param size size of one data piece
- * @param nmemb count of data pieces
- * @param userdata structure from which data should be read
- *
- * @return amount of data copied
- */
-size_t readfunc(void *ptr, size_t size, size_t nmemb, void *userdata) {
-	struct buffered_char * data = (struct buffered_char *)userdata;
-	
-	size_t datalen = (size*nmemb > strlen(data->buffer)-data->pointer) ? strlen(data->buffer)-data->pointer : size*nmemb;
-	if(datalen > 0) memcpy(ptr, data->buffer+data->pointer, datalen);
-	data->pointer += datalen;
-	
-	return datalen;
-}
-
-/** \fn size_t writefunc(void *ptr, size_t size, size_t nmemb, void *userdata)
- * 	\brief Helper function for cURL, writes data to buffer
- *
- * This is helper function for cURL, which takes userdata and ptr (internal field where cURL stores data received)
- * and then copies contents of ptr to userdata. This function assumes that userdata is of type struct buffered_char.
- *
- * @param ptr internal cURL location
- * @param size size of one data piece
- * @param nmemb count of data pieces
- * @param userdata structure to which data should be read
- *
- * @return amount of data copied
- */
-size_t writefunc(void *ptr, size_t size, size_t nmemb, void *userdata) {
-	struct buffered_char * data = (struct buffered_char *)userdata;
-	
-	memcpy(data->buffer+data->pointer, ptr, size*nmemb);
-	data->pointer += size*nmemb;
-
-	return size*nmemb;
+int riak_list_keys_stream(RIAK_CONN * connstruct, char * bucket, riak_keys_callback callback, void * userdata) {
+	return riak_list_keys_stream_len(connstruct, bucket, strlen(bucket), callback, userdata);
 }
 
-int riak_put(RIAK_CONN * connstruct, char * bucket, char * key, char * data) {
-	RpbPutReq putReq;
-	RpbContent content;
-	RpbPutResp * putResp;
+int riak_list_keys_stream_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len,
+		riak_keys_callback callback, void * userdata) {
+	RpbListKeysReq keysReq;
 	RpbErrorResp * errorResp;
-	int reqSize;
+	RIAK_OP command, res;
+	RIAK_SLICE * index = NULL;
+	size_t index_size = 0, n_index;
+	__uint32_t flags = 0;
+	int reqSize, stopped = 0;
 	char * buffer;
-	RIAK_OP command, result;
 
-	rpb_put_req__init(&putReq);
-	rpb_content__init(&content);
+	if(riak_pb_required(connstruct))
+		return 1;
 
-	putReq.bucket.data = bucket;
-	putReq.bucket.len = strlen(bucket);
-	putReq.key.data = key;
-	putReq.key.len = strlen(key);
-	content.value.data = data;
-	content.value.len = strlen(data);
-	content.links = NULL;
-	content.usermeta = NULL;
-	putReq.content = &content;
+	rpb_list_keys_req__init(&keysReq);
+	keysReq.bucket = riak_bin(bucket, bucket_len);
 
-	reqSize = rpb_put_req__get_packed_size(&putReq);
-	buffer = malloc(reqSize);
-	rpb_put_req__pack(&putReq,buffer);
+	reqSize = rpb_list_keys_req__get_packed_size(&keysReq);
+	buffer = riak_buf_alloc(reqSize);
+	rpb_list_keys_req__pack(&keysReq, (__uint8_t *)buffer);
 
-	command.msgcode = RPB_PUT_REQ;
+	command.msgcode = RPB_LIST_KEYS_REQ;
 	command.msg = buffer;
 	command.length = reqSize+1;
-	result.msg = NULL;
+	res.msg = NULL;
 
 	connstruct->last_error = RERR_OK;
 
-	if(riak_exec_op(connstruct, &command, &result)!=0)
+	if(riak_send_op(connstruct, &command) != 0) {
+		riak_buf_free(buffer);
 		return 1;
+	}
+	riak_buf_free(buffer);
 
-	/* Received correct response */
-	if(result.msgcode == RPB_PUT_RESP) {
-		/* not used right now */
-		/*putResp = rpb_put_resp__unpack(NULL, result.length-1, result.msg);
+	/* Riak sends keys in many chunks, last one has "done" flag set */
+	while(!(flags & (1u << 2))) {
+		if(riak_recv_op(connstruct, &res) != 0)
+			break;
 
-		rpb_put_resp__free_unpacked(putResp, NULL);*/
-		/* Riak reported an error */
-	} else if(result.msgcode == RPB_ERROR_RESP) {
-		errorResp = rpb_error_resp__unpack(NULL, result.length-1, result.msg);
+		if(res.msgcode == RPB_LIST_KEYS_RESP) {
+			if(riak_pb_index_bytes((__uint8_t *)res.msg, res.length-1, 1, &index, &index_size, &n_index, &flags) != 0) {
+				/* Stream is out of sync - nothing more can be done with this connection */
+				connstruct->last_error = RERR_KEY_LIST;
+				break;
+			}
+			if(!stopped && n_index > 0)
+				stopped = callback(res.msg, index, n_index, userdata);
+		} else if(res.msgcode == RPB_ERROR_RESP) {
+			errorResp = rpb_error_resp__unpack(NULL, res.length-1, (__uint8_t *)res.msg);
 
-		connstruct->last_error = RERR_BUCKET_LIST;
-		riak_copy_error(connstruct, errorResp);
+			connstruct->last_error = RERR_KEY_LIST;
+			riak_copy_error(connstruct, errorResp);
 
-		rpb_error_resp__free_unpacked(errorResp, NULL);
-		return 1;
-		/* Something really bad happened. :( */
-	} else {
-		connstruct->last_error = RERR_UNKNOWN;
-		return 1;
+			rpb_error_resp__free_unpacked(errorResp, NULL);
+			break;
+		} else {
+			connstruct->last_error = RERR_UNKNOWN;
+			break;
+		}
 	}
 
+	free(index);
+	riak_buf_free(res.msg);
+	return connstruct->last_error != RERR_OK;
+}
+
+/**
+ * \brief Helper structure for collecting keys in riak_list_keys.
+ */
+struct key_collector {
+	/** Concatenated keys, each one null-terminated. */
+	char * data;
+	/** Used size of data. */
+	size_t size;
+	/** Allocated size of data. */
+	size_t alloc;
+	/** Offsets of keys in data; keys may contain null bytes, so they can't be found by scanning data. */
+	size_t * offsets;
+	/** Number of collected keys. */
+	size_t n_keys;
+	/** Allocated size of offsets. */
+	size_t alloc_keys;
+};
+
+/**	\fn int riak_collect_keys(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata)
+ * 	\brief Callback for riak_list_keys_stream which appends keys to struct key_collector.
+ */
+static int riak_collect_keys(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata) {
+	struct key_collector * coll = (struct key_collector *)userdata;
+	size_t i, alloc, needed = 0;
+	size_t * offsets;
+	char * tmp;
+
+	for(i=0; i<n_keys; i++)
+		needed += keys[i].len+1;
+	if(coll->size+needed > coll->alloc) {
+		for(alloc = coll->alloc ? coll->alloc : 4096; coll->size+needed > alloc; alloc *= 2)
+			;
+		if((tmp = realloc(coll->data, alloc)) == NULL)
+			return 1;
+		coll->data = tmp;
+		coll->alloc = alloc;
+	}
+	if(coll->n_keys+n_keys > coll->alloc_keys) {
+		for(alloc = coll->alloc_keys ? coll->alloc_keys : 256; coll->n_keys+n_keys > alloc; alloc *= 2)
+			;
+		if((offsets = realloc(coll->offsets, alloc*sizeof(size_t))) == NULL)
+			return 1;
+		coll->offsets = offsets;
+		coll->alloc_keys = alloc;
+	}
+	for(i=0; i<n_keys; i++) {
+		coll->offsets[coll->n_keys+i] = coll->size;
+		memcpy(coll->data+coll->size, msg+keys[i].offset, keys[i].len);
+		coll->size += keys[i].len;
+		coll->data[coll->size++] = '\0';
+	}
+	coll->n_keys += n_keys;
 	return 0;
 }
 
-void riak_put_json(RIAK_CONN * connstruct, char * bucket, char * key, json_object * elem) {
-	int i;
-	char address[1024];
-	CURLcode res;
-	struct curl_slist * headerlist = NULL;
-	struct buffered_char data;
-	CURL * curl = connstruct->curlh;
-	char * addr = connstruct->addr;
-	
-	if((key == NULL)||(elem == NULL))
-		return;
-	
-	sprintf(address, "http://%s/riak/%s/%s", addr, bucket, key);
-	
-	headerlist = curl_slist_append(headerlist, "Content-type: application/json");
-	
-	data.buffer = (char*)json_object_get_string(elem);
-	data.pointer = 0;
-	
-	curl_easy_setopt(curl, CURLOPT_URL, address);
-	curl_easy_setopt(curl, CURLOPT_PUT, 1L);
-	curl_easy_setopt(curl, CURLOPT_HEADER, 1L);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &data);
-	curl_easy_setopt(curl, CURLOPT_INFILESIZE, strlen(data.buffer));
-	
-	res = curl_easy_perform(curl);
-	
-	curl_slist_free_all(headerlist);
+char ** riak_list_keys(RIAK_CONN * connstruct, char * bucket, int * n_keys) {
+	struct key_collector coll = { NULL, 0, 0, NULL, 0, 0 };
+	char ** keyList;
+	char * p;
+	size_t i;
+
+	if(riak_list_keys_stream(connstruct, bucket, riak_collect_keys, &coll) != 0) {
+		free(coll.data);
+		free(coll.offsets);
+		return NULL;
+	}
+
+	/* Pointers and keys in one block, so user frees everything at once */
+	keyList = malloc(coll.n_keys*sizeof(char*) + coll.size);
+	if(keyList == NULL) {
+		free(coll.data);
+		free(coll.offsets);
+		return NULL;
+	}
+	p = (char *)(keyList+coll.n_keys);
+	if(coll.size > 0)
+		memcpy(p, coll.data, coll.size);
+	for(i=0; i<coll.n_keys; i++)
+		keyList[i] = p+coll.offsets[i];
+	*n_keys = coll.n_keys;
+
+	free(coll.data);
+	free(coll.offsets);
+	return keyList;
 }
 
-json_object ** riak_get_json_mapred(RIAK_CONN * connstruct, char * mapred_statement, int *ret_len) {
-	int i, j, offset, counter, offset_mem;
-	char buffer[4096], retbuffer[4096];
-	char address[1024];
-	char *startp, *endp;
-	CURLcode res;
-	struct curl_slist * headerlist = NULL;
-	struct buffered_char * retdata;
-	json_object ** retTab;
-	CURL * curl = connstruct->curlh;
-	char * addr = connstruct->addr;
-	
-	if((mapred_statement == NULL)||(ret_len == NULL))
-		return;
-	
-	sprintf(address, "http://%s/mapred", addr);
-	
-	headerlist = curl_slist_append(headerlist, "Content-type: application/json");
-	
-	strcpy(buffer, mapred_statement);
-	
-	retdata = malloc(sizeof(struct buffered_char));
-	retdata->buffer = retbuffer;
-	retdata->pointer = 0;
-	
-	curl_easy_setopt(curl, CURLOPT_URL, address);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_HEADER, 1L);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buffer);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, retdata);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-	
-	res = curl_easy_perform(curl);
-	
-	retdata->buffer[retdata->pointer] = '\0';
-	
-	i = strlen(retdata->buffer);
-	for(offset = 0; (retdata->buffer[offset] != '[') && (offset < i); offset++);
-	offset++;
-	offset_mem = offset;
-	*ret_len = 0;
-	while(offset<i) {
-		endp = retdata->buffer+offset;
-		counter = 0;
-		do {
-			if(*endp == '{') counter++;
-			if(*endp == '}') counter--;
-			endp++;
-			offset++;
-		} while((counter > 0)||((*endp != ',')&&(*endp != ']')));
-		offset++;
-		(*ret_len)++;
-	}
-	offset = offset_mem;
-	retTab = calloc(*ret_len, sizeof(json_object*));
-	j=0;
-	while(offset<i) {
-		startp = retdata->buffer+offset;
-		endp = startp;
-		counter = 0;
-		do {
-			if(*endp == '{') counter++;
-			if(*endp == '}') counter--;
-			endp++;
-			offset++;
-		} while((counter > 0)||((*endp != ',')&&(*endp != ']')));
-		strncpy(buffer, startp, endp-startp);
-		buffer[endp-startp] = '\0';
-		retTab[j] = json_tokener_parse(buffer);
-		j++;
-		offset++;
-	}
-	
-	free(retdata);
-	curl_slist_free_all(headerlist);
-	
-	return retTab;
+/** Values of at least this size are sent without copying them into packed message. */
+#define RIAK_ZEROCOPY_MIN (64*1024)
+/** Size of chunks used when file descriptor can't be sent or received with sendfile/splice. */
+#define RIAK_IO_CHUNK (64*1024)
+
+/**	\fn int riak_send_iov(RIAK_CONN * connstruct, struct iovec * iov, int iovcnt)
+ * 	\brief Writes all data described by iov to Protocol Buffers socket. Modifies iov.
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_send_iov(RIAK_CONN * connstruct, struct iovec * iov, int iovcnt) {
+	ssize_t n;
+
+	while(iovcnt > 0) {
+		n = writev(connstruct->socket, iov, iovcnt);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			connstruct->last_error = RERR_OP_SEND;
+			return RERR_OP_SEND;
+		}
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
 }
 
-char * riak_get_raw_rs(RIAK_CONN * connstruct, char * query) {
-	int i, j, offset, counter, offset_mem;
-	char * retbuffer;
-	char address[1024];
-	CURLcode res;
-	struct buffered_char * retdata;
-	CURL * curl = connstruct->curlh;
-	char * addr = connstruct->addr;
-	
-	if(!query)
-		return;
-	
-	sprintf(address, "http://%s/solr/%s", addr, query);
-	
-	retdata = malloc(sizeof(struct buffered_char));
-	retbuffer = malloc(4096*sizeof(char));
-	retdata->buffer = retbuffer;
-	retdata->pointer = 0;
-	
-	curl_easy_setopt(curl, CURLOPT_URL, address);
-	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, retdata);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-	
-	res = curl_easy_perform(curl);
-	
-	retdata->buffer[retdata->pointer] = '\0';
-	
-	return retbuffer;
+/**	\fn int riak_send_fd(RIAK_CONN * connstruct, int fd, off_t offset, size_t len)
+ * 	\brief Writes len bytes from file descriptor to Protocol Buffers socket.
+ *
+ * Uses sendfile where possible, so data doesn't pass through user space. Otherwise (e.g. for pipes)
+ * data is copied in chunks through pool buffer.
+ *
+ * @param connstruct connection handle
+ * @param fd source file descriptor
+ * @param offset offset in file; if negative, data is read from current position of fd
+ * @param len number of bytes to send
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_send_fd(RIAK_CONN * connstruct, int fd, off_t offset, size_t len) {
+	ssize_t n;
+	size_t chunk;
+	char * buffer;
+
+#ifdef __linux__
+	while(len > 0) {
+		n = sendfile(connstruct->socket, fd, offset < 0 ? NULL : &offset, len > 0x7FFFF000 ? 0x7FFFF000 : len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		len -= n;
+	}
+	if(len == 0)
+		return 0;
+	if(n == 0 || (errno != EINVAL && errno != ENOSYS)) {
+		connstruct->last_error = RERR_IO;
+		return RERR_IO;
+	}
+#endif
+
+	buffer = riak_buf_alloc(RIAK_IO_CHUNK);
+	while(len > 0) {
+		chunk = len > RIAK_IO_CHUNK ? RIAK_IO_CHUNK : len;
+		n = offset < 0 ? read(fd, buffer, chunk) : pread(fd, buffer, chunk, offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0) {
+			riak_buf_free(buffer);
+			connstruct->last_error = RERR_IO;
+			return RERR_IO;
+		}
+		if(riak_send_raw(connstruct, buffer, n) != 0) {
+			riak_buf_free(buffer);
+			return RERR_OP_SEND;
+		}
+		if(offset >= 0)
+			offset += n;
+		len -= n;
+	}
+	riak_buf_free(buffer);
+
+	return 0;
 }
 
-void riak_close(RIAK_CONN * connstruct) {
-	curl_easy_cleanup(connstruct->curlh);
+/** Number of delayed puts sent at once, before their responses are read. */
+#define RIAK_PENDING_PIPELINE 32
+/** Number of delayed puts of connection above which all of them are sent. */
+#define RIAK_PENDING_MAX 4096
+/** Initial size of hash table of delayed puts; must be power of two. */
+#define RIAK_PENDING_MIN_TABLE 64
+
+/**
+ * \brief Put delayed by write-behind bucket.
+ */
+struct riak_pending_put {
+	/** Hash of bucket and key. */
+	__uint64_t hash;
+	/** Next put in hash chain. */
+	struct riak_pending_put * chain;
+	/** Previous put in order of arrival. */
+	struct riak_pending_put * prev;
+	/** Next put in order of arrival. */
+	struct riak_pending_put * next;
+	/** Time (monotonic, ms) when put should be sent. Later puts of the same key don't move it. */
+	long long deadline;
+	/** Encoded request (pool buffer); replaced by later puts of the same key. */
+	char * frame;
+	/** Hash of value carried by frame. */
+	__uint64_t value_hash;
+	/** Length of frame. */
+	size_t frame_len;
+	/** Length of bucket name. */
+	size_t bucket_len;
+	/** Length of key. */
+	size_t key_len;
+	/** Bucket name, then key. */
+	char data[];
+};
+
+/**
+ * \brief Delayed puts of connection.
+ */
+struct riak_pending {
+	/** Hash table of puts. */
+	struct riak_pending_put ** table;
+	/** Size of table; power of two. */
+	size_t table_size;
+	/** Number of puts. */
+	size_t n_puts;
+	/** Oldest put. */
+	struct riak_pending_put * head;
+	/** Newest put. */
+	struct riak_pending_put * tail;
+	/** Earliest deadline of puts; LLONG_MAX if there are none. */
+	long long next_deadline;
+	/** Number of delayed puts which failed since last riak_flush. */
+	int failed;
+	/** Error code of last of them. */
+	int error;
+};
+
+/**	\fn long long riak_now_ms(void)
+ * 	\brief Returns monotonic time in milliseconds.
+ */
+static inline long long riak_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**	\fn __uint64_t riak_pending_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief FNV-1a hash of bucket and key.
+ */
+static inline __uint64_t riak_pending_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < bucket_len; i++)
+		hash = (hash ^ (unsigned char)bucket[i]) * 1099511628211ULL;
+	hash = (hash ^ 0xFF) * 1099511628211ULL;
+	for(i = 0; i < key_len; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+/**	\fn struct riak_pending_put ** riak_pending_find(struct riak_pending * p, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Finds delayed put of object.
+ *
+ * @return pointer to link pointing at put; link holding NULL if there is no such put
+ */
+static struct riak_pending_put ** riak_pending_find(struct riak_pending * p, __uint64_t hash,
+		const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	struct riak_pending_put ** link;
+	struct riak_pending_put * e;
+
+	for(link = &p->table[hash & (p->table_size-1)]; (e = *link) != NULL; link = &e->chain) {
+		if(e->hash == hash && e->bucket_len == bucket_len && e->key_len == key_len
+				&& memcmp(e->data, bucket, bucket_len) == 0 && memcmp(e->data+bucket_len, key, key_len) == 0)
+			break;
+	}
+
+	return link;
+}
+
+/**	\fn void riak_pending_remove(struct riak_pending * p, struct riak_pending_put * e)
+ * 	\brief Takes put out of hash table and list (but doesn't free it).
+ */
+static void riak_pending_remove(struct riak_pending * p, struct riak_pending_put * e) {
+	struct riak_pending_put ** link;
+
+	for(link = &p->table[e->hash & (p->table_size-1)]; *link != e; link = &(*link)->chain)
+		;
+	*link = e->chain;
+	if(e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		p->head = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		p->tail = e->prev;
+	p->n_puts--;
+}
+
+/**	\fn void riak_pending_send(RIAK_CONN * connstruct, struct riak_pending_put ** puts, int n)
+ * 	\brief Sends delayed puts (already removed from connection) and frees them.
+ *
+ * All requests are written at once and then responses are read. Failures are counted in connstruct->pending
+ * and reported by riak_flush; connstruct->last_error isn't changed, as put is sent on behalf of other operation.
+ *
+ * @param n number of puts; at most RIAK_PENDING_PIPELINE
+ */
+static void riak_pending_send(RIAK_CONN * connstruct, struct riak_pending_put ** puts, int n) {
+	struct riak_pending * p = connstruct->pending;
+	struct iovec iov[RIAK_PENDING_PIPELINE];
+	int i, broken, failed, saved_error = connstruct->last_error;
+	RIAK_OP result;
+
+	for(i = 0; i < n; i++) {
+		iov[i].iov_base = puts[i]->frame;
+		iov[i].iov_len = puts[i]->frame_len;
+	}
+	broken = riak_send_iov(connstruct, iov, n) != 0;
+
+	for(i = 0; i < n; i++) {
+		result.msg = NULL;
+		/* Once connection breaks, responses of remaining puts can't be read */
+		failed = broken || (broken = riak_recv_op(connstruct, &result) != 0)
+				|| riak_check_resp(connstruct, &result, RPB_PUT_RESP, RERR_PUT) != 0;
+		if(failed) {
+			p->failed++;
+			p->error = connstruct->last_error;
+		}
+		riak_buf_free(result.msg);
+		riak_stored(connstruct, puts[i]->data, puts[i]->bucket_len, puts[i]->data+puts[i]->bucket_len, puts[i]->key_len,
+				puts[i]->value_hash, failed);
+		riak_buf_free(puts[i]->frame);
+		free(puts[i]);
+	}
+
+	connstruct->last_error = saved_error;
+}
+
+/**	\fn void riak_pending_run(RIAK_CONN * connstruct, int all)
+ * 	\brief Sends delayed puts whose window has passed, or all of them if all is set.
+ */
+static void riak_pending_run(RIAK_CONN * connstruct, int all) {
+	struct riak_pending * p = connstruct->pending;
+	struct riak_pending_put * batch[RIAK_PENDING_PIPELINE], * e, * next;
+	long long now, next_deadline = LLONG_MAX;
+	int n = 0;
+
+	if(p == NULL || p->n_puts == 0)
+		return;
+	now = riak_now_ms();
+	if(!all && now < p->next_deadline)
+		return;
+
+	/* Windows of buckets may differ, so puts aren't ordered by deadline */
+	for(e = p->head; e != NULL; e = next) {
+		next = e->next;
+		if(all || e->deadline <= now) {
+			riak_pending_remove(p, e);
+			batch[n++] = e;
+			if(n == RIAK_PENDING_PIPELINE) {
+				riak_pending_send(connstruct, batch, n);
+				n = 0;
+			}
+		} else if(e->deadline < next_deadline) {
+			next_deadline = e->deadline;
+		}
+	}
+	if(n > 0)
+		riak_pending_send(connstruct, batch, n);
+	p->next_deadline = next_deadline;
+}
+
+/**	\fn void riak_pending_check(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int send)
+ * 	\brief Settles delayed put of object before other operation on it, then sends puts whose window has passed.
+ *
+ * @param send if set (for reads), delayed put is sent, so that read sees it; otherwise (for writes, which supersede it)
+ * 		it is dropped
+ */
+static void riak_pending_check(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int send) {
+	struct riak_pending * p = connstruct->pending;
+	struct riak_pending_put ** link, * e;
+
+	if(p == NULL || p->n_puts == 0)
+		return;
+
+	link = riak_pending_find(p, riak_pending_hash(bucket, bucket_len, key, key_len), bucket, bucket_len, key, key_len);
+	if((e = *link) != NULL) {
+		riak_pending_remove(p, e);
+		if(send) {
+			riak_pending_send(connstruct, &e, 1);
+		} else {
+			riak_buf_free(e->frame);
+			free(e);
+		}
+	}
+	riak_pending_run(connstruct, 0);
+}
+
+/**	\fn int riak_pending_add(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len, char * frame, size_t frame_len, __uint64_t value_hash)
+ * 	\brief Delays put made through write-behind bucket, replacing delayed put of the same object if there is one.
+ *
+ * @param frame encoded request (pool buffer); taken over on success
+ * @param value_hash hash of value carried by frame
+ *
+ * @return 0 if put was delayed, 1 if out of memory (put should be sent right away)
+ */
+static int riak_pending_add(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len,
+		char * frame, size_t frame_len, __uint64_t value_hash) {
+	struct riak_pending * p = connstruct->pending;
+	struct riak_pending_put ** link, ** table, * e, * next;
+	__uint64_t hash = riak_pending_hash(bucket->name, bucket->name_len, key, key_len);
+	size_t i;
+
+	if(p == NULL) {
+		if((p = calloc(1, sizeof(struct riak_pending))) == NULL)
+			return 1;
+		if((p->table = calloc(RIAK_PENDING_MIN_TABLE, sizeof(struct riak_pending_put *))) == NULL) {
+			free(p);
+			return 1;
+		}
+		p->table_size = RIAK_PENDING_MIN_TABLE;
+		p->next_deadline = LLONG_MAX;
+		connstruct->pending = p;
+	}
+
+	link = riak_pending_find(p, hash, bucket->name, bucket->name_len, key, key_len);
+	if((e = *link) != NULL) {
+		/* Only the latest value is sent */
+		riak_buf_free(e->frame);
+		e->frame = frame;
+		e->frame_len = frame_len;
+		e->value_hash = value_hash;
+		riak_pending_run(connstruct, 0);
+		return 0;
+	}
+
+	if((e = malloc(sizeof(struct riak_pending_put) + bucket->name_len + key_len)) == NULL)
+		return 1;
+	e->hash = hash;
+	e->deadline = riak_now_ms() + bucket->write_behind_ms;
+	e->frame = frame;
+	e->frame_len = frame_len;
+	e->value_hash = value_hash;
+	e->bucket_len = bucket->name_len;
+	e->key_len = key_len;
+	memcpy(e->data, bucket->name, bucket->name_len);
+	memcpy(e->data+bucket->name_len, key, key_len);
+	e->chain = *link;
+	*link = e;
+	e->prev = p->tail;
+	e->next = NULL;
+	if(p->tail != NULL)
+		p->tail->next = e;
+	else
+		p->head = e;
+	p->tail = e;
+	p->n_puts++;
+	if(e->deadline < p->next_deadline)
+		p->next_deadline = e->deadline;
+
+	if(p->n_puts >= p->table_size && (table = calloc(2*p->table_size, sizeof(struct riak_pending_put *))) != NULL) {
+		for(i = 0; i < p->table_size; i++) {
+			for(e = p->table[i]; e != NULL; e = next) {
+				next = e->chain;
+				e->chain = table[e->hash & (2*p->table_size-1)];
+				table[e->hash & (2*p->table_size-1)] = e;
+			}
+		}
+		free(p->table);
+		p->table = table;
+		p->table_size *= 2;
+	}
+
+	riak_pending_run(connstruct, p->n_puts > RIAK_PENDING_MAX);
+	return 0;
+}
+
+/**	\fn int riak_unchanged(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const char * data, size_t data_len, __uint64_t * value_hash)
+ * 	\brief Checks whether put of value can be skipped, because the same value was last written.
+ *
+ * Put is never skipped while other put of object is delayed, as the delayed value would win.
+ *
+ * @param value_hash set to hash of value, to be passed to riak_stored (0 if connection doesn't use table of hashes)
+ *
+ * @return 1 if put should be skipped (last_error is set to RERR_UNCHANGED), 0 otherwise
+ */
+static int riak_unchanged(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * data, size_t data_len, __uint64_t * value_hash) {
+	*value_hash = 0;
+	if(connstruct->digests == NULL)
+		return 0;
+
+	*value_hash = riak_digest_value(data, data_len);
+	if(connstruct->pending != NULL && connstruct->pending->n_puts > 0
+			&& *riak_pending_find(connstruct->pending, riak_pending_hash(bucket, bucket_len, key, key_len),
+					bucket, bucket_len, key, key_len) != NULL)
+		return 0;
+	if(!riak_digest_same(connstruct->digests, bucket, bucket_len, key, key_len, *value_hash))
+		return 0;
+
+	connstruct->last_error = RERR_UNCHANGED;
+	return 1;
+}
+
+/**	\fn int riak_put_stream(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const char * content_type, size_t content_type_len, const char * data, int fd, off_t offset, size_t len)
+ * 	\brief Puts value from memory or file descriptor without copying it into packed message.
+ *
+ * Protocol Buffers framing is encoded so that value is the last thing in the message: frame header, bucket, key
+ * and RpbContent header are written first, then the value follows straight from its source.
+ *
+ * @param connstruct connection handle
+ * @param bucket name of the bucket
+ * @param bucket_len length of bucket name
+ * @param key key of object
+ * @param key_len length of key
+ * @param content_type content type of value; NULL if not set
+ * @param content_type_len length of content type
+ * @param data value in memory; if NULL value is read from fd
+ * @param fd source file descriptor (used when data is NULL)
+ * @param offset offset in file; if negative, data is read from current position of fd
+ * @param len length of value
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_put_stream(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * content_type, size_t content_type_len, const char * data, int fd, off_t offset, size_t len) {
+	struct iovec iov[2];
+	RIAK_OP result;
+	size_t content_len, msg_len;
+	__uint32_t length;
+	char * header, * p;
+	int ret;
+
+	connstruct->last_error = RERR_OK;
+
+	content_len = riak_pb_bytes_size(1, len);
+	if(content_type != NULL)
+		content_len += riak_pb_bytes_size(2, content_type_len);
+	msg_len = riak_pb_bytes_size(1, bucket_len) + riak_pb_bytes_size(2, key_len) + riak_pb_bytes_size(4, content_len);
+
+	/* Everything except the value itself */
+	header = riak_buf_alloc(5 + msg_len - len);
+	length = htonl(msg_len+1);
+	memcpy(header, &length, 4);
+	header[4] = RPB_PUT_REQ;
+	p = header+5;
+	p += riak_pb_put_bytes(p, 1, bucket, bucket_len);
+	p += riak_pb_put_bytes(p, 2, key, key_len);
+	p += riak_pb_put_varint(p, (4 << 3) | 2);
+	p += riak_pb_put_varint(p, content_len);
+	if(content_type != NULL)
+		p += riak_pb_put_bytes(p, 2, content_type, content_type_len);
+	p += riak_pb_put_varint(p, (1 << 3) | 2);
+	p += riak_pb_put_varint(p, len);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = p - header;
+	iov[1].iov_base = (char *)data;
+	iov[1].iov_len = len;
+
+	if(data != NULL)
+		ret = riak_send_iov(connstruct, iov, 2);
+	else if((ret = riak_send_iov(connstruct, iov, 1)) == 0)
+		ret = riak_send_fd(connstruct, fd, offset, len);
+	riak_buf_free(header);
+	if(ret != 0)
+		return 1;
+
+	result.msg = NULL;
+	if(riak_recv_op(connstruct, &result) != 0)
+		return 1;
+
+	ret = riak_check_resp(connstruct, &result, RPB_PUT_RESP, RERR_PUT);
+
+	riak_buf_free(result.msg);
+	return ret;
+}
+
+/**	\fn int riak_put_bin(RIAK_CONN * connstruct, ProtobufCBinaryData bucket, ProtobufCBinaryData key, ProtobufCBinaryData data, const char * content_type)
+ * 	\brief Common implementation of riak_put, riak_put_len and riak_put_json_len.
+ *
+ * Value is put via Protocol Buffers if connection has PB socket, otherwise via HTTP.
+ *
+ * @param content_type content type of value; NULL if not set
+ */
+static int riak_put_bin(RIAK_CONN * connstruct, ProtobufCBinaryData bucket, ProtobufCBinaryData key, ProtobufCBinaryData data,
+		const char * content_type) {
+	RpbPutReq putReq;
+	RpbContent content;
+	int reqSize, ret;
+	char * buffer;
+	RIAK_OP command, result;
+
+	if(!(connstruct->transports & RIAK_TRANSPORT_PB)) {
+		if(!(connstruct->transports & RIAK_TRANSPORT_HTTP)) {
+			connstruct->last_error = RERR_NO_TRANSPORT;
+			return 1;
+		}
+		if(riak_http(connstruct) == NULL)
+			return 1;
+		return riak_http(connstruct)->put(connstruct, (char *)bucket.data, bucket.len, (char *)key.data, key.len,
+				(char *)data.data, data.len, content_type);
+	}
+
+	/* Big values are written straight from user memory */
+	if(data.len >= RIAK_ZEROCOPY_MIN)
+		return riak_put_stream(connstruct, (char *)bucket.data, bucket.len, (char *)key.data, key.len,
+				content_type, content_type ? strlen(content_type) : 0, (char *)data.data, -1, -1, data.len);
+
+	rpb_put_req__init(&putReq);
+	rpb_content__init(&content);
+
+	putReq.bucket = bucket;
+	putReq.key = key;
+	content.value = data;
+	if(content_type != NULL) {
+		content.has_content_type = 1;
+		content.content_type = riak_bin(content_type, strlen(content_type));
+	}
+	content.links = NULL;
+	content.usermeta = NULL;
+	putReq.content = &content;
+
+	reqSize = rpb_put_req__get_packed_size(&putReq);
+	buffer = riak_buf_alloc(reqSize);
+	rpb_put_req__pack(&putReq, (__uint8_t *)buffer);
+
+	command.msgcode = RPB_PUT_REQ;
+	command.msg = buffer;
+	command.length = reqSize+1;
+	result.msg = NULL;
+
+	connstruct->last_error = RERR_OK;
+
+	if(riak_exec_op(connstruct, &command, &result)!=0) {
+		riak_buf_free(buffer);
+		return 1;
+	}
+	riak_buf_free(buffer);
+
+	ret = riak_check_resp(connstruct, &result, RPB_PUT_RESP, RERR_PUT);
+
+	riak_buf_free(result.msg);
+	return ret;
+}
+
+int riak_put(RIAK_CONN * connstruct, char * bucket, char * key, char * data) {
+	return riak_put_len(connstruct, bucket, strlen(bucket), key, strlen(key), data, strlen(data));
+}
+
+int riak_put_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * data, size_t data_len) {
+	__uint64_t value_hash;
+
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 0);
+	if(riak_unchanged(connstruct, bucket, bucket_len, key, key_len, data, data_len, &value_hash))
+		return 0;
+	return riak_stored(connstruct, bucket, bucket_len, key, key_len, value_hash,
+			riak_put_bin(connstruct, riak_bin(bucket, bucket_len), riak_bin(key, key_len), riak_bin(data, data_len), NULL));
+}
+
+/**	\fn RIAK_OBJECT * riak_parse_get_resp(RIAK_CONN * connstruct, RIAK_OP * result)
+ * 	\brief Converts response for get request into RIAK_OBJECT.
+ *
+ * If object has siblings, only first one is returned.
+ *
+ * @return newly allocated object; NULL on error or if object wasn't found (last_error is RERR_NOT_FOUND then)
+ */
+static RIAK_OBJECT * riak_parse_get_resp(RIAK_CONN * connstruct, RIAK_OP * result) {
+	RpbGetResp * getResp;
+	RpbContent * content;
+	RIAK_OBJECT * obj;
+
+	if(riak_check_resp(connstruct, result, RPB_GET_RESP, RERR_GET) != 0)
+		return NULL;
+
+	getResp = rpb_get_resp__unpack(NULL, result->length > 1 ? result->length-1 : 0, (__uint8_t *)result->msg);
+	if(getResp == NULL) {
+		connstruct->last_error = RERR_GET;
+		return NULL;
+	}
+	if(getResp->n_content == 0) {
+		connstruct->last_error = RERR_NOT_FOUND;
+		rpb_get_resp__free_unpacked(getResp, NULL);
+		return NULL;
+	}
+
+	content = getResp->content[0];
+	obj = calloc(1, sizeof(RIAK_OBJECT));
+	obj->value = malloc(content->value.len+1);
+	memcpy(obj->value, content->value.data, content->value.len);
+	obj->value[content->value.len] = '\0';
+	obj->value_len = content->value.len;
+	if(content->has_content_type) {
+		obj->content_type = malloc(content->content_type.len+1);
+		memcpy(obj->content_type, content->content_type.data, content->content_type.len);
+		obj->content_type[content->content_type.len] = '\0';
+	}
+	if(content->has_vtag) {
+		obj->vtag = malloc(content->vtag.len+1);
+		memcpy(obj->vtag, content->vtag.data, content->vtag.len);
+		obj->vtag[content->vtag.len] = '\0';
+	}
+	obj->last_mod = content->has_last_mod ? content->last_mod : 0;
+	obj->last_mod_usecs = content->has_last_mod_usecs ? content->last_mod_usecs : 0;
+	if(getResp->has_vclock) {
+		obj->vclock = malloc(getResp->vclock.len);
+		memcpy(obj->vclock, getResp->vclock.data, getResp->vclock.len);
+		obj->vclock_len = getResp->vclock.len;
+	}
+	obj->n_siblings = getResp->n_content;
+
+	rpb_get_resp__free_unpacked(getResp, NULL);
+	return obj;
+}
+
+RIAK_OBJECT * riak_get(RIAK_CONN * connstruct, char * bucket, char * key) {
+	return riak_get_len(connstruct, bucket, strlen(bucket), key, strlen(key));
+}
+
+/**	\fn int riak_send_get_req(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Packs and sends get request, without receiving response.
+ *
+ * @return 0 if success, error code > 0 when failure
+ */
+static int riak_send_get_req(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	RpbGetReq getReq;
+	RIAK_OP command;
+	int reqSize, err;
+	char * buffer;
+
+	rpb_get_req__init(&getReq);
+	getReq.bucket = riak_bin(bucket, bucket_len);
+	getReq.key = riak_bin(key, key_len);
+
+	reqSize = rpb_get_req__get_packed_size(&getReq);
+	buffer = riak_buf_alloc(reqSize);
+	rpb_get_req__pack(&getReq, (__uint8_t *)buffer);
+
+	command.msgcode = RPB_GET_REQ;
+	command.msg = buffer;
+	command.length = reqSize+1;
+
+	connstruct->last_error = RERR_OK;
+	err = riak_send_op(connstruct, &command);
+	riak_buf_free(buffer);
+
+	return err;
+}
+
+RIAK_OBJECT * riak_get_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	RIAK_OBJECT * obj = NULL;
+	RIAK_OP result;
+	RIAK_CACHE_TICKET ticket;
+
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 1);
+	if(connstruct->key_filter != NULL && !riak_key_filter_maybe(connstruct->key_filter, bucket, bucket_len, key, key_len)) {
+		connstruct->last_error = RERR_NOT_FOUND;
+		return NULL;
+	}
+	if(connstruct->cache != NULL) {
+		switch(riak_cache_lookup(connstruct->cache, bucket, bucket_len, key, key_len, &obj, connstruct->coalesce, &ticket)) {
+		case RIAK_CACHE_HIT:
+			connstruct->last_error = RERR_OK;
+			return obj;
+		case RIAK_CACHE_ABSENT:
+			connstruct->last_error = RERR_NOT_FOUND;
+			return NULL;
+		}
+	}
+	if(!(connstruct->transports & RIAK_TRANSPORT_PB))
+		return riak_fetched(connstruct, bucket, bucket_len, key, key_len,
+				riak_http_get(connstruct, bucket, bucket_len, key, key_len), &ticket);
+
+	result.msg = NULL;
+	if(riak_send_get_req(connstruct, bucket, bucket_len, key, key_len) != 0 || riak_recv_op(connstruct, &result) != 0)
+		return riak_fetched(connstruct, bucket, bucket_len, key, key_len, NULL, &ticket);
+
+	obj = riak_parse_get_resp(connstruct, &result);
+
+	riak_buf_free(result.msg);
+	return riak_fetched(connstruct, bucket, bucket_len, key, key_len, obj, &ticket);
+}
+
+void riak_object_free(RIAK_OBJECT * obj) {
+	if(obj == NULL)
+		return;
+	free(obj->value);
+	free(obj->content_type);
+	free(obj->vtag);
+	free(obj->vclock);
+	free(obj);
+}
+
+int riak_del(RIAK_CONN * connstruct, char * bucket, char * key) {
+	return riak_del_len(connstruct, bucket, strlen(bucket), key, strlen(key));
+}
+
+int riak_del_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	RpbDelReq delReq;
+	RIAK_OP command, result;
+	int reqSize, ret;
+	char * buffer;
+
+	if(riak_pb_required(connstruct))
+		return 1;
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 0);
+
+	rpb_del_req__init(&delReq);
+	delReq.bucket = riak_bin(bucket, bucket_len);
+	delReq.key = riak_bin(key, key_len);
+
+	reqSize = rpb_del_req__get_packed_size(&delReq);
+	buffer = riak_buf_alloc(reqSize);
+	rpb_del_req__pack(&delReq, (__uint8_t *)buffer);
+
+	command.msgcode = RPB_DEL_REQ;
+	command.msg = buffer;
+	command.length = reqSize+1;
+	result.msg = NULL;
+
+	if(riak_exec_op(connstruct, &command, &result) != 0) {
+		riak_buf_free(buffer);
+		return riak_deleted(connstruct, bucket, bucket_len, key, key_len, 1);
+	}
+	riak_buf_free(buffer);
+
+	ret = riak_check_resp(connstruct, &result, RPB_DEL_RESP, RERR_DEL);
+
+	riak_buf_free(result.msg);
+	return riak_deleted(connstruct, bucket, bucket_len, key, key_len, ret);
+}
+
+RIAK_BUCKET * riak_bucket_new(const char * name, size_t name_len, const RIAK_BUCKET_OPTS * opts) {
+	RIAK_BUCKET * bucket;
+	char * p;
+	size_t ct_len = 0;
+
+	if(opts != NULL && opts->content_type != NULL)
+		ct_len = strlen(opts->content_type);
+
+	bucket = calloc(1, sizeof(RIAK_BUCKET));
+	bucket->name = malloc(name_len+1);
+	memcpy(bucket->name, name, name_len);
+	bucket->name[name_len] = '\0';
+	bucket->name_len = name_len;
+	bucket->write_behind_ms = opts != NULL ? opts->write_behind_ms : 0;
+
+	/* Bucket field is shared by all requests */
+	bucket->prefix_len = riak_pb_bytes_size(1, name_len);
+	bucket->prefix = malloc(bucket->prefix_len);
+	riak_pb_put_bytes(bucket->prefix, 1, name, name_len);
+
+	/* Option fields, each at most 1 tag byte + 5 value bytes. Field order doesn't matter in Protocol Buffers,
+	 * so they can be simply appended after variable part of request. */
+	p = bucket->get_suffix;
+	if(opts != NULL && opts->r != 0)
+		p += riak_pb_put_uint(p, 3, opts->r);
+	bucket->get_suffix_len = p - bucket->get_suffix;
+
+	p = bucket->put_suffix;
+	if(opts != NULL && opts->w != 0)
+		p += riak_pb_put_uint(p, 5, opts->w);
+	if(opts != NULL && opts->dw != 0)
+		p += riak_pb_put_uint(p, 6, opts->dw);
+	bucket->put_suffix_len = p - bucket->put_suffix;
+
+	p = bucket->del_suffix;
+	if(opts != NULL && opts->rw != 0)
+		p += riak_pb_put_uint(p, 3, opts->rw);
+	bucket->del_suffix_len = p - bucket->del_suffix;
+
+	/* Content type goes inside of RpbContent, after value */
+	if(ct_len > 0) {
+		bucket->content_suffix_len = riak_pb_bytes_size(2, ct_len);
+		bucket->content_suffix = malloc(bucket->content_suffix_len);
+		riak_pb_put_bytes(bucket->content_suffix, 2, opts->content_type, ct_len);
+	}
+
+	return bucket;
+}
+
+void riak_bucket_free(RIAK_BUCKET * bucket) {
+	if(bucket == NULL)
+		return;
+	free(bucket->name);
+	free(bucket->prefix);
+	free(bucket->content_suffix);
+	free(bucket);
+}
+
+/**	\fn char * riak_bucket_frame(RIAK_BUCKET * bucket, __uint8_t msgcode, const char * key, size_t key_len, size_t body_len, size_t * frame_len, char ** body)
+ * 	\brief Allocates frame for bucket request and fills its header, bucket field and key field.
+ *
+ * @param bucket bucket handle
+ * @param msgcode message code of request
+ * @param key key of object
+ * @param key_len length of key
+ * @param body_len length of remaining part of request (after key)
+ * @param frame_len place where total length of frame will be written
+ * @param body place where pointer to remaining part of request will be written
+ *
+ * @return newly allocated frame
+ */
+static char * riak_bucket_frame(RIAK_BUCKET * bucket, __uint8_t msgcode, const char * key, size_t key_len,
+		size_t body_len, size_t * frame_len, char ** body) {
+	size_t msg_len;
+	__uint32_t length;
+	char * frame, * p;
+
+	msg_len = bucket->prefix_len + riak_pb_bytes_size(2, key_len) + body_len;
+	frame = riak_buf_alloc(5+msg_len);
+	length = htonl(msg_len+1);
+	memcpy(frame, &length, 4);
+	frame[4] = msgcode;
+	p = frame+5;
+	memcpy(p, bucket->prefix, bucket->prefix_len);
+	p += bucket->prefix_len;
+	p += riak_pb_put_bytes(p, 2, key, key_len);
+
+	*body = p;
+	*frame_len = 5+msg_len;
+	return frame;
+}
+
+RIAK_OBJECT * riak_bucket_get(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len) {
+	RIAK_OBJECT * obj = NULL;
+	RIAK_OP result;
+	size_t frame_len;
+	char * frame, * p;
+	RIAK_CACHE_TICKET ticket;
+
+	connstruct->last_error = RERR_OK;
+
+	riak_pending_check(connstruct, bucket->name, bucket->name_len, key, key_len, 1);
+	if(connstruct->key_filter != NULL
+			&& !riak_key_filter_maybe(connstruct->key_filter, bucket->name, bucket->name_len, key, key_len)) {
+		connstruct->last_error = RERR_NOT_FOUND;
+		return NULL;
+	}
+	if(connstruct->cache != NULL) {
+		switch(riak_cache_lookup(connstruct->cache, bucket->name, bucket->name_len, key, key_len, &obj, connstruct->coalesce, &ticket)) {
+		case RIAK_CACHE_HIT:
+			return obj;
+		case RIAK_CACHE_ABSENT:
+			connstruct->last_error = RERR_NOT_FOUND;
+			return NULL;
+		}
+	}
+	/* Options of bucket are encoded for PB, so HTTP get uses defaults of server */
+	if(!(connstruct->transports & RIAK_TRANSPORT_PB))
+		return riak_fetched(connstruct, bucket->name, bucket->name_len, key, key_len,
+				riak_http_get(connstruct, bucket->name, bucket->name_len, key, key_len), &ticket);
+
+	frame = riak_bucket_frame(bucket, RPB_GET_REQ, key, key_len, bucket->get_suffix_len, &frame_len, &p);
+	memcpy(p, bucket->get_suffix, bucket->get_suffix_len);
+
+	result.msg = NULL;
+	if(riak_send_raw(connstruct, frame, frame_len) != 0 || riak_recv_op(connstruct, &result) != 0) {
+		riak_buf_free(frame);
+		return riak_fetched(connstruct, bucket->name, bucket->name_len, key, key_len, NULL, &ticket);
+	}
+	riak_buf_free(frame);
+
+	obj = riak_parse_get_resp(connstruct, &result);
+
+	riak_buf_free(result.msg);
+	return riak_fetched(connstruct, bucket->name, bucket->name_len, key, key_len, obj, &ticket);
+}
+
+int riak_bucket_put(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len,
+		const char * data, size_t data_len, const char * vclock, size_t vclock_len) {
+	RIAK_OP result;
+	size_t frame_len, content_len, body_len;
+	char * frame, * p;
+	__uint64_t value_hash;
+	int ret;
+
+	connstruct->last_error = RERR_OK;
+	if(riak_pb_required(connstruct))
+		return 1;
+	if(riak_unchanged(connstruct, bucket->name, bucket->name_len, key, key_len, data, data_len, &value_hash))
+		return 0;
+
+	content_len = riak_pb_bytes_size(1, data_len) + bucket->content_suffix_len;
+	body_len = riak_pb_bytes_size(4, content_len) + bucket->put_suffix_len;
+	if(vclock != NULL)
+		body_len += riak_pb_bytes_size(3, vclock_len);
+
+	frame = riak_bucket_frame(bucket, RPB_PUT_REQ, key, key_len, body_len, &frame_len, &p);
+	if(vclock != NULL)
+		p += riak_pb_put_bytes(p, 3, vclock, vclock_len);
+	/* RpbContent header, then value and constant content fields */
+	p += riak_pb_put_varint(p, (4 << 3) | 2);
+	p += riak_pb_put_varint(p, content_len);
+	p += riak_pb_put_bytes(p, 1, data, data_len);
+	if(bucket->content_suffix_len > 0) {
+		memcpy(p, bucket->content_suffix, bucket->content_suffix_len);
+		p += bucket->content_suffix_len;
+	}
+	memcpy(p, bucket->put_suffix, bucket->put_suffix_len);
+
+	if(bucket->write_behind_ms > 0 && riak_pending_add(connstruct, bucket, key, key_len, frame, frame_len, value_hash) == 0)
+		return 0;
+	riak_pending_check(connstruct, bucket->name, bucket->name_len, key, key_len, 0);
+
+	result.msg = NULL;
+	if(riak_send_raw(connstruct, frame, frame_len) != 0 || riak_recv_op(connstruct, &result) != 0) {
+		riak_buf_free(frame);
+		return riak_stored(connstruct, bucket->name, bucket->name_len, key, key_len, value_hash, 1);
+	}
+	riak_buf_free(frame);
+
+	ret = riak_check_resp(connstruct, &result, RPB_PUT_RESP, RERR_PUT);
+
+	riak_buf_free(result.msg);
+	return riak_stored(connstruct, bucket->name, bucket->name_len, key, key_len, value_hash, ret);
+}
+
+int riak_bucket_del(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len) {
+	RIAK_OP result;
+	size_t frame_len;
+	char * frame, * p;
+	int ret;
+
+	connstruct->last_error = RERR_OK;
+	if(riak_pb_required(connstruct))
+		return 1;
+
+	riak_pending_check(connstruct, bucket->name, bucket->name_len, key, key_len, 0);
+
+	frame = riak_bucket_frame(bucket, RPB_DEL_REQ, key, key_len, bucket->del_suffix_len, &frame_len, &p);
+	memcpy(p, bucket->del_suffix, bucket->del_suffix_len);
+
+	result.msg = NULL;
+	if(riak_send_raw(connstruct, frame, frame_len) != 0 || riak_recv_op(connstruct, &result) != 0) {
+		riak_buf_free(frame);
+		return riak_deleted(connstruct, bucket->name, bucket->name_len, key, key_len, 1);
+	}
+	riak_buf_free(frame);
+
+	ret = riak_check_resp(connstruct, &result, RPB_DEL_RESP, RERR_DEL);
+
+	riak_buf_free(result.msg);
+	return riak_deleted(connstruct, bucket->name, bucket->name_len, key, key_len, ret);
+}
+
+int riak_put_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int fd, off_t offset, size_t len) {
+	if(riak_pb_required(connstruct))
+		return 1;
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 0);
+	return riak_added(connstruct, bucket, bucket_len, key, key_len,
+			riak_put_stream(connstruct, bucket, bucket_len, key, key_len, NULL, 0, NULL, fd, offset, len));
+}
+
+/**
+ * \brief Helper structure for parsing Protocol Buffers response while it is being received.
+ *
+ * Small fields are read through internal buffer; big ones (object values) can be received directly to their destination.
+ */
+struct riak_pb_reader {
+	/** Connection which is read. */
+	RIAK_CONN * conn;
+	/** Bytes of message which weren't received from socket yet. */
+	size_t remaining;
+	/** Bytes of message consumed by parser. */
+	size_t consumed;
+	/** Current position in buffer. */
+	size_t pos;
+	/** Length of data in buffer. */
+	size_t len;
+	/** Buffer for small fields. */
+	char buf[4096];
+};
+
+/**	\fn int riak_reader_fill(struct riak_pb_reader * r)
+ * 	\brief Receives next part of message into empty reader buffer.
+ *
+ * @return 0 if success, 1 on error or end of message
+ */
+static int riak_reader_fill(struct riak_pb_reader * r) {
+	ssize_t n;
+
+	if(r->remaining == 0)
+		return 1;
+	do {
+		n = recv(r->conn->socket, r->buf, r->remaining < sizeof(r->buf) ? r->remaining : sizeof(r->buf), 0);
+	} while(n < 0 && errno == EINTR);
+	if(n <= 0) {
+		r->conn->last_error = RERR_OP_RECV_DATA;
+		return 1;
+	}
+	r->pos = 0;
+	r->len = n;
+	r->remaining -= n;
+	return 0;
+}
+
+/**	\fn int riak_reader_varint(struct riak_pb_reader * r, __uint64_t * value)
+ * 	\brief Reads single varint from message.
+ *
+ * @return 0 if success, 1 on error
+ */
+static int riak_reader_varint(struct riak_pb_reader * r, __uint64_t * value) {
+	__uint64_t v = 0;
+	__uint8_t b;
+	int shift;
+
+	for(shift = 0; shift < 64; shift += 7) {
+		if(r->pos == r->len && riak_reader_fill(r) != 0)
+			return 1;
+		b = r->buf[r->pos++];
+		r->consumed++;
+		v |= (__uint64_t)(b & 0x7F) << shift;
+		if(b < 0x80) {
+			*value = v;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**	\fn int riak_reader_read(struct riak_pb_reader * r, char * dest, size_t n)
+ * 	\brief Reads n bytes of message into dest. Bytes which aren't buffered yet are received directly into dest.
+ *
+ * @param r reader
+ * @param dest destination; when NULL bytes are skipped
+ * @param n number of bytes
+ *
+ * @return 0 if success, 1 on error
+ */
+static int riak_reader_read(struct riak_pb_reader * r, char * dest, size_t n) {
+	size_t chunk;
+	ssize_t got;
+
+	if(n > r->len - r->pos + r->remaining)
+		return 1;
+	r->consumed += n;
+
+	chunk = r->len - r->pos < n ? r->len - r->pos : n;
+	if(dest != NULL) {
+		memcpy(dest, r->buf+r->pos, chunk);
+		dest += chunk;
+	}
+	r->pos += chunk;
+	n -= chunk;
+
+	while(n > 0) {
+		if(dest != NULL) {
+			got = recv(r->conn->socket, dest, n, MSG_WAITALL);
+			if(got < 0 && errno == EINTR)
+				continue;
+			if(got <= 0) {
+				r->conn->last_error = RERR_OP_RECV_DATA;
+				return 1;
+			}
+			dest += got;
+			r->remaining -= got;
+			n -= got;
+		} else {
+			if(riak_reader_fill(r) != 0)
+				return 1;
+			chunk = r->len < n ? r->len : n;
+			r->pos = chunk;
+			n -= chunk;
+		}
+	}
+	return 0;
+}
+
+/**	\fn int riak_reader_to_fd(struct riak_pb_reader * r, int fd, size_t n)
+ * 	\brief Moves n bytes of message to file descriptor.
+ *
+ * Buffered bytes are written first, the rest is moved with splice (through a pipe) where possible,
+ * so it never enters user space. Otherwise it goes through reader buffer.
+ *
+ * @return 0 if success, 1 on error
+ */
+static int riak_reader_to_fd(struct riak_pb_reader * r, int fd, size_t n) {
+	size_t chunk;
+	ssize_t got, put;
+	int pipefd[2] = { -1, -1 };
+
+	if(n > r->len - r->pos + r->remaining)
+		return 1;
+	r->consumed += n;
+
+	while(n > 0) {
+		if(r->pos == r->len) {
+#ifdef __linux__
+			if(pipefd[0] < 0 && pipe(pipefd) != 0)
+				pipefd[0] = pipefd[1] = -2;
+			if(pipefd[0] >= 0) {
+				got = splice(r->conn->socket, NULL, pipefd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+				if(got < 0 && errno == EINTR)
+					continue;
+				if(got > 0) {
+					r->remaining -= got;
+					n -= got;
+					while(got > 0) {
+						put = splice(pipefd[0], NULL, fd, NULL, got, SPLICE_F_MOVE | SPLICE_F_MORE);
+						if(put < 0 && errno == EINTR)
+							continue;
+						if(put <= 0)
+							break;
+						got -= put;
+					}
+					if(got == 0)
+						continue;
+					/* Data is stuck in the pipe - stream is broken */
+					r->conn->last_error = RERR_IO;
+					break;
+				}
+				if(got == 0 || errno != EINVAL) {
+					r->conn->last_error = got == 0 ? RERR_OP_RECV_DATA : RERR_IO;
+					break;
+				}
+				/* Destination doesn't support splice - fall back to copying */
+				close(pipefd[0]);
+				close(pipefd[1]);
+				pipefd[0] = pipefd[1] = -2;
+			}
+#endif
+			if(riak_reader_fill(r) != 0)
+				break;
+		}
+		chunk = r->len - r->pos < n ? r->len - r->pos : n;
+		while(chunk > 0) {
+			put = write(fd, r->buf+r->pos, chunk);
+			if(put < 0 && errno == EINTR)
+				continue;
+			if(put <= 0) {
+				r->conn->last_error = RERR_IO;
+				break;
+			}
+			r->pos += put;
+			chunk -= put;
+			n -= put;
+		}
+		if(chunk > 0)
+			break;
+	}
+
+	if(pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	return n != 0;
+}
+
+/**	\fn int riak_reader_skip_field(struct riak_pb_reader * r, __uint64_t tag)
+ * 	\brief Skips value of field with given tag.
+ *
+ * @return 0 if success, 1 on error
+ */
+static int riak_reader_skip_field(struct riak_pb_reader * r, __uint64_t tag) {
+	__uint64_t value;
+
+	switch(tag & 7) {
+	case 0:
+		return riak_reader_varint(r, &value);
+	case 1:
+		return riak_reader_read(r, NULL, 8);
+	case 2:
+		if(riak_reader_varint(r, &value) != 0)
+			return 1;
+		return riak_reader_read(r, NULL, value);
+	case 5:
+		return riak_reader_read(r, NULL, 4);
+	}
+	return 1;
+}
+
+/**	\fn char * riak_reader_string(struct riak_pb_reader * r, size_t * len)
+ * 	\brief Reads bytes field value into newly allocated null-terminated string.
+ *
+ * @return string or NULL on error
+ */
+static char * riak_reader_string(struct riak_pb_reader * r, size_t * len) {
+	__uint64_t value;
+	char * str;
+
+	if(riak_reader_varint(r, &value) != 0 || value > r->len - r->pos + r->remaining)
+		return NULL;
+	str = malloc(value+1);
+	if(riak_reader_read(r, str, value) != 0) {
+		free(str);
+		return NULL;
+	}
+	str[value] = '\0';
+	if(len != NULL)
+		*len = value;
+	return str;
+}
+
+/**	\fn int riak_get_stream(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, char * buf, size_t buf_size, int fd, size_t * value_len, RIAK_OBJECT ** meta)
+ * 	\brief Common implementation of riak_get_into and riak_get_to_fd.
+ *
+ * Response is parsed while it is received, so value of object is never held in memory as a whole
+ * (when fd is used) or is received straight into user buffer.
+ */
+static int riak_get_stream(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		char * buf, size_t buf_size, int fd, size_t * value_len, RIAK_OBJECT ** meta) {
+	struct riak_pb_reader * r;
+	RIAK_OBJECT * obj = NULL;
+	RIAK_OP result;
+	__uint32_t length;
+	__uint64_t tag, value, content_end;
+	__uint8_t cmdcode;
+	int have_content = 0, err = 0;
+
+	if(meta != NULL)
+		*meta = NULL;
+	if(riak_pb_required(connstruct))
+		return 1;
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 1);
+	if(connstruct->key_filter != NULL && !riak_key_filter_maybe(connstruct->key_filter, bucket, bucket_len, key, key_len)) {
+		connstruct->last_error = RERR_NOT_FOUND;
+		return 1;
+	}
+	if(riak_send_get_req(connstruct, bucket, bucket_len, key, key_len) != 0)
+		return 1;
+
+	if(recv(connstruct->socket, &length, 4, MSG_WAITALL) != 4) {
+		connstruct->last_error = RERR_OP_RECV_LEN;
+		return 1;
+	}
+	if(recv(connstruct->socket, &cmdcode, 1, MSG_WAITALL) != 1) {
+		connstruct->last_error = RERR_OP_RECV_OPCODE;
+		return 1;
+	}
+	length = ntohl(length);
+
+	/* Errors are small - receive them in the usual way */
+	if(cmdcode != RPB_GET_RESP) {
+		result.length = length;
+		result.msgcode = cmdcode;
+		result.msg = NULL;
+		if(length > 1) {
+			result.msg = riak_buf_alloc(length-1);
+			if(recv(connstruct->socket, result.msg, length-1, MSG_WAITALL) != length-1) {
+				connstruct->last_error = RERR_OP_RECV_DATA;
+				riak_buf_free(result.msg);
+				return 1;
+			}
+		}
+		riak_check_resp(connstruct, &result, RPB_GET_RESP, RERR_GET);
+		riak_buf_free(result.msg);
+		return 1;
+	}
+
+	r = riak_buf_alloc(sizeof(struct riak_pb_reader));
+	r->conn = connstruct;
+	r->remaining = length-1;
+	r->consumed = r->pos = r->len = 0;
+	if(meta != NULL)
+		obj = calloc(1, sizeof(RIAK_OBJECT));
+
+	while(!err && (r->pos < r->len || r->remaining > 0)) {
+		if(riak_reader_varint(r, &tag) != 0) {
+			err = 1;
+		/* Content of object - only first sibling is returned, others are skipped */
+		} else if(tag == ((1 << 3) | 2) && !have_content) {
+			have_content = 1;
+			if(riak_reader_varint(r, &value) != 0) {
+				err = 1;
+				break;
+			}
+			content_end = r->consumed + value;
+			while(!err && r->consumed < content_end) {
+				if(riak_reader_varint(r, &tag) != 0) {
+					err = 1;
+				} else if(tag == ((1 << 3) | 2)) {
+					if(riak_reader_varint(r, &value) != 0) {
+						err = 1;
+						break;
+					}
+					if(value_len != NULL)
+						*value_len = value;
+					if(obj != NULL)
+						obj->value_len = value;
+					if(buf == NULL) {
+						err = riak_reader_to_fd(r, fd, value);
+					} else if(value > buf_size) {
+						/* Value is skipped, but the rest is received to keep connection in sync */
+						connstruct->last_error = RERR_BUFFER_SMALL;
+						err = riak_reader_read(r, NULL, value);
+					} else {
+						err = riak_reader_read(r, buf, value);
+					}
+				} else if(obj != NULL && tag == ((2 << 3) | 2)) {
+					err = (obj->content_type = riak_reader_string(r, NULL)) == NULL;
+				} else if(obj != NULL && tag == ((5 << 3) | 2)) {
+					err = (obj->vtag = riak_reader_string(r, NULL)) == NULL;
+				} else if(obj != NULL && tag == (7 << 3)) {
+					err = riak_reader_varint(r, &value);
+					obj->last_mod = value;
+				} else if(obj != NULL && tag == (8 << 3)) {
+					err = riak_reader_varint(r, &value);
+					obj->last_mod_usecs = value;
+				} else {
+					err = riak_reader_skip_field(r, tag);
+				}
+			}
+		} else if(obj != NULL && tag == ((2 << 3) | 2)) {
+			err = (obj->vclock = riak_reader_string(r, &obj->vclock_len)) == NULL;
+		} else {
+			if(tag == ((1 << 3) | 2) && obj != NULL)
+				obj->n_siblings++;
+			err = riak_reader_skip_field(r, tag);
+		}
+	}
+	riak_buf_free(r);
+
+	if(err) {
+		/* Remaining part of response can't be found reliably - connection is unusable now */
+		if(connstruct->last_error == RERR_OK)
+			connstruct->last_error = RERR_GET;
+		riak_object_free(obj);
+		return 1;
+	}
+	if(!have_content) {
+		connstruct->last_error = RERR_NOT_FOUND;
+		riak_object_free(obj);
+		return 1;
+	}
+	if(obj != NULL)
+		obj->n_siblings++;
+	if(meta != NULL)
+		*meta = obj;
+
+	return connstruct->last_error != RERR_OK;
+}
+
+int riak_get_into(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		char * buf, size_t buf_size, size_t * value_len, RIAK_OBJECT ** meta) {
+	return riak_get_stream(connstruct, bucket, bucket_len, key, key_len, buf, buf_size, -1, value_len, meta);
+}
+
+int riak_get_to_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int fd, size_t * value_len, RIAK_OBJECT ** meta) {
+	return riak_get_stream(connstruct, bucket, bucket_len, key, key_len, NULL, 0, fd, value_len, meta);
+}
+
+/**	\fn int riak_core_put(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const char * data, size_t data_len, const char * content_type)
+ * 	\brief Put with content type, for HTTP module.
+ */
+static int riak_core_put(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * data, size_t data_len, const char * content_type) {
+	__uint64_t value_hash;
+
+	riak_pending_check(connstruct, bucket, bucket_len, key, key_len, 0);
+	if(riak_unchanged(connstruct, bucket, bucket_len, key, key_len, data, data_len, &value_hash))
+		return 0;
+	return riak_stored(connstruct, bucket, bucket_len, key, key_len, value_hash,
+			riak_put_bin(connstruct, riak_bin(bucket, bucket_len), riak_bin(key, key_len), riak_bin(data, data_len), content_type));
+}
+
+/** Number of PB gets sent by riak_core_get_batch before their responses are read. */
+#define RIAK_GET_PIPELINE 32
+
+/**	\fn int riak_core_get_batch(RIAK_CONN * connstruct, RIAK_CORE_GET * gets, size_t n)
+ * 	\brief Gets many objects for HTTP module, as riak_get_len would get them one by one, but pipelining requests.
+ *
+ * Requests are sent in groups of RIAK_GET_PIPELINE before their responses are read, so whole group costs one
+ * round trip. Groups are bounded, so that neither side blocks on full socket buffer. Delayed puts of group are
+ * sent before its gets, as their responses have to be read first. Cache lookups don't wait for gets of other
+ * threads, which might be waiting for this batch. Responses of all gets which were sent are read even after
+ * failure, so that connection stays in sync; gets after failed group aren't made.
+ *
+ * @return 0 if success (objects which weren't found are NULL), 1 on error (first error in last_error)
+ */
+static int riak_core_get_batch(RIAK_CONN * connstruct, RIAK_CORE_GET * gets, size_t n) {
+	RIAK_CACHE_TICKET tickets[RIAK_GET_PIPELINE];
+	RIAK_CORE_GET * misses[RIAK_GET_PIPELINE], * g;
+	RIAK_OP result;
+	size_t i, j, end, n_misses, n_sent;
+	int broken = 0, error = RERR_OK;
+
+	for(i=0; i<n; i++)
+		gets[i].obj = NULL;
+	if(riak_pb_required(connstruct))
+		return 1;
+
+	for(i=0; i<n && error == RERR_OK; i=end) {
+		end = i+RIAK_GET_PIPELINE < n ? i+RIAK_GET_PIPELINE : n;
+		for(j=i; j<end; j++)
+			riak_pending_check(connstruct, gets[j].bucket, gets[j].bucket_len, gets[j].key, gets[j].key_len, 1);
+		for(j=i, n_misses=0; j<end; j++) {
+			g = &gets[j];
+			if(connstruct->key_filter != NULL
+					&& !riak_key_filter_maybe(connstruct->key_filter, g->bucket, g->bucket_len, g->key, g->key_len))
+				continue;
+			if(connstruct->cache != NULL && riak_cache_lookup(connstruct->cache, g->bucket, g->bucket_len, g->key,
+					g->key_len, &g->obj, 0, &tickets[n_misses]) != RIAK_CACHE_MISS)
+				continue;
+			misses[n_misses++] = g;
+		}
+
+		for(n_sent=0; n_sent<n_misses; n_sent++)
+			if(riak_send_get_req(connstruct, misses[n_sent]->bucket, misses[n_sent]->bucket_len, misses[n_sent]->key,
+					misses[n_sent]->key_len) != 0) {
+				error = connstruct->last_error;
+				break;
+			}
+		for(j=0; j<n_misses; j++) {
+			g = misses[j];
+			result.msg = NULL;
+			if(j < n_sent && !broken && riak_recv_op(connstruct, &result) != 0) {
+				/* Remaining responses can't be found any more */
+				if(error == RERR_OK)
+					error = connstruct->last_error;
+				broken = 1;
+			}
+			if(j >= n_sent || broken) {
+				/* Cache hands failure to waiting threads */
+				connstruct->last_error = error;
+				riak_fetched(connstruct, g->bucket, g->bucket_len, g->key, g->key_len, NULL, &tickets[j]);
+				continue;
+			}
+			g->obj = riak_fetched(connstruct, g->bucket, g->bucket_len, g->key, g->key_len,
+					riak_parse_get_resp(connstruct, &result), &tickets[j]);
+			riak_buf_free(result.msg);
+			/* Hit without object (e.g. deleted meanwhile) is not an error */
+			if(g->obj == NULL && connstruct->last_error != RERR_NOT_FOUND && error == RERR_OK)
+				error = connstruct->last_error;
+		}
+	}
+	connstruct->last_error = error;
+
+	return error != RERR_OK;
+}
+
+/** Functions of core library handed to HTTP module. */
+static const RIAK_CORE_OPS core_ops = {
+	riak_core_put,
+	riak_core_get_batch
+};
+
+/** HTTP module is loaded only once - this guards loading. */
+static pthread_once_t http_once = PTHREAD_ONCE_INIT;
+/** Functions of HTTP module; NULL if it couldn't be loaded. */
+static const RIAK_HTTP_OPS * http_ops = NULL;
+
+/**	\fn void riak_http_load(void)
+ * 	\brief Loads HTTP module. Called once.
+ */
+static void riak_http_load(void) {
+	const RIAK_HTTP_OPS * (*entry)(const RIAK_CORE_OPS *);
+	const RIAK_HTTP_OPS * ops;
+	void * module;
+
+	if((module = dlopen(RIAK_HTTP_MODULE, RTLD_NOW | RTLD_LOCAL)) == NULL)
+		return;
+	*(void **)(&entry) = dlsym(module, RIAK_HTTP_ENTRY_NAME);
+	if(entry == NULL || (ops = entry(&core_ops)) == NULL || ops->version != RIAK_HTTP_OPS_VERSION) {
+		dlclose(module);
+		return;
+	}
+	http_ops = ops;
+}
+
+/**	\fn const RIAK_HTTP_OPS * riak_http(RIAK_CONN * connstruct)
+ * 	\brief Returns functions of HTTP module, loading it on first use.
+ *
+ * @param connstruct connection for error reporting; may be NULL
+ *
+ * @return functions of module; NULL if module couldn't be loaded (RERR_HTTP_MODULE)
+ */
+static const RIAK_HTTP_OPS * riak_http(RIAK_CONN * connstruct) {
+	pthread_once(&http_once, riak_http_load);
+	if(http_ops == NULL && connstruct != NULL)
+		connstruct->last_error = RERR_HTTP_MODULE;
+	return http_ops;
+}
+
+int riak_get_cond(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj) {
+	if(riak_http(connstruct) == NULL)
+		return 1;
+	return http_ops->get_cond(connstruct, bucket, bucket_len, key, key_len, obj);
+}
+
+int riak_put_json(RIAK_CONN * connstruct, char * bucket, char * key, json_object * elem) {
+	if((bucket == NULL)||(key == NULL)||(elem == NULL))
+		return 1;
+
+	return riak_put_json_len(connstruct, bucket, strlen(bucket), key, strlen(key), elem);
+}
+
+int riak_put_json_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		json_object * elem) {
+	if(riak_http(connstruct) == NULL)
+		return 1;
+	return http_ops->put_json_len(connstruct, bucket, bucket_len, key, key_len, elem);
+}
+
+int riak_mapred_json_stream(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, void * userdata) {
+	if(riak_http(connstruct) == NULL)
+		return 1;
+	return http_ops->mapred_json_stream(connstruct, mapred_statement, statement_len, callback, userdata);
+}
+
+json_object ** riak_get_json_mapred(RIAK_CONN * connstruct, char * mapred_statement, int *ret_len) {
+	if(mapred_statement == NULL)
+		return NULL;
+
+	return riak_get_json_mapred_len(connstruct, mapred_statement, strlen(mapred_statement), ret_len);
+}
+
+json_object ** riak_get_json_mapred_len(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, int *ret_len) {
+	if(riak_http(connstruct) == NULL)
+		return NULL;
+	return http_ops->get_json_mapred_len(connstruct, mapred_statement, statement_len, ret_len);
+}
+
+int riak_search_stream(RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, void * userdata, size_t * total) {
+	if(riak_http(connstruct) == NULL)
+		return 1;
+	return http_ops->search_stream(connstruct, query, query_len, callback, userdata, total);
+}
+
+char * riak_get_raw_rs(RIAK_CONN * connstruct, char * query) {
+	if(!query)
+		return NULL;
+
+	return riak_get_raw_rs_len(connstruct, query, strlen(query), NULL);
+}
+
+char * riak_get_raw_rs_len(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len) {
+	if(riak_http(connstruct) == NULL)
+		return NULL;
+	return http_ops->get_raw_rs_len(connstruct, query, query_len, ret_len);
+}
+
+RIAK_LOOP * riak_loop_new(void) {
+	if(riak_http(NULL) == NULL)
+		return NULL;
+	return http_ops->loop_new();
+}
+
+/* Loop exists only if module was loaded, but NULL loop (from failed riak_loop_new) mustn't reach http_ops */
+
+void riak_loop_free(RIAK_LOOP * loop) {
+	if(loop != NULL && http_ops != NULL)
+		http_ops->loop_free(loop);
+}
+
+int riak_loop_add_fd(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata) {
+	if(loop == NULL || http_ops == NULL)
+		return 1;
+	return http_ops->loop_add_fd(loop, fd, events, callback, userdata);
+}
+
+void riak_loop_remove_fd(RIAK_LOOP * loop, int fd) {
+	if(loop != NULL && http_ops != NULL)
+		http_ops->loop_remove_fd(loop, fd);
+}
+
+int riak_loop_run_once(RIAK_LOOP * loop, int timeout_ms) {
+	if(loop == NULL || http_ops == NULL)
+		return -1;
+	return http_ops->loop_run_once(loop, timeout_ms);
+}
+
+int riak_loop_run(RIAK_LOOP * loop) {
+	if(loop == NULL || http_ops == NULL)
+		return 1;
+	return http_ops->loop_run(loop);
+}
+
+int riak_async_mapred(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, riak_done_callback done, void * userdata) {
+	if(riak_http(connstruct) == NULL || loop == NULL)
+		return 1;
+	return http_ops->async_mapred(loop, connstruct, mapred_statement, statement_len, callback, done, userdata);
+}
+
+int riak_async_search(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, riak_done_callback done, void * userdata) {
+	if(riak_http(connstruct) == NULL || loop == NULL)
+		return 1;
+	return http_ops->async_search(loop, connstruct, query, query_len, callback, done, userdata);
+}
+
+RIAK_SEARCH_CURSOR * riak_search_open(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows, int flags) {
+	if(riak_http(connstruct) == NULL)
+		return NULL;
+	return http_ops->search_open(connstruct, index, query, rows, flags);
+}
+
+RIAK_SEARCH_DOC * riak_search_next(RIAK_SEARCH_CURSOR * cursor) {
+	if(cursor == NULL || http_ops == NULL)
+		return NULL;
+	return http_ops->search_next(cursor);
+}
+
+void riak_search_close(RIAK_SEARCH_CURSOR * cursor) {
+	if(cursor != NULL && http_ops != NULL)
+		http_ops->search_close(cursor);
+}
+
+RIAK_MAPRED_CACHE * riak_mapred_cache_new(size_t max_bytes, unsigned int ttl_ms) {
+	if(riak_http(NULL) == NULL)
+		return NULL;
+	return http_ops->mapred_cache_new(max_bytes, ttl_ms);
+}
+
+/* Like loop, cache exists only if module was loaded */
+
+void riak_mapred_cache_clear(RIAK_MAPRED_CACHE * cache) {
+	if(cache != NULL && http_ops != NULL)
+		http_ops->mapred_cache_clear(cache);
+}
+
+void riak_mapred_cache_free(RIAK_MAPRED_CACHE * cache) {
+	if(cache != NULL && http_ops != NULL)
+		http_ops->mapred_cache_free(cache);
+}
+
+int riak_flush(RIAK_CONN * connstruct) {
+	struct riak_pending * p = connstruct->pending;
+
+	connstruct->last_error = RERR_OK;
+	if(p == NULL)
+		return 0;
+
+	riak_pending_run(connstruct, 1);
+	if(p->failed > 0) {
+		connstruct->last_error = p->error;
+		p->failed = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void riak_close(RIAK_CONN * connstruct) {
+	/* Delayed puts are sent before connection goes away */
+	if(connstruct->pending != NULL) {
+		riak_flush(connstruct);
+		free(connstruct->pending->table);
+		free(connstruct->pending);
+	}
+	/* HTTP part exists only if module was loaded */
+	if(connstruct->curlh != NULL)
+		http_ops->close_conn(connstruct);
 	free(connstruct->addr);
-	close(connstruct->socket);
+	/* HTTP-only and failed connections have no socket (and 0 is stdin) */
+	if(connstruct->transports & RIAK_TRANSPORT_PB)
+		close(connstruct->socket);
 	free(connstruct);
 }
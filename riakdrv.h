@@ -33,16 +33,71 @@
 
 /* --------------------------- STRUCTURE DEFINITIONS --------------------------- */
 
+/** Connection has Protocol Buffers socket. */
+#define RIAK_TRANSPORT_PB 1
+/** Connection has cURL handle for HTTP operations. */
+#define RIAK_TRANSPORT_HTTP 2
+
+/** Client-side object cache, see riak_cache_new. */
+typedef struct riak_cache RIAK_CACHE;
+/** Table of hashes of values last written, see riak_digests_new. */
+typedef struct riak_digests RIAK_DIGESTS;
+/** Cache of MapReduce results, see riak_mapred_cache_new. */
+typedef struct riak_mapred_cache RIAK_MAPRED_CACHE;
+/** Bloom filter of existing keys, see riak_key_filter_new. */
+typedef struct riak_key_filter RIAK_KEY_FILTER;
+/** Sorted index of keys of bucket, see riak_key_index_open. */
+typedef struct riak_key_index RIAK_KEY_INDEX;
+
 /**
  * \brief Connection handle structure.
  */
 typedef struct {
 	/** Address of server for cURL in form: http://hostname:port */
 	char * addr;
-	/** cURL handle */
+	/** cURL handle; NULL until first HTTP operation */
 	CURL * curlh;
+	/** Length of addr. */
+	size_t addr_len;
+	/** Buffer where request addresses are built. Always starts with addr. Allocated with curlh. */
+	char * url;
+	/** Allocated size of url. */
+	size_t url_size;
+	/** Prebuilt header list for requests with JSON body. */
+	struct curl_slist * json_headers;
 	/** Socket descriptor for Protocol Buffers connection */
 	int socket;
+	/** Available transports (RIAK_TRANSPORT_* flags). Operations which exist in both APIs use PB when available,
+	 *  HTTP otherwise. Clearing RIAK_TRANSPORT_PB forces HTTP. */
+	int transports;
+	/** Non-zero if MapReduce and search responses may be sent compressed (gzip/deflate). Set by riak_init;
+	 *  clear it for servers on fast local links, where compression costs more CPU than it saves. */
+	int compression;
+	/** Number of worker threads decoding MapReduce results while they arrive; 0 (set by riak_init) decodes them
+	 *  on calling thread. Elements are passed to callbacks in order, on calling thread, either way. */
+	int decode_threads;
+	/** Non-zero (set by riak_init) if get which misses cache, or MapReduce job, identical to one being run
+	 *  by other thread (gets: through the same cache, jobs: on the same server) waits for it and returns its result,
+	 *  instead of being sent again. */
+	int coalesce;
+	/** Object cache used by riak_get_len and riak_bucket_get, and invalidated by writes and deletes made through
+	 *  this connection; NULL (set by riak_init) disables caching. Cache may be shared by many connections. */
+	RIAK_CACHE * cache;
+	/** Puts delayed by write-behind buckets (see RIAK_BUCKET_OPTS.write_behind_ms); NULL until first of them. */
+	struct riak_pending * pending;
+	/** Table of hashes of values last written through connections using it; puts of unchanged values
+	 *  are skipped. NULL (set by riak_init) disables it. Table may be shared by many connections. */
+	RIAK_DIGESTS * digests;
+	/** Cache of MapReduce results used by riak_mapred_json_stream and riak_get_json_mapred; NULL (set by riak_init)
+	 *  disables it. Cache may be shared by many connections. */
+	RIAK_MAPRED_CACHE * mapred_cache;
+	/** Filter of existing keys; gets of keys which it reports absent fail with RERR_NOT_FOUND without request,
+	 *  and keys written through this connection are added to it. NULL (set by riak_init) disables it.
+	 *  Filter may be shared by many connections. */
+	RIAK_KEY_FILTER * key_filter;
+	/** Index of keys of one bucket; keys written to and deleted from that bucket through this connection are added
+	 *  to and removed from it. NULL (set by riak_init) disables it. Index may be shared by many connections. */
+	RIAK_KEY_INDEX * key_index;
 	/** Error code of last operation. Codes can be found in riakerrors.h */
 	int last_error;
 	/** Riak internal error message. Only some operations return this message. Format: "(err code in hex): err msg" */
@@ -63,13 +118,231 @@ typedef struct {
 	char * msg;
 } RIAK_OP;
 
+/**
+ * \brief Reference to single entry inside of received Protocol Buffers message.
+ *
+ * Used by functions which return many entries (like keys or buckets) at once, so that entries don't have
+ * to be copied out of received message one by one.
+ */
+typedef struct {
+	/** Offset of entry data from the beginning of message. */
+	__uint32_t offset;
+	/** Length of entry data. Data is NOT null-terminated! */
+	__uint32_t len;
+} RIAK_SLICE;
+
+/**
+ * \brief Object fetched from Riak.
+ *
+ * All strings are null-terminated. Value is null-terminated too (terminator is not counted in value_len),
+ * but may contain null bytes. Structure should be freed with riak_object_free.
+ */
+typedef struct {
+	/** Value of object. */
+	char * value;
+	/** Length of value. */
+	size_t value_len;
+	/** Content type of value; NULL if not set. */
+	char * content_type;
+	/** Entity tag of value; NULL if not set. */
+	char * vtag;
+	/** Last modification time (seconds part); 0 if not set. */
+	__uint32_t last_mod;
+	/** Last modification time (microseconds part). */
+	__uint32_t last_mod_usecs;
+	/** Opaque vector clock of object; NULL if not set. */
+	char * vclock;
+	/** Length of vector clock. */
+	size_t vclock_len;
+	/** Number of siblings of object. Only first one is returned. */
+	size_t n_siblings;
+} RIAK_OBJECT;
+
+/**
+ * \brief Options of bucket handle.
+ *
+ * Zero/NULL values mean defaults of bucket.
+ */
+typedef struct {
+	/** Read quorum for get requests. */
+	__uint32_t r;
+	/** Write quorum for put requests. */
+	__uint32_t w;
+	/** Durable write quorum for put requests. */
+	__uint32_t dw;
+	/** Quorum for delete requests. */
+	__uint32_t rw;
+	/** Content type of values put via this handle. */
+	const char * content_type;
+	/** If not 0, puts via this handle are delayed by up to this many milliseconds, and puts of the same key
+	 *  within that time are merged into one request carrying the latest value (see riak_flush). */
+	unsigned int write_behind_ms;
+} RIAK_BUCKET_OPTS;
+
+/**
+ * \brief Bucket handle.
+ *
+ * Holds Protocol Buffers encoding of parts which are constant for all requests to one bucket (bucket name and options),
+ * so that every request only encodes key, value and vclock. Handle doesn't depend on connection and may be used with
+ * many connections at once.
+ */
+typedef struct {
+	/** Null-terminated name of the bucket. */
+	char * name;
+	/** Length of name. */
+	size_t name_len;
+	/** Encoded bucket field, common for get, put and delete requests. */
+	char * prefix;
+	/** Length of prefix. */
+	size_t prefix_len;
+	/** Encoded option fields of get request. */
+	char get_suffix[8];
+	/** Length of get_suffix. */
+	size_t get_suffix_len;
+	/** Encoded option fields of put request. */
+	char put_suffix[16];
+	/** Length of put_suffix. */
+	size_t put_suffix_len;
+	/** Encoded option fields of delete request. */
+	char del_suffix[8];
+	/** Length of del_suffix. */
+	size_t del_suffix_len;
+	/** Encoded constant fields of RpbContent (e.g. content type); NULL if none. */
+	char * content_suffix;
+	/** Length of content_suffix. */
+	size_t content_suffix_len;
+	/** Write-behind window of puts in milliseconds; 0 if puts are sent right away. */
+	unsigned int write_behind_ms;
+} RIAK_BUCKET;
+
+/** \brief Callback type for streaming JSON results.
+ *
+ * Called for every element of result array as soon as it is decoded. Callback takes ownership of elem
+ * (it should release it with json_object_put). Callback should return 0 to continue and any other value
+ * to stop - transfer is then aborted.
+ */
+typedef int (*riak_json_callback)(json_object * elem, void * userdata);
+
+/** \brief Callback type for streaming raw HTTP bodies.
+ *
+ * Called for every chunk of body as it arrives. Data is valid only until callback returns.
+ * Callback should return 0 to continue and any other value to stop - transfer is then aborted.
+ */
+typedef int (*riak_data_callback)(const char * data, size_t len, void * userdata);
+
+/** \brief Callback type for completion of asynchronous operations.
+ *
+ * @param error RERR_OK if operation succeeded, error code otherwise (RERR_CANCELLED when loop was freed)
+ * @param userdata pointer given when operation was started
+ */
+typedef void (*riak_done_callback)(int error, void * userdata);
+
+/** \brief Callback type for file descriptors registered in RIAK_LOOP.
+ *
+ * @param fd ready file descriptor
+ * @param revents events which occurred (POLLIN, POLLOUT etc.)
+ * @param userdata pointer given at registration
+ */
+typedef void (*riak_fd_callback)(int fd, short revents, void * userdata);
+
+/**
+ * \brief Event loop for asynchronous operations. Contents are private.
+ *
+ * Loop owns cURL multi handle: sockets and timers of all HTTP requests in flight are registered in it,
+ * together with file descriptors added by user (e.g. PB sockets), so that one thread can drive all of them.
+ */
+typedef struct riak_loop RIAK_LOOP;
+
+/**
+ * \brief Document found by Riak Search, returned by riak_search_next.
+ */
+typedef struct {
+	/** Key of object; NULL if document doesn't contain it. */
+	char * id;
+	/** Index (bucket) of object; NULL if document doesn't contain it. */
+	char * index;
+	/** Score of document; 0 if not returned. */
+	double score;
+	/** Indexed fields of document (borrowed from doc). */
+	json_object * fields;
+	/** Whole document as returned by Solr interface. */
+	json_object * doc;
+	/** Object of hit; only with RIAK_SEARCH_FETCH, NULL if it doesn't exist anymore. */
+	RIAK_OBJECT * object;
+} RIAK_SEARCH_DOC;
+
+/** riak_search_open flag: fetch objects of hits via Protocol Buffers. */
+#define RIAK_SEARCH_FETCH 1
+
+/**
+ * \brief Cursor over Riak Search results. Contents are private.
+ */
+typedef struct riak_search_cursor RIAK_SEARCH_CURSOR;
+
+/** Number of size classes in driver buffer pool (64 bytes to 1 MB). */
+#define RIAK_POOL_CLASSES 15
+
+/**
+ * \brief Occupancy of driver buffer pool.
+ */
+typedef struct {
+	/** Statistics of every size class. */
+	struct {
+		/** Size of buffers in class. */
+		size_t size;
+		/** Buffers currently handed out. */
+		size_t in_use;
+		/** Free buffers kept in depot and thread magazines. */
+		size_t cached;
+		/** Buffers obtained from heap since start. */
+		size_t allocated;
+	} classes[RIAK_POOL_CLASSES];
+	/** Total bytes in buffers handed out from classes. */
+	size_t bytes_in_use;
+	/** Total bytes in free buffers kept by pool. */
+	size_t bytes_cached;
+	/** Bytes in buffers bigger than largest class, allocated directly from heap. */
+	size_t large_bytes_in_use;
+} RIAK_POOL_STATS;
+
+/**
+ * \brief Occupancy and effectiveness of object cache.
+ */
+typedef struct {
+	/** Number of cached objects. */
+	size_t entries;
+	/** Number of cached not-found results. */
+	size_t negative_entries;
+	/** Bytes used by cached objects and not-found results (with their keys and metadata). */
+	size_t bytes;
+	/** Lookups which returned cached object. */
+	unsigned long long hits;
+	/** Lookups which returned cached not-found result. */
+	unsigned long long negative_hits;
+	/** Lookups which didn't find object in cache. */
+	unsigned long long misses;
+	/** Misses which got result of identical get sent by other thread instead of sending their own. */
+	unsigned long long coalesced;
+	/** Objects evicted to make room for new ones. */
+	unsigned long long evictions;
+} RIAK_CACHE_STATS;
+
+/** \brief Callback type for streaming list of keys.
+ *
+ * Called once per received chunk of keys. Key i starts at msg+keys[i].offset and is keys[i].len bytes long.
+ * Both msg and keys are valid only until callback returns. Callback should return 0 to continue receiving keys
+ * and any other value to stop - remaining chunks will be then received and dropped without calling the callback.
+ */
+typedef int (*riak_keys_callback)(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata);
+
 /* --------------------------- FUNCTIONS DEFINITIONS --------------------------- */
 
 /** \fn RIAK_CONN * riak_init(char * hostname, int pb_port, int curl_port, RIAK_CONN * connstruct)
  *  \brief Create new handle.
  *
  * This function creates new Riak handle. It contains both TCP socket for operations using Protocol Buffers
- * and CURL handle for operations like using Riak Search.
+ * and CURL handle for operations like using Riak Search. CURL handle is created on first HTTP operation,
+ * after HTTP module (libriakdrv_http.so) is loaded, so this function doesn't need cURL nor json-c.
  *
  * WARNING!
  * If connstruct!=NULL, this function will assume that it doesn't describe open connection anyway, therefore
@@ -77,6 +350,7 @@ typedef struct {
  *
  * @param hostname string containing address where Riak server can be accessed, e.g. 127.0.0.1
  * @param pb_port port where Protocol Buffers API is available, e.g. 8087; may be 0, in such case PB operations won't be available
+ *        (they fail with RERR_NO_TRANSPORT), while riak_put_len, riak_get_len and riak_bucket_get go via HTTP
  * @param curl_port port where HTTP server is available, e.g. 8089; may be 0, in such case HTTP operations won't be available
  * @param connstruct structure for holding Riak connection data; when NULL - new structure will be allocated
  *
@@ -91,6 +365,9 @@ RIAK_CONN * riak_init(char * hostname, int pb_port, int curl_port, RIAK_CONN * c
  * for socket operations. Ultimately, user shouldn't have to use this function because other functions
  * are to cover all possible operations. Still, probably this function will remain in library API even then.
  *
+ * Message of response (result->msg) is allocated from driver buffer pool. It is released by next call
+ * using the same result structure, or it can be released with riak_buf_free.
+ *
  * @param connstruct connection handle
  * @param command command to be sent to Riak
  * @param result structure for response; this function won't allocate space and won't check if result structure exists!
@@ -123,28 +400,794 @@ int riak_ping(RIAK_CONN * connstruct);
  */
 char ** riak_list_buckets(RIAK_CONN * connstruct, int * n_buckets);
 
-/** \fn void riak_put_json(char * bucket, char * key, json_object * elem)
+/**	\fn int riak_list_keys_stream(RIAK_CONN * connstruct, char * bucket, riak_keys_callback callback, void * userdata)
+ *	\brief Streams list of keys in bucket.
+ *
+ * This function sends list keys request to Riak and passes every received chunk of keys to callback, without copying
+ * keys out of received messages. It is the preferred way of listing large buckets.
+ *
+ * @param connstruct connection handle
+ * @param bucket name of the bucket
+ * @param callback function called for every received chunk of keys
+ * @param userdata pointer passed to callback
+ *
+ * @return 0 if success, not 0 on error
+ */
+int riak_list_keys_stream(RIAK_CONN * connstruct, char * bucket, riak_keys_callback callback, void * userdata);
+
+/**	\fn int riak_list_keys_stream_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, riak_keys_callback callback, void * userdata)
+ *	\brief Binary-safe version of riak_list_keys_stream, bucket name is passed with explicit length.
+ */
+int riak_list_keys_stream_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len,
+		riak_keys_callback callback, void * userdata);
+
+/**	\fn char ** riak_list_keys(RIAK_CONN * connstruct, char * bucket, int * n_keys)
+ *	\brief Fetches list of keys in bucket.
+ *
+ * This function returns array of null-terminated strings containing all keys in bucket. Unlike riak_list_buckets,
+ * array and all strings are allocated as a single memory block, so it should be freed with one free() call.
+ * Keys containing null bytes are cut short by it; riak_list_keys_stream_len passes their lengths.
+ *
+ * @param connstruct connection handle
+ * @param bucket name of the bucket
+ * @param n_keys pointer to integer, where key count will be written
+ *
+ * @return array (of n_keys length) of null-terminated strings; NULL on error
+ */
+char ** riak_list_keys(RIAK_CONN * connstruct, char * bucket, int * n_keys);
+
+/** \fn int riak_put(RIAK_CONN * connstruct, char * bucket, char * key, char * data)
+ *  \brief Puts data into DB via Protocol Buffers.
+ *
+ *  Bucket, key and data are null-terminated strings. For binary data use riak_put_len.
+ *  If connection was opened without Protocol Buffers port, data is put via HTTP.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket for data
+ *  @param key key for passed value
+ *  @param data value to be stored
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_put(RIAK_CONN * connstruct, char * bucket, char * key, char * data);
+
+/** \fn int riak_put_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const char * data, size_t data_len)
+ *  \brief Binary-safe version of riak_put.
+ *
+ *  All arguments are passed with explicit lengths, so they may contain null bytes and are never rescanned.
+ */
+int riak_put_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * data, size_t data_len);
+
+/** \fn RIAK_OBJECT * riak_get(RIAK_CONN * connstruct, char * bucket, char * key)
+ *  \brief Fetches object from DB via Protocol Buffers.
+ *
+ *  If connection was opened without Protocol Buffers port, object is fetched via HTTP.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket
+ *  @param key key of object
+ *
+ *  @return newly allocated object, which should be freed with riak_object_free; NULL on error
+ *  or when object doesn't exist (last_error is RERR_NOT_FOUND then)
+ */
+RIAK_OBJECT * riak_get(RIAK_CONN * connstruct, char * bucket, char * key);
+
+/** \fn RIAK_OBJECT * riak_get_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Binary-safe version of riak_get.
+ */
+RIAK_OBJECT * riak_get_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_object_free(RIAK_OBJECT * obj)
+ *  \brief Frees object returned by riak_get and similar functions. Accepts NULL.
+ */
+void riak_object_free(RIAK_OBJECT * obj);
+
+/** \fn int riak_get_cond(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT ** obj)
+ *  \brief Fetches object via HTTP only if it changed since copy held by caller.
+ *
+ *  If *obj is not NULL, its vtag and last_mod are sent as If-None-Match and If-Modified-Since. When server answers
+ *  304 Not Modified, no body is transferred and *obj is left untouched. Otherwise *obj is freed and replaced
+ *  with fetched object (vtag and last_mod are taken from ETag and Last-Modified headers), so the same pointer
+ *  can be passed to every poll:
+ *
+ *  RIAK_OBJECT * obj = NULL;
+ *  while(polling) { if(riak_get_cond(conn, "b", 1, "k", 1, &obj) == 0 && conn->last_error != RERR_UNCHANGED) reload(obj); ... }
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket
+ *  @param bucket_len length of bucket name
+ *  @param key key of object
+ *  @param key_len length of key
+ *  @param obj in: copy held by caller or NULL; out: current object
+ *
+ *  @return 0 if new version was fetched or copy is still current (last_error is RERR_UNCHANGED then), 1 on error
+ *  (RERR_NOT_FOUND if object doesn't exist)
+ */
+int riak_get_cond(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj);
+
+/** \fn int riak_del(RIAK_CONN * connstruct, char * bucket, char * key)
+ *  \brief Deletes object from DB via Protocol Buffers.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket
+ *  @param key key of object
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_del(RIAK_CONN * connstruct, char * bucket, char * key);
+
+/** \fn int riak_del_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Binary-safe version of riak_del.
+ */
+int riak_del_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn RIAK_BUCKET * riak_bucket_new(const char * name, size_t name_len, const RIAK_BUCKET_OPTS * opts)
+ *  \brief Creates bucket handle.
+ *
+ *  Bucket name and options are encoded once here, so requests made with riak_bucket_get, riak_bucket_put
+ *  and riak_bucket_del only encode their key, value and vclock.
+ *
+ *  @param name name of the bucket
+ *  @param name_len length of name
+ *  @param opts options of requests; may be NULL
+ *
+ *  @return new handle, which should be freed with riak_bucket_free
+ */
+RIAK_BUCKET * riak_bucket_new(const char * name, size_t name_len, const RIAK_BUCKET_OPTS * opts);
+
+/** \fn void riak_bucket_free(RIAK_BUCKET * bucket)
+ *  \brief Frees bucket handle. Accepts NULL.
+ */
+void riak_bucket_free(RIAK_BUCKET * bucket);
+
+/** \fn RIAK_OBJECT * riak_bucket_get(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len)
+ *  \brief Fetches object from bucket described by handle. Works like riak_get_len.
+ */
+RIAK_OBJECT * riak_bucket_get(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len);
+
+/** \fn int riak_bucket_put(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len, const char * data, size_t data_len, const char * vclock, size_t vclock_len)
+ *  \brief Puts object into bucket described by handle.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket bucket handle
+ *  @param key key of object
+ *  @param key_len length of key
+ *  @param data value to be stored
+ *  @param data_len length of value
+ *  @param vclock vector clock of updated object (from RIAK_OBJECT); NULL for new objects
+ *  @param vclock_len length of vector clock
+ *
+ *  @return 0 if success (or put was delayed by write-behind handle), not 0 on error
+ */
+int riak_bucket_put(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len,
+		const char * data, size_t data_len, const char * vclock, size_t vclock_len);
+
+/** \fn int riak_bucket_del(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len)
+ *  \brief Deletes object from bucket described by handle. Works like riak_del_len.
+ */
+int riak_bucket_del(RIAK_CONN * connstruct, RIAK_BUCKET * bucket, const char * key, size_t key_len);
+
+/** \fn int riak_put_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int fd, off_t offset, size_t len)
+ *  \brief Puts value read from file descriptor.
+ *
+ *  Protocol Buffers framing is written around the value and the value itself is sent with sendfile where possible
+ *  (or in small chunks otherwise), so it is never loaded into memory as a whole. Values passed to riak_put_len
+ *  above 64 KB are sent in the same way, straight from user memory.
+ *
+ *  If fd delivers less than len bytes, request can't be completed and connection should be closed.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket
+ *  @param bucket_len length of bucket name
+ *  @param key key of object
+ *  @param key_len length of key
+ *  @param fd file descriptor to read value from
+ *  @param offset offset of value in file; if negative, value is read from current position of fd (e.g. for pipes)
+ *  @param len length of value
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_put_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int fd, off_t offset, size_t len);
+
+/** \fn int riak_get_into(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, char * buf, size_t buf_size, size_t * value_len, RIAK_OBJECT ** meta)
+ *  \brief Fetches value of object straight into user buffer.
+ *
+ *  Response is parsed while it is received and value is received directly into buf, without intermediate copies.
+ *  If value doesn't fit, RERR_BUFFER_SMALL is reported and value_len holds size needed.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param bucket name of the bucket
+ *  @param bucket_len length of bucket name
+ *  @param key key of object
+ *  @param key_len length of key
+ *  @param buf destination buffer (not NULL)
+ *  @param buf_size size of buf
+ *  @param value_len place where length of value will be written; may be NULL
+ *  @param meta place where metadata of object (RIAK_OBJECT with NULL value) will be written; may be NULL
+ *
+ *  @return 0 if success, not 0 on error (RERR_NOT_FOUND if object doesn't exist)
+ */
+int riak_get_into(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		char * buf, size_t buf_size, size_t * value_len, RIAK_OBJECT ** meta);
+
+/** \fn int riak_get_to_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int fd, size_t * value_len, RIAK_OBJECT ** meta)
+ *  \brief Fetches value of object straight into file descriptor.
+ *
+ *  Works like riak_get_into, but value is written to fd - with splice where possible, so memory used doesn't depend
+ *  on size of value.
+ */
+int riak_get_to_fd(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int fd, size_t * value_len, RIAK_OBJECT ** meta);
+
+/** \fn int riak_put_json(RIAK_CONN * connstruct, char * bucket, char * key, json_object * elem)
  *  \brief Puts JSON data into DB.
  *
- *  This function puts JSON data into chosen bucket with certain key.
+ *  This function puts JSON data into chosen bucket with certain key, with content type application/json.
+ *  Data is put via Protocol Buffers if connection has PB socket, via HTTP otherwise.
  *
  *	@param connstruct Riak connection structure
  *  @param bucket name of the bucket for data
  *  @param key key for passed value
  *  @param elem JSON structure which should be inserted
+ *
+ *  @return 0 if success, not 0 on error
  */
+int riak_put_json(RIAK_CONN * connstruct, char * bucket, char * key, json_object * elem);
 
-int riak_put(RIAK_CONN * connstruct, char * bucket, char * key, char * data);
+/** \fn int riak_put_json_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, json_object * elem)
+ *  \brief Binary-safe version of riak_put_json.
+ */
+int riak_put_json_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		json_object * elem);
 
-void riak_put_json(RIAK_CONN * connstruct, char * bucket, char * key, json_object * elem);
+/** \fn int riak_mapred_json_stream(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, riak_json_callback callback, void * userdata)
+ *  \brief Executes MapReduce job via HTTP and streams decoded results.
+ *
+ *  Result array is decoded incrementally while body is received, and each element is passed to callback
+ *  as soon as it is complete. Size of result is not limited by any buffer. If connstruct->decode_threads is set,
+ *  elements are decoded by worker threads and callback gets them (on calling thread, in order) in batches.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param mapred_statement MapReduce job in JSON
+ *  @param statement_len length of statement
+ *  @param callback function called for every element of result
+ *  @param userdata pointer passed to callback
+ *
+ *  @return 0 if success (also when stopped by callback), not 0 on error
+ */
+int riak_mapred_json_stream(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, void * userdata);
 
+/** \fn json_object ** riak_get_json_mapred(RIAK_CONN * connstruct, char * mapred_statement, int *ret_len)
+ *  \brief Executes MapReduce job via HTTP and returns all results.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param mapred_statement MapReduce job in JSON
+ *  @param ret_len place where number of results will be written
+ *
+ *  @return array of results (of ret_len length); user should release elements with json_object_put and free array
+ */
 json_object ** riak_get_json_mapred(RIAK_CONN * connstruct, char * mapred_statement, int *ret_len);
+
+/** \fn json_object ** riak_get_json_mapred_len(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, int *ret_len)
+ *  \brief Version of riak_get_json_mapred with explicit length of statement.
+ */
+json_object ** riak_get_json_mapred_len(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, int *ret_len);
+
+/** \fn char * riak_get_raw_rs(RIAK_CONN * connstruct, char * query)
+ *  \brief Executes Riak Search query via HTTP.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param query query part of Solr URL, e.g. "bucket/select?q=field:value"
+ *
+ *  @return null-terminated response, which should be released with riak_buf_free; NULL on error
+ */
 char * riak_get_raw_rs(RIAK_CONN * connstruct, char * query);
 
+/** \fn char * riak_get_raw_rs_len(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len)
+ *  \brief Version of riak_get_raw_rs with explicit length of query, reporting length of response.
+ *
+ *  Response buffer grows geometrically, so its size is not limited.
+ *
+ *  @param connstruct Riak connection structure
+ *  @param query query part of Solr URL
+ *  @param query_len length of query
+ *  @param ret_len place where length of response will be written; may be NULL
+ */
+char * riak_get_raw_rs_len(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len);
+
+/** \fn int riak_search_stream(RIAK_CONN * connstruct, const char * query, size_t query_len, riak_data_callback callback, void * userdata, size_t * total)
+ *  \brief Executes Riak Search query via HTTP and streams response body.
+ *
+ *  Every chunk of body is passed to callback as it arrives, without buffering whole response. Callback may stop
+ *  transfer early, e.g. when enough hits were received; this is not an error.
+ *
+ *	@param connstruct Riak connection structure
+ *  @param query query part of Solr URL, e.g. "bucket/select?q=field:value"
+ *  @param query_len length of query
+ *  @param callback function called for every chunk of body
+ *  @param userdata pointer passed to callback
+ *  @param total place where number of received bytes will be written; may be NULL
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_search_stream(RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, void * userdata, size_t * total);
+
+/** \fn RIAK_LOOP * riak_loop_new(void)
+ *  \brief Creates event loop for asynchronous operations.
+ *
+ *  @return new loop, which should be freed with riak_loop_free; NULL on error
+ */
+RIAK_LOOP * riak_loop_new(void);
+
+/** \fn void riak_loop_free(RIAK_LOOP * loop)
+ *  \brief Frees event loop. Operations still in flight are cancelled (their done callbacks get RERR_CANCELLED).
+ */
+void riak_loop_free(RIAK_LOOP * loop);
+
+/** \fn int riak_loop_add_fd(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata)
+ *  \brief Registers file descriptor in event loop, e.g. PB socket or any other socket of application.
+ *
+ *  Registering fd again changes its events and callback.
+ *
+ *	@param loop event loop
+ *  @param fd file descriptor
+ *  @param events events to wait for (POLLIN, POLLOUT)
+ *  @param callback function called when fd is ready
+ *  @param userdata pointer passed to callback
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_loop_add_fd(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata);
+
+/** \fn void riak_loop_remove_fd(RIAK_LOOP * loop, int fd)
+ *  \brief Removes file descriptor registered with riak_loop_add_fd.
+ */
+void riak_loop_remove_fd(RIAK_LOOP * loop, int fd);
+
+/** \fn int riak_loop_run_once(RIAK_LOOP * loop, int timeout_ms)
+ *  \brief Waits for events on all registered file descriptors once and dispatches them.
+ *
+ *  @param loop event loop
+ *  @param timeout_ms maximum time to wait; -1 means no limit
+ *
+ *  @return number of operations still in flight; -1 on error
+ */
+int riak_loop_run_once(RIAK_LOOP * loop, int timeout_ms);
+
+/** \fn int riak_loop_run(RIAK_LOOP * loop)
+ *  \brief Runs event loop until all asynchronous operations are finished.
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_loop_run(RIAK_LOOP * loop);
+
+/** \fn int riak_async_mapred(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, riak_json_callback callback, riak_done_callback done, void * userdata)
+ *  \brief Starts MapReduce job via HTTP in event loop.
+ *
+ *  Works like riak_mapred_json_stream, but returns immediately; callbacks are called from riak_loop_run_once.
+ *  Connection handle is used only for its address, so it stays free for other operations, and any number of
+ *  requests may be in flight at once.
+ *
+ *	@param loop event loop
+ *	@param connstruct Riak connection structure
+ *  @param mapred_statement MapReduce job in JSON (copied)
+ *  @param statement_len length of statement
+ *  @param callback function called for every element of result
+ *  @param done function called when job is finished; may be NULL
+ *  @param userdata pointer passed to callback and done
+ *
+ *  @return 0 if request was started, not 0 on error
+ */
+int riak_async_mapred(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, riak_done_callback done, void * userdata);
+
+/** \fn int riak_async_search(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len, riak_data_callback callback, riak_done_callback done, void * userdata)
+ *  \brief Starts Riak Search query via HTTP in event loop. Asynchronous version of riak_search_stream.
+ */
+int riak_async_search(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, riak_done_callback done, void * userdata);
+
+/** \fn RIAK_SEARCH_CURSOR * riak_search_open(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows, int flags)
+ *  \brief Starts Riak Search query returning documents page by page.
+ *
+ *  Results are requested from Solr interface in JSON format and decoded while they arrive. When a page is handed
+ *  over to caller, next page is already being downloaded in background (on its own HTTP connection), so
+ *  processing of one page overlaps with transfer of next one. With RIAK_SEARCH_FETCH objects of all hits of page
+ *  are fetched via Protocol Buffers with pipelined requests, instead of one round trip per hit; otherwise they are
+ *  got like with riak_get_len (delayed puts, key filter and cache apply). If fetching fails, cursor returns no
+ *  more documents.
+ *
+ *	@param connstruct Riak connection structure; needs HTTP and, for RIAK_SEARCH_FETCH, PB
+ *  @param index name of index to search
+ *  @param query query in Lucene syntax (escaped by driver)
+ *  @param rows page size; 0 means default of 10
+ *  @param flags RIAK_SEARCH_* flags
+ *
+ *  @return new cursor, which should be closed with riak_search_close; NULL on error
+ */
+RIAK_SEARCH_CURSOR * riak_search_open(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows, int flags);
+
+/** \fn RIAK_SEARCH_DOC * riak_search_next(RIAK_SEARCH_CURSOR * cursor)
+ *  \brief Returns next document of search results.
+ *
+ *  Document is valid until cursor moves to next page, i.e. at least until next call of riak_search_next.
+ *
+ *  @return next document; NULL at the end of results or on error (last_error of connection is then not RERR_OK)
+ */
+RIAK_SEARCH_DOC * riak_search_next(RIAK_SEARCH_CURSOR * cursor);
+
+/** \fn void riak_search_close(RIAK_SEARCH_CURSOR * cursor)
+ *  \brief Frees cursor and documents, cancelling prefetch in flight.
+ */
+void riak_search_close(RIAK_SEARCH_CURSOR * cursor);
+
+/** \fn void * riak_buf_alloc(size_t size)
+ *  \brief Allocates buffer from driver-wide buffer pool.
+ *
+ *  Buffers are taken from power-of-two size classes, first from magazine of calling thread, then from shared depot
+ *  and only then from the heap. Buffers bigger than largest class are allocated directly from the heap.
+ *  Thread-safe.
+ *
+ *  @param size requested size
+ *
+ *  @return buffer, which should be released with riak_buf_free; NULL if out of memory
+ */
+void * riak_buf_alloc(size_t size);
+
+/** \fn void riak_buf_free(void * buf)
+ *  \brief Returns buffer to driver buffer pool. Accepts NULL.
+ */
+void riak_buf_free(void * buf);
+
+/** \fn void * riak_buf_realloc(void * buf, size_t size)
+ *  \brief Resizes pool buffer. Works like realloc; on error original buffer is left untouched.
+ */
+void * riak_buf_realloc(void * buf, size_t size);
+
+/** \fn void riak_pool_set_limit(size_t max_bytes)
+ *  \brief Sets limit of free bytes kept by buffer pool, in shared depot and thread magazines together. Default is 64 MB.
+ *
+ *  Limit is split evenly between size classes. Free buffers over the limit are returned to the heap.
+ */
+void riak_pool_set_limit(size_t max_bytes);
+
+/** \fn void riak_pool_trim(void)
+ *  \brief Returns all free buffers from shared depot and magazines of calling thread to the heap.
+ *
+ *  Magazines of other threads are emptied when they exit.
+ */
+void riak_pool_trim(void);
+
+/** \fn void riak_pool_stats(RIAK_POOL_STATS * stats)
+ *  \brief Reports occupancy of buffer pool.
+ */
+void riak_pool_stats(RIAK_POOL_STATS * stats);
+
+/** \fn RIAK_CACHE * riak_cache_new(size_t max_bytes, unsigned int ttl_ms)
+ *  \brief Creates object cache.
+ *
+ *  Cache keeps objects fetched by riak_get_len and riak_bucket_get (value, content type, vtag, last modification
+ *  time and vclock) of connections which have it set in RIAK_CONN.cache, so that repeated gets of hot keys are
+ *  served from memory. Writes and deletes made through such connections drop cached copies; changes made
+ *  by other clients are seen after TTL expires. Cache is split into independently locked shards and may be
+ *  shared by connections used in many threads. Least recently used objects are evicted (CLOCK approximation)
+ *  when size limit is reached. Gets which miss an object that another thread is already fetching through the cache
+ *  wait for that request and return copies of its result, so that expiry of hot key sends one get, not many.
+ *
+ *  @param max_bytes limit of memory used by cached objects
+ *  @param ttl_ms time for which objects are served from cache, unless set otherwise for bucket
+ *
+ *  @return new cache, which should be freed with riak_cache_free; NULL if out of memory
+ */
+RIAK_CACHE * riak_cache_new(size_t max_bytes, unsigned int ttl_ms);
+
+/** \fn RIAK_CACHE * riak_cache_new_shared(const char * path, size_t max_bytes, size_t max_object, unsigned int ttl_ms)
+ *  \brief Creates object cache shared by all processes which open the same file.
+ *
+ *  Cache works like one made by riak_cache_new, but its entries are kept in file mapped into memory (normally
+ *  on tmpfs, e.g. /dev/shm), so that objects fetched by one process are hits in all others. File and its entries
+ *  outlive processes: worker started later, or restarted, finds cache warm. Lookups take no locks; writers lock
+ *  only slots they change, and slot of process killed while writing it is emptied. Writes and deletes made
+ *  through connections using cache drop cached copies for all processes. Expiration times are kept as wall clock.
+ *
+ *  Entries have fixed size: objects whose bucket name, key, value, content type, vtag and vclock take more than
+ *  max_object bytes aren't cached. Every object may be held by one of 4 slots; when they are all taken, entry
+ *  expiring first is evicted. Gets are coalesced only within process. TTLs of buckets are settings of process,
+ *  so all processes should set the same ones. riak_cache_stats reports entries of whole file, but hits and misses
+ *  of calling process only. All processes must pass the same max_bytes and max_object, otherwise file can't be
+ *  opened; remove file to change them. riak_cache_free unmaps file, leaving entries for others.
+ *
+ *  @param path file holding entries; created if it doesn't exist
+ *  @param max_bytes size of table (rounded down, so that number of slots is power of two)
+ *  @param max_object largest entry which is cached
+ *  @param ttl_ms time for which objects are served from cache, unless set otherwise for bucket
+ *
+ *  @return new cache, which should be freed with riak_cache_free; NULL on error (file couldn't be opened or mapped,
+ *  	or was created with other sizes)
+ */
+RIAK_CACHE * riak_cache_new_shared(const char * path, size_t max_bytes, size_t max_object, unsigned int ttl_ms);
+
+/** \fn int riak_cache_set_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms)
+ *  \brief Sets time for which objects of bucket are cached. Affects objects cached from now on.
+ *
+ *  @param bucket name of the bucket; NULL sets default for buckets without own TTL
+ *  @param ttl_ms TTL in milliseconds; 0 turns caching of bucket off
+ *
+ *  @return 0 if success, not 0 if out of memory
+ */
+int riak_cache_set_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms);
+
+/** \fn int riak_cache_set_negative_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms)
+ *  \brief Sets time for which "not found" results of gets from bucket are cached.
+ *
+ *  While such result is cached, gets of the key return NULL with RERR_NOT_FOUND without asking Riak. Writes made
+ *  through connections using the cache drop it, but objects created by other clients aren't seen until it expires,
+ *  so it should be short, or left off (default) for buckets written by others. Not-found results take at most
+ *  1/8 of the cache and never evict objects.
+ *
+ *  @param bucket name of the bucket; NULL sets default for buckets without own TTL
+ *  @param ttl_ms TTL in milliseconds; 0 turns negative caching of bucket off
+ *
+ *  @return 0 if success, not 0 if out of memory
+ */
+int riak_cache_set_negative_ttl(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, unsigned int ttl_ms);
+
+/** \fn void riak_cache_invalidate(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Drops cached copy of object, e.g. after it was changed by other client.
+ */
+void riak_cache_invalidate(RIAK_CACHE * cache, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_cache_clear(RIAK_CACHE * cache)
+ *  \brief Drops all cached objects.
+ */
+void riak_cache_clear(RIAK_CACHE * cache);
+
+/** \fn void riak_cache_stats(RIAK_CACHE * cache, RIAK_CACHE_STATS * stats)
+ *  \brief Reports occupancy and hit counts of cache.
+ */
+void riak_cache_stats(RIAK_CACHE * cache, RIAK_CACHE_STATS * stats);
+
+/** \fn int riak_cache_save(RIAK_CACHE * cache, const char * path)
+ *  \brief Writes cached objects (not not-found results) to file, e.g. at shutdown, so that next process can load them.
+ *
+ *  Objects are copied shard by shard, so cache stays usable meanwhile. File is replaced atomically. It holds
+ *  expiration times as wall clock and is meant to be loaded on the same machine. Caches made by
+ *  riak_cache_new_shared keep entries in their file already and can't be saved.
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_cache_save(RIAK_CACHE * cache, const char * path);
+
+/** \fn int riak_cache_load(RIAK_CACHE * cache, const char * path)
+ *  \brief Fills cache with objects from file written by riak_cache_save, e.g. at startup, so that it starts warm.
+ *
+ *  Objects keep time to live they had left when saved (but not more than TTL now set for their bucket); expired
+ *  ones are skipped, as are objects already cached. TTLs should be set before loading. Load stops at first damaged
+ *  record. Caches made by riak_cache_new_shared can't be loaded.
+ *
+ *  @return 0 if success, not 0 on error (file couldn't be read or is damaged; objects read before damage are kept)
+ */
+int riak_cache_load(RIAK_CACHE * cache, const char * path);
+
+/** \fn void riak_cache_free(RIAK_CACHE * cache)
+ *  \brief Frees cache. No connection may use it any more. Accepts NULL.
+ */
+void riak_cache_free(RIAK_CACHE * cache);
+
+/** \fn RIAK_DIGESTS * riak_digests_new(size_t n_keys)
+ *  \brief Creates table of hashes of values, which lets puts skip values that wouldn't change anything.
+ *
+ *  Connections which have table set in RIAK_CONN.digests remember 64-bit hash of value of every object they
+ *  successfully put. Put (riak_put, riak_put_len, riak_bucket_put) of value with the same hash as
+ *  remembered one isn't sent at all: it returns 0 and sets last_error to RERR_UNCHANGED. Deletes and failed puts
+ *  through such connections make table forget object, as do gets which find it missing, with siblings or with
+ *  other value than remembered one. Changes made by other clients aren't seen, so table
+ *  should be used only when the process is the only writer of its objects (or cleared with riak_digests_clear
+ *  when that isn't known).
+ *
+ *  Table has fixed size of 16 bytes per slot; objects which map to the same slot replace each other.
+ *  It may be shared by connections used in many threads.
+ *
+ *  @param n_keys number of slots (rounded up to power of two)
+ *
+ *  @return new table, which should be freed with riak_digests_free; NULL if out of memory
+ */
+RIAK_DIGESTS * riak_digests_new(size_t n_keys);
+
+/** \fn void riak_digests_clear(RIAK_DIGESTS * digests)
+ *  \brief Forgets all objects, so that following puts are sent.
+ */
+void riak_digests_clear(RIAK_DIGESTS * digests);
+
+/** \fn void riak_digests_free(RIAK_DIGESTS * digests)
+ *  \brief Frees table. No connection may use it any more. Accepts NULL.
+ */
+void riak_digests_free(RIAK_DIGESTS * digests);
+
+/** \fn RIAK_MAPRED_CACHE * riak_mapred_cache_new(size_t max_bytes, unsigned int ttl_ms)
+ *  \brief Creates cache of MapReduce results, which can be set in RIAK_CONN.mapred_cache.
+ *
+ *  Results are keyed by server address and statement with whitespace outside of strings removed, so jobs
+ *  differing only in formatting share result. Complete response body (up to 4 MB) of successful job is kept
+ *  and decoded anew for every caller, who owns elements as usual; nothing is sent to server while result is fresh.
+ *  When result is in last fifth of its time to live, first caller which gets it starts one refresh in background
+ *  thread, and callers keep getting old result (even past its time to live) until refresh replaces it.
+ *  Results don't see writes, so cache suits jobs whose result may be stale by ttl_ms. Least recently used
+ *  results are evicted to stay within max_bytes. Cache may be shared by connections used in many threads.
+ *
+ *  @param max_bytes memory which results may take
+ *  @param ttl_ms time to live of results in milliseconds
+ *
+ *  @return new cache, which should be freed with riak_mapred_cache_free; NULL on error (also when HTTP module
+ *  	couldn't be loaded)
+ */
+RIAK_MAPRED_CACHE * riak_mapred_cache_new(size_t max_bytes, unsigned int ttl_ms);
+
+/** \fn void riak_mapred_cache_clear(RIAK_MAPRED_CACHE * cache)
+ *  \brief Drops all results, so that following jobs are sent to server.
+ */
+void riak_mapred_cache_clear(RIAK_MAPRED_CACHE * cache);
+
+/** \fn void riak_mapred_cache_free(RIAK_MAPRED_CACHE * cache)
+ *  \brief Frees cache. No connection may use it any more. Accepts NULL.
+ */
+void riak_mapred_cache_free(RIAK_MAPRED_CACHE * cache);
+
+/** \fn RIAK_KEY_FILTER * riak_key_filter_new(size_t n_keys, unsigned int bits_per_key)
+ *  \brief Creates Bloom filter of existing keys, which can be set in RIAK_CONN.key_filter.
+ *
+ *  Filter answers only for buckets loaded with riak_key_filter_load (or marked with riak_key_filter_mark); gets of keys of such bucket which were
+ *  neither listed nor written through connection using filter return not found locally. Filter can't forget keys,
+ *  so deleted keys are still fetched, and keys written by other clients after load are reported absent until
+ *  bucket is loaded again (or they are added with riak_key_filter_add). Filter should therefore be used only
+ *  for buckets which other clients don't add keys to, or be reloaded as often as staleness allows.
+ *  False positives (absent keys which are fetched anyway) stay rare while number of keys stays below n_keys;
+ *  10 bits per key give about 1%. Filter may be shared by connections used in many threads.
+ *
+ *  @param n_keys expected number of keys of all loaded buckets
+ *  @param bits_per_key memory per key in bits
+ *
+ *  @return new filter, which should be freed with riak_key_filter_free; NULL on error
+ */
+RIAK_KEY_FILTER * riak_key_filter_new(size_t n_keys, unsigned int bits_per_key);
+
+/** \fn int riak_key_filter_load(RIAK_CONN * connstruct, RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len)
+ *  \brief Adds all keys of bucket to filter with streaming list-keys, and makes filter answer for bucket.
+ *
+ *  Filter should already be set on connections writing to bucket, so that keys written during listing
+ *  aren't missed. Listing keys is expensive on Riak side; load rarely.
+ *
+ *  @return 0 if success, not 0 on error (filter doesn't answer for bucket then)
+ */
+int riak_key_filter_load(RIAK_CONN * connstruct, RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len);
+
+/** \fn int riak_key_filter_mark(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len)
+ *  \brief Makes filter answer for bucket whose keys were all added with riak_key_filter_add, without listing them.
+ *
+ *  Meant for buckets created by application and written only through connections using filter, whose keys
+ *  are known without asking Riak. Nothing is sent to Riak.
+ *
+ *  @return 0 if success, not 0 if out of memory
+ */
+int riak_key_filter_mark(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len);
+
+/** \fn int riak_key_filter_maybe(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Checks whether key may exist.
+ *
+ *  @return 0 if key definitely doesn't exist, 1 if it may (always for buckets which weren't loaded)
+ */
+int riak_key_filter_maybe(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_key_filter_add(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Adds key, e.g. one written by other client.
+ */
+void riak_key_filter_add(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_key_filter_free(RIAK_KEY_FILTER * filter)
+ *  \brief Frees filter. No connection may use it any more. Accepts NULL.
+ */
+void riak_key_filter_free(RIAK_KEY_FILTER * filter);
+
+/** \fn int riak_key_index_build(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * path)
+ *  \brief Takes snapshot of keys of bucket with streaming list-keys and writes it to index file.
+ *
+ *  Keys are sorted and front-coded, so file takes little more than keys sharing long prefixes do. File is replaced
+ *  atomically; indexes opened from old file keep working. Listing keys is expensive on Riak side; build rarely
+ *  and open snapshot in every process which needs it.
+ *
+ *  @return 0 if success, not 0 on error (RERR_IO if file couldn't be written)
+ */
+int riak_key_index_build(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * path);
+
+/** \fn RIAK_KEY_INDEX * riak_key_index_open(const char * path)
+ *  \brief Maps index file written by riak_key_index_build or riak_key_index_save.
+ *
+ *  Index can be set in RIAK_CONN.key_index, so that writes made after snapshot are seen by scans. Writes made
+ *  by other clients aren't seen until new snapshot is taken (or they are applied with riak_key_index_add
+ *  and riak_key_index_remove). Index may be shared by connections used in many threads.
+ *
+ *  @return new index, which should be freed with riak_key_index_free; NULL on error
+ */
+RIAK_KEY_INDEX * riak_key_index_open(const char * path);
+
+/** \fn RIAK_KEY_INDEX * riak_key_index_new(const char * bucket, size_t bucket_len)
+ *  \brief Creates empty index of bucket without snapshot file, e.g. for new bucket or keys known to application.
+ *
+ *  Keys are added with riak_key_index_add (or by writes through connections using index), and riak_key_index_save
+ *  writes them to file, which riak_key_index_open maps. Nothing is sent to Riak.
+ *
+ *  @return new index, which should be freed with riak_key_index_free; NULL if out of memory
+ */
+RIAK_KEY_INDEX * riak_key_index_new(const char * bucket, size_t bucket_len);
+
+/** \fn int riak_key_index_scan(RIAK_KEY_INDEX * index, const char * from, size_t from_len, const char * to, size_t to_len, riak_keys_callback callback, void * userdata)
+ *  \brief Passes keys from range [from, to) in bytewise order to callback, in chunks like riak_list_keys_stream.
+ *
+ *  Nothing is sent to Riak; start of range is found with binary search. Callback runs without locks held,
+ *  so it may write to or delete keys it is passed, also through connections using index; such changes aren't seen
+ *  by scan which is running.
+ *
+ *  @param from first key of range; NULL for start of index
+ *  @param to key after range; NULL for end of index
+ *
+ *  @return 0 if success, not 0 if out of memory or index file is damaged
+ */
+int riak_key_index_scan(RIAK_KEY_INDEX * index, const char * from, size_t from_len, const char * to, size_t to_len,
+		riak_keys_callback callback, void * userdata);
+
+/** \fn int riak_key_index_prefix(RIAK_KEY_INDEX * index, const char * prefix, size_t prefix_len, riak_keys_callback callback, void * userdata)
+ *  \brief Passes keys starting with prefix to callback, like riak_key_index_scan.
+ */
+int riak_key_index_prefix(RIAK_KEY_INDEX * index, const char * prefix, size_t prefix_len,
+		riak_keys_callback callback, void * userdata);
+
+/** \fn void riak_key_index_add(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Adds key, e.g. one written by other client. Keys of other buckets are ignored.
+ */
+void riak_key_index_add(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_key_index_remove(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Removes key, e.g. one deleted by other client. Keys of other buckets are ignored.
+ */
+void riak_key_index_remove(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn int riak_key_index_save(RIAK_KEY_INDEX * index, const char * path)
+ *  \brief Writes snapshot with changes applied since it was taken to index file (which may be file index was opened from).
+ *
+ *  Changes are kept in memory until index is freed; open saved file to drop them.
+ *
+ *  @return 0 if success, not 0 on error
+ */
+int riak_key_index_save(RIAK_KEY_INDEX * index, const char * path);
+
+/** \fn void riak_key_index_free(RIAK_KEY_INDEX * index)
+ *  \brief Unmaps index and frees it. No connection may use it any more. Accepts NULL.
+ */
+void riak_key_index_free(RIAK_KEY_INDEX * index);
+
+/** \fn int riak_flush(RIAK_CONN * connstruct)
+ *  \brief Sends all puts delayed by write-behind bucket handles.
+ *
+ *  Delayed put is sent when its window passes and another operation is made on connection, when object is read
+ *  through connection (so reads see own writes), or by this function and riak_close. Put or delete of the same
+ *  object through connection drops it, as it would be overwritten anyway. Puts of idle connections are sent only
+ *  by riak_flush, so it should be called periodically. Operations via HTTP don't see delayed puts.
+ *
+ *	@param connstruct Riak connection structure
+ *
+ *  @return 0 if success, not 0 if any delayed put sent since last riak_flush failed (last_error tells why)
+ */
+int riak_flush(RIAK_CONN * connstruct);
+
 /** \fn void riak_close(RIAK_CONN * connstruct)
  *  \brief Closes connection to Riak.
  *
- *  This function ends cURL session, closes TCP socket and frees connstruct,
+ *  This function sends delayed puts, ends cURL session, closes TCP socket and frees connstruct,
  *  so this structure can't be used after calling this function.
  *
  *  @param connstruct connection structure to be closed and freed.
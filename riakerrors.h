@@ -23,21 +23,8 @@
 #ifndef RIAKERRORS_H_
 #define RIAKERRORS_H_
 
-const char * (RIAK_ERR_MSGS[]) = {
-		"Success",
-		/* Errors for riak_init */
-		"Socket creation error",
-		"Can't fetch host name",
-		"Couldn't connect to PB socket",
-		"Couldn't initialize cURL handle",
-		/* Errors for riak_exec_op */
-		"Error when sending data via PB socket",
-		"Error when receiving length of response via PB socket",
-		"Error when receiving command code via PB socket",
-		"Error when receiving command message via PB socket",
-		/* Errors for riak_list_buckets */
-		"Error when fetching bucket list"
-};
+/** Descriptions of error codes, indexed by code. Defined in riakdrv.c. */
+extern const char * (RIAK_ERR_MSGS[]);
 
 #define RERR_UNKNOWN -1
 #define RERR_OK 0
@@ -57,7 +44,34 @@ const char * (RIAK_ERR_MSGS[]) = {
 /* Errors for riak_list_buckets */
 #define RERR_BUCKET_LIST 9
 
+/* Errors for riak_list_keys */
+#define RERR_KEY_LIST 10
+
+/* Errors for riak_get */
+#define RERR_GET 11
+#define RERR_NOT_FOUND 12
+
+/* Errors for riak_put */
+#define RERR_PUT 13
+
+/* Errors for riak_del */
+#define RERR_DEL 14
+
+/* Errors for large object I/O */
+#define RERR_BUFFER_SMALL 15
+#define RERR_IO 16
+
+/* Errors for HTTP operations */
+#define RERR_HTTP 17
+#define RERR_JSON 18
+#define RERR_CANCELLED 19
+/* Transport errors */
+#define RERR_NO_TRANSPORT 20
+#define RERR_HTTP_MODULE 21
+/* Informational codes (operation succeeded) */
+#define RERR_UNCHANGED 22
+
 /* Maximum value for testing purposes */
-#define RERR_MAX_CODE 10
+#define RERR_MAX_CODE 23
 
 #endif /* RIAKERRORS_H_ */
@@ -0,0 +1,229 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakfilter.c
+ *
+ * Bloom filter of existing keys, which lets gets of keys known to be absent return without asking Riak.
+ *
+ * Filter is blocked: all bits of a key lie in one 64-byte block (chosen by hash), so that test or insert
+ * touches one cache line, at the cost of slightly higher false positive rate than plain Bloom filter.
+ * Bits are set with atomic OR, so filter is updated and tested without locks. Keys of all buckets share
+ * the filter; only buckets whose keys were fully loaded are answered for.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "riakdrv.h"
+#include "riakdigest.h"
+
+/** Bits of block. */
+#define RIAK_FILTER_BLOCK_BITS 512
+/** Largest number of bits set per key; all are taken from one 64-bit hash, 9 bits each. */
+#define RIAK_FILTER_MAX_K 7
+
+/**
+ * \brief Bucket whose keys were loaded into filter.
+ */
+struct riak_filter_bucket {
+	/** Name of bucket. */
+	char * name;
+	/** Length of name. */
+	size_t name_len;
+};
+
+struct riak_key_filter {
+	/** Blocks, 8 words each. */
+	__uint64_t * bits;
+	/** Number of blocks. */
+	size_t n_blocks;
+	/** Number of bits set per key. */
+	int k;
+	/** Guards buckets. */
+	pthread_rwlock_t lock;
+	/** Loaded buckets. */
+	struct riak_filter_bucket * buckets;
+	/** Number of buckets. */
+	size_t n_buckets;
+};
+
+/**	\fn __uint64_t riak_filter_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Hash of bucket and key.
+ */
+static inline __uint64_t riak_filter_hash(const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t h = riak_digest_value(key, key_len) ^ (riak_digest_value(bucket, bucket_len) * 0x9E3779B97F4A7C15ULL);
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**	\fn __uint64_t * riak_filter_block(RIAK_KEY_FILTER * filter, __uint64_t hash, __uint64_t * bits)
+ * 	\brief Returns block of key and sets bits to second hash, from which positions of its bits are taken.
+ */
+static inline __uint64_t * riak_filter_block(RIAK_KEY_FILTER * filter, __uint64_t hash, __uint64_t * bits) {
+	/* Top half picks block without modulo; whole hash, remixed, picks bits */
+	*bits = hash * 0xC4CEB9FE1A85EC53ULL;
+	return filter->bits + 8*(((hash >> 32) * filter->n_blocks) >> 32);
+}
+
+/**	\fn int riak_filter_loaded(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len)
+ * 	\brief Checks whether all keys of bucket were loaded.
+ */
+static int riak_filter_loaded(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len) {
+	size_t i;
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&filter->lock);
+	for(i = 0; i < filter->n_buckets; i++) {
+		if(filter->buckets[i].name_len == bucket_len && memcmp(filter->buckets[i].name, bucket, bucket_len) == 0) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&filter->lock);
+
+	return ret;
+}
+
+/**
+ * \brief Helper structure passing filter and bucket to riak_filter_collect.
+ */
+struct riak_filter_load {
+	/** Filter being loaded. */
+	RIAK_KEY_FILTER * filter;
+	/** Name of bucket. */
+	const char * bucket;
+	/** Length of bucket name. */
+	size_t bucket_len;
+};
+
+/**	\fn int riak_filter_collect(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata)
+ * 	\brief Callback for riak_list_keys_stream which adds keys to filter (struct riak_filter_load).
+ */
+static int riak_filter_collect(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata) {
+	struct riak_filter_load * load = (struct riak_filter_load *)userdata;
+	size_t i;
+
+	for(i = 0; i < n_keys; i++)
+		riak_key_filter_add(load->filter, load->bucket, load->bucket_len, msg+keys[i].offset, keys[i].len);
+	return 0;
+}
+
+RIAK_KEY_FILTER * riak_key_filter_new(size_t n_keys, unsigned int bits_per_key) {
+	RIAK_KEY_FILTER * filter;
+
+	if(bits_per_key == 0)
+		return NULL;
+	if((filter = malloc(sizeof(RIAK_KEY_FILTER))) == NULL)
+		return NULL;
+	filter->n_blocks = (n_keys*bits_per_key + RIAK_FILTER_BLOCK_BITS-1) / RIAK_FILTER_BLOCK_BITS;
+	if(filter->n_blocks == 0)
+		filter->n_blocks = 1;
+	/* Blocks are aligned to cache lines */
+	if(posix_memalign((void **)&filter->bits, 64, filter->n_blocks*RIAK_FILTER_BLOCK_BITS/8) != 0) {
+		free(filter);
+		return NULL;
+	}
+	memset(filter->bits, 0, filter->n_blocks*RIAK_FILTER_BLOCK_BITS/8);
+	/* Optimal number of bits is bits_per_key * ln 2 */
+	filter->k = (bits_per_key*693 + 500) / 1000;
+	if(filter->k < 1)
+		filter->k = 1;
+	if(filter->k > RIAK_FILTER_MAX_K)
+		filter->k = RIAK_FILTER_MAX_K;
+	pthread_rwlock_init(&filter->lock, NULL);
+	filter->buckets = NULL;
+	filter->n_buckets = 0;
+
+	return filter;
+}
+
+int riak_key_filter_load(RIAK_CONN * connstruct, RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len) {
+	struct riak_filter_load load = { filter, bucket, bucket_len };
+
+	if(riak_list_keys_stream_len(connstruct, bucket, bucket_len, riak_filter_collect, &load) != 0)
+		return 1;
+	if(riak_key_filter_mark(filter, bucket, bucket_len) != 0) {
+		connstruct->last_error = RERR_KEY_LIST;
+		return 1;
+	}
+	return 0;
+}
+
+int riak_key_filter_mark(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len) {
+	struct riak_filter_bucket * tmp;
+	char * name;
+
+	if(riak_filter_loaded(filter, bucket, bucket_len))
+		return 0;
+
+	if((name = malloc(bucket_len > 0 ? bucket_len : 1)) == NULL)
+		return 1;
+	memcpy(name, bucket, bucket_len);
+	pthread_rwlock_wrlock(&filter->lock);
+	if((tmp = realloc(filter->buckets, (filter->n_buckets+1)*sizeof(struct riak_filter_bucket))) == NULL) {
+		pthread_rwlock_unlock(&filter->lock);
+		free(name);
+		return 1;
+	}
+	filter->buckets = tmp;
+	tmp[filter->n_buckets].name = name;
+	tmp[filter->n_buckets].name_len = bucket_len;
+	filter->n_buckets++;
+	pthread_rwlock_unlock(&filter->lock);
+
+	return 0;
+}
+
+void riak_key_filter_add(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t bits, * block = riak_filter_block(filter, riak_filter_hash(bucket, bucket_len, key, key_len), &bits);
+	unsigned int bit;
+	int i;
+
+	for(i = 0; i < filter->k; i++, bits >>= 9) {
+		bit = bits & (RIAK_FILTER_BLOCK_BITS-1);
+		__atomic_fetch_or(&block[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+	}
+}
+
+int riak_key_filter_maybe(RIAK_KEY_FILTER * filter, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	__uint64_t bits, * block = riak_filter_block(filter, riak_filter_hash(bucket, bucket_len, key, key_len), &bits);
+	unsigned int bit;
+	int i;
+
+	for(i = 0; i < filter->k; i++, bits >>= 9) {
+		bit = bits & (RIAK_FILTER_BLOCK_BITS-1);
+		if(!(__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))))
+			return !riak_filter_loaded(filter, bucket, bucket_len);
+	}
+	return 1;
+}
+
+void riak_key_filter_free(RIAK_KEY_FILTER * filter) {
+	size_t i;
+
+	if(filter == NULL)
+		return;
+	for(i = 0; i < filter->n_buckets; i++)
+		free(filter->buckets[i].name);
+	free(filter->buckets);
+	pthread_rwlock_destroy(&filter->lock);
+	free(filter->bits);
+	free(filter);
+}
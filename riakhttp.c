@@ -0,0 +1,2727 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakhttp.c
+ *
+ * HTTP and JSON part of driver: operations done via cURL, event loop and search cursor.
+ *
+ * Built as separate module (libriakdrv_http.so), so that only processes which really use HTTP
+ * load cURL and json-c. Core library loads it with dlopen on first HTTP operation and calls it through
+ * RIAK_HTTP_OPS table; module calls back into core through RIAK_CORE_OPS.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <json/json_tokener.h>
+
+#include "riakdrv.h"
+#include "riakhttp.h"
+
+/** Functions of core library, given when module is loaded. */
+static const RIAK_CORE_OPS * core = NULL;
+
+/**
+ * \brief Helper structure for exchanging data with cURL.
+ */
+struct buffered_char {
+	/** Data buffer. Doesn't have to be null-terminated, may contain null bytes. */
+	char * buffer;
+	/** Current position in buffer */
+	size_t pointer;
+	/** Length of data in buffer (used when buffer is read) */
+	size_t length;
+};
+
+/** We should initialize cURL only once - this guards initialization. */
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+/** Share handle of all cURL handles of driver: DNS cache, connection cache and SSL sessions. */
+static CURLSH * curl_share = NULL;
+/** Locks of data shared by curl_share, one per CURL_LOCK_DATA_* kind. */
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+
+/**	\fn void riak_curl_share_lock(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr)
+ * 	\brief CURLSHOPT_LOCKFUNC of curl_share.
+ */
+static void riak_curl_share_lock(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr) {
+	pthread_mutex_lock(&curl_share_locks[data]);
+}
+
+/**	\fn void riak_curl_share_unlock(CURL * handle, curl_lock_data data, void * userptr)
+ * 	\brief CURLSHOPT_UNLOCKFUNC of curl_share.
+ */
+static void riak_curl_share_unlock(CURL * handle, curl_lock_data data, void * userptr) {
+	pthread_mutex_unlock(&curl_share_locks[data]);
+}
+
+/**	\fn void riak_curl_init_once(void)
+ * 	\brief Initializes cURL library and share handle. Called once.
+ */
+static void riak_curl_init_once(void) {
+	int i;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&curl_share_locks[i], NULL);
+	if((curl_share = curl_share_init()) == NULL)
+		return;
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, riak_curl_share_lock);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, riak_curl_share_unlock);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+/**	\fn void riak_curl_global_init(void)
+ * 	\brief Initializes cURL library if it wasn't initialized yet. Thread-safe.
+ */
+static void riak_curl_global_init(void) {
+	pthread_once(&curl_once, riak_curl_init_once);
+}
+
+/**	\fn void riak_curl_setup(CURL * curl)
+ * 	\brief Sets options common for all cURL handles of driver.
+ */
+static void riak_curl_setup(CURL * curl) {
+	if(curl_share != NULL)
+		curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+}
+
+/**	\fn int riak_http_conn(RIAK_CONN * connstruct)
+ * 	\brief Sets up HTTP part of connection on its first HTTP operation.
+ *
+ * riak_init only remembers server address, cURL handle, address buffer and header list are created here.
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_http_conn(RIAK_CONN * connstruct) {
+	if(connstruct->curlh != NULL)
+		return 0;
+	if(connstruct->addr == NULL) {
+		connstruct->last_error = RERR_NO_TRANSPORT;
+		return 1;
+	}
+
+	riak_curl_global_init();
+	if((connstruct->curlh = curl_easy_init()) == NULL) {
+		connstruct->last_error = RERR_CURL_INIT;
+		return 1;
+	}
+	riak_curl_setup(connstruct->curlh);
+
+	connstruct->url_size = connstruct->addr_len+256;
+	connstruct->url = malloc(connstruct->url_size);
+	memcpy(connstruct->url, connstruct->addr, connstruct->addr_len+1);
+	connstruct->json_headers = curl_slist_append(NULL, "Content-type: application/json");
+	connstruct->json_headers = curl_slist_append(connstruct->json_headers, "Expect:");
+
+	return 0;
+}
+
+/** \fn size_t readfunc(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief Helper function for cURL, reads data from buffer
+ *
+ * This is helper function for cURL, which takes userdata and ptr (internal field where cURL stores data to be sent)
+ * and then copies contents of userdata to ptr. This function assumes that userdata is of type struct buffered_char
+ * with length field set, so the data is never rescanned.
+ *
+ * @param ptr internal cURL location
+ * @param size size of one data piece
+ * @param nmemb count of data pieces
+ * @param userdata structure from which data should be read
+ *
+ * @return amount of data copied
+ */
+size_t readfunc(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct buffered_char * data = (struct buffered_char *)userdata;
+	
+	size_t datalen = (size*nmemb > data->length-data->pointer) ? data->length-data->pointer : size*nmemb;
+	if(datalen > 0) memcpy(ptr, data->buffer+data->pointer, datalen);
+	data->pointer += datalen;
+	
+	return datalen;
+}
+
+/** \fn size_t writefunc(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief Helper function for cURL, writes data to buffer
+ *
+ * This is helper function for cURL, which takes userdata and ptr (internal field where cURL stores data received)
+ * and then copies contents of ptr to userdata. This function assumes that userdata is of type struct buffered_char,
+ * with buffer allocated from buffer pool and length being its allocated size. Buffer is grown geometrically when needed,
+ * and one byte is always kept free for null terminator.
+ *
+ * @param ptr internal cURL location
+ * @param size size of one data piece
+ * @param nmemb count of data pieces
+ * @param userdata structure to which data should be read
+ *
+ * @return amount of data copied; 0 if buffer couldn't be grown
+ */
+size_t writefunc(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct buffered_char * data = (struct buffered_char *)userdata;
+	size_t new_length;
+	char * tmp;
+
+	if(data->pointer+size*nmemb+1 > data->length) {
+		new_length = data->length ? data->length : 4096;
+		while(data->pointer+size*nmemb+1 > new_length)
+			new_length *= 2;
+		if((tmp = riak_buf_realloc(data->buffer, new_length)) == NULL)
+			return 0;
+		data->buffer = tmp;
+		data->length = new_length;
+	}
+	memcpy(data->buffer+data->pointer, ptr, size*nmemb);
+	data->pointer += size*nmemb;
+
+	return size*nmemb;
+}
+
+/**	\fn CURL * riak_curl_handle(RIAK_CONN * connstruct)
+ * 	\brief Returns cURL handle of connection with options of previous operation cleared; NULL on error.
+ *
+ * Resetting keeps connections, DNS entries and SSL sessions, so next request doesn't pay for setting them up again.
+ */
+static CURL * riak_curl_handle(RIAK_CONN * connstruct) {
+	if(riak_http_conn(connstruct) != 0)
+		return NULL;
+	curl_easy_reset(connstruct->curlh);
+	riak_curl_setup(connstruct->curlh);
+	return connstruct->curlh;
+}
+
+/**	\fn void riak_curl_compression(RIAK_CONN * connstruct, CURL * curl)
+ * 	\brief Lets server compress response if connection allows it. cURL decompresses body before passing it to write function.
+ */
+static void riak_curl_compression(RIAK_CONN * connstruct, CURL * curl) {
+	if(connstruct->compression)
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+/**	\fn char * riak_conn_url(RIAK_CONN * connstruct, const char * path, const char * tail, size_t tail_len)
+ * 	\brief Builds HTTP address in buffer of connection: server address, path and tail.
+ *
+ * Server address is kept at the beginning of buffer, so only path and tail are copied.
+ * If tail is NULL, tail_len bytes are only reserved for caller to fill in.
+ *
+ * @return url buffer of connection (valid until next call); NULL on error
+ */
+static char * riak_conn_url(RIAK_CONN * connstruct, const char * path, const char * tail, size_t tail_len) {
+	size_t path_len = strlen(path);
+	size_t size = connstruct->addr_len+path_len+tail_len+1;
+	char * tmp;
+
+	if(riak_http_conn(connstruct) != 0)
+		return NULL;
+	if(size > connstruct->url_size) {
+		if((tmp = realloc(connstruct->url, size*2)) == NULL)
+			return NULL;
+		connstruct->url = tmp;
+		connstruct->url_size = size*2;
+	}
+	memcpy(connstruct->url+connstruct->addr_len, path, path_len);
+	if(tail != NULL)
+		memcpy(connstruct->url+connstruct->addr_len+path_len, tail, tail_len);
+	connstruct->url[size-1] = '\0';
+
+	return connstruct->url;
+}
+
+/**	\fn char * riak_object_url(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Builds HTTP address of object, escaping bucket and key.
+ *
+ * @return url buffer of connection (valid until next call); NULL on error
+ */
+static char * riak_object_url(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	char * ebucket, * ekey, * address = NULL;
+	size_t ebucket_len, ekey_len;
+
+	ebucket = curl_easy_escape(connstruct->curlh, bucket, bucket_len);
+	ekey = curl_easy_escape(connstruct->curlh, key, key_len);
+	if(ebucket != NULL && ekey != NULL) {
+		ebucket_len = strlen(ebucket);
+		ekey_len = strlen(ekey);
+		if((address = riak_conn_url(connstruct, "/riak/", NULL, ebucket_len+1+ekey_len)) != NULL) {
+			memcpy(address+connstruct->addr_len+sizeof("/riak/")-1, ebucket, ebucket_len);
+			address[connstruct->addr_len+sizeof("/riak/")-1+ebucket_len] = '/';
+			memcpy(address+connstruct->addr_len+sizeof("/riak/")+ebucket_len, ekey, ekey_len);
+		}
+	}
+	curl_free(ebucket);
+	curl_free(ekey);
+
+	return address;
+}
+
+/**	\fn size_t riak_discard_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief cURL write function dropping response body.
+ */
+static size_t riak_discard_write(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	return size*nmemb;
+}
+
+/**	\fn int riak_http_put(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const char * data, size_t len, const char * content_type)
+ * 	\brief Puts value via HTTP. Used when connection has no Protocol Buffers socket.
+ *
+ * @param content_type content type of value; NULL means application/octet-stream
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_http_put(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const char * data, size_t len, const char * content_type) {
+	char * address;
+	char header[128];
+	CURLcode res;
+	long status = 0;
+	struct buffered_char body;
+	struct curl_slist * headerlist = NULL;
+	CURL * curl;
+
+	connstruct->last_error = RERR_OK;
+	if((curl = riak_curl_handle(connstruct)) == NULL)
+		return 1;
+	if((address = riak_object_url(connstruct, bucket, bucket_len, key, key_len)) == NULL) {
+		connstruct->last_error = RERR_HTTP;
+		return 1;
+	}
+
+	if(content_type != NULL && strcmp(content_type, "application/json") == 0) {
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, connstruct->json_headers);
+	} else {
+		snprintf(header, sizeof(header), "Content-type: %s", content_type ? content_type : "application/octet-stream");
+		headerlist = curl_slist_append(headerlist, header);
+		headerlist = curl_slist_append(headerlist, "Expect:");
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
+	}
+
+	body.buffer = (char *)data;
+	body.pointer = 0;
+	body.length = len;
+
+	curl_easy_setopt(curl, CURLOPT_URL, address);
+	curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &body);
+	curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)len);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, riak_discard_write);
+
+	res = curl_easy_perform(curl);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	curl_slist_free_all(headerlist);
+
+	if(res != CURLE_OK || status < 200 || status >= 300)
+		connstruct->last_error = RERR_HTTP;
+
+	return connstruct->last_error != RERR_OK;
+}
+
+/**
+ * \brief Headers of HTTP object response collected by riak_http_obj_header.
+ */
+struct http_obj_headers {
+	/** Entity tag without quotes. */
+	char * etag;
+	/** Content type. */
+	char * content_type;
+	/** Vector clock, still base64-encoded. */
+	char * vclock;
+};
+
+/**	\fn char * riak_header_value(const char * line, size_t len, const char * name)
+ * 	\brief Returns newly allocated value of header line if it is header name (case-insensitive); NULL otherwise.
+ *
+ * Surrounding whitespace and double quotes are stripped.
+ */
+static char * riak_header_value(const char * line, size_t len, const char * name) {
+	size_t name_len = strlen(name);
+	const char * end = line+len;
+	char * value;
+
+	if(len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+		return NULL;
+	line += name_len+1;
+	while(line < end && (*line == ' ' || *line == '\t' || *line == '"'))
+		line++;
+	while(end > line && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ' || end[-1] == '"'))
+		end--;
+
+	value = malloc(end-line+1);
+	memcpy(value, line, end-line);
+	value[end-line] = '\0';
+	return value;
+}
+
+/**	\fn size_t riak_http_obj_header(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief cURL header function picking headers describing object into struct http_obj_headers.
+ */
+static size_t riak_http_obj_header(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct http_obj_headers * h = (struct http_obj_headers *)userdata;
+	char * value;
+
+	if((value = riak_header_value(ptr, size*nmemb, "ETag")) != NULL) {
+		free(h->etag);
+		h->etag = value;
+	} else if((value = riak_header_value(ptr, size*nmemb, "Content-Type")) != NULL) {
+		free(h->content_type);
+		h->content_type = value;
+	} else if((value = riak_header_value(ptr, size*nmemb, "X-Riak-Vclock")) != NULL) {
+		free(h->vclock);
+		h->vclock = value;
+	}
+
+	return size*nmemb;
+}
+
+/**	\fn size_t riak_base64_decode(const char * in, char * out)
+ * 	\brief Decodes null-terminated base64 string. Out must have room for 3/4 of input length.
+ *
+ * @return number of decoded bytes
+ */
+static size_t riak_base64_decode(const char * in, char * out) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char * c;
+	__uint32_t acc = 0;
+	int bits = 0;
+	size_t n = 0;
+
+	for(; *in != '\0' && *in != '='; in++) {
+		if((c = strchr(alphabet, *in)) == NULL)
+			continue;
+		acc = (acc << 6) | (c - alphabet);
+		bits += 6;
+		if(bits >= 8) {
+			bits -= 8;
+			out[n++] = (acc >> bits) & 0xFF;
+		}
+	}
+	return n;
+}
+
+/**	\fn int riak_http_get_cond(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT ** obj)
+ * 	\brief Implementation of riak_get_cond.
+ */
+static int riak_http_get_cond(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj) {
+	char * address;
+	CURLcode res;
+	long status = 0, unmet = 0, filetime = -1;
+	struct buffered_char body;
+	struct http_obj_headers hdrs;
+	struct curl_slist * headerlist = NULL, * tmplist;
+	RIAK_OBJECT * newobj;
+	char * tmp;
+	CURL * curl;
+
+	connstruct->last_error = RERR_OK;
+	if(key == NULL || obj == NULL)
+		return 1;
+	if(!(connstruct->transports & RIAK_TRANSPORT_HTTP)) {
+		connstruct->last_error = RERR_NO_TRANSPORT;
+		return 1;
+	}
+
+	if((curl = riak_curl_handle(connstruct)) == NULL)
+		return 1;
+	if((address = riak_object_url(connstruct, bucket, bucket_len, key, key_len)) == NULL) {
+		connstruct->last_error = RERR_HTTP;
+		return 1;
+	}
+
+	/* Validators of copy we already have */
+	if(*obj != NULL && (*obj)->vtag != NULL) {
+		if((tmp = malloc(strlen((*obj)->vtag)+sizeof("If-None-Match: \"\""))) == NULL) {
+			connstruct->last_error = RERR_GET;
+			return 1;
+		}
+		sprintf(tmp, "If-None-Match: \"%s\"", (*obj)->vtag);
+		tmplist = curl_slist_append(headerlist, tmp);
+		free(tmp);
+		if(tmplist == NULL) {
+			connstruct->last_error = RERR_GET;
+			return 1;
+		}
+		headerlist = tmplist;
+	}
+	if(*obj != NULL && (*obj)->last_mod != 0) {
+		curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)(*obj)->last_mod);
+	}
+
+	memset(&hdrs, 0, sizeof(hdrs));
+	body.buffer = NULL;
+	body.pointer = 0;
+	body.length = 0;
+
+	curl_easy_setopt(curl, CURLOPT_URL, address);
+	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, riak_http_obj_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hdrs);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+
+	res = curl_easy_perform(curl);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
+	curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
+	curl_slist_free_all(headerlist);
+
+	newobj = NULL;
+	if(res != CURLE_OK) {
+		connstruct->last_error = RERR_HTTP;
+	} else if(status == 304 || unmet) {
+		/* Not modified - copy of caller stays valid */
+		connstruct->last_error = RERR_UNCHANGED;
+	} else if(status == 404) {
+		connstruct->last_error = RERR_NOT_FOUND;
+	} else if(status != 200) {
+		connstruct->last_error = RERR_GET;
+	} else if((newobj = calloc(1, sizeof(RIAK_OBJECT))) == NULL || (newobj->value = malloc(body.pointer+1)) == NULL
+			|| (hdrs.vclock != NULL && (newobj->vclock = malloc(strlen(hdrs.vclock)/4*3+3)) == NULL)) {
+		riak_object_free(newobj);
+		newobj = NULL;
+		connstruct->last_error = RERR_GET;
+	} else {
+		if(body.pointer > 0)
+			memcpy(newobj->value, body.buffer, body.pointer);
+		newobj->value[body.pointer] = '\0';
+		newobj->value_len = body.pointer;
+		newobj->content_type = hdrs.content_type;
+		newobj->vtag = hdrs.etag;
+		newobj->last_mod = filetime > 0 ? filetime : 0;
+		if(hdrs.vclock != NULL)
+			newobj->vclock_len = riak_base64_decode(hdrs.vclock, newobj->vclock);
+		newobj->n_siblings = 1;
+		hdrs.content_type = NULL;
+		hdrs.etag = NULL;
+	}
+
+	free(hdrs.etag);
+	free(hdrs.content_type);
+	free(hdrs.vclock);
+	riak_buf_free(body.buffer);
+
+	if(newobj == NULL)
+		return connstruct->last_error != RERR_UNCHANGED;
+
+	riak_object_free(*obj);
+	*obj = newobj;
+	return 0;
+}
+
+/**	\fn int riak_http_put_json_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len, json_object * elem)
+ * 	\brief Implementation of riak_put_json_len.
+ */
+static int riak_http_put_json_len(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		json_object * elem) {
+	const char * data;
+
+	if((key == NULL)||(elem == NULL))
+		return 1;
+
+	data = json_object_to_json_string(elem);
+
+	return core->put(connstruct, bucket, bucket_len, key, key_len, data, strlen(data), "application/json");
+}
+
+/**
+ * \brief State of streaming decoder of JSON array elements.
+ *
+ * Bytes of HTTP body are fed as they arrive. Everything before opening bracket of array is skipped,
+ * then every element is parsed with json_tokener_parse_ex and passed to callback as soon as it is complete.
+ */
+struct riak_json_stream {
+	/** Tokener of currently parsed element. */
+	struct json_tokener * tok;
+	/** Current state of decoder. */
+	enum {
+		RIAK_JSON_BEFORE_ARRAY,
+		RIAK_JSON_BETWEEN,
+		RIAK_JSON_ELEMENT,
+		RIAK_JSON_DONE,
+		RIAK_JSON_ERROR
+	} state;
+	/** Function receiving decoded elements. */
+	riak_json_callback callback;
+	/** Pointer passed to callback. */
+	void * userdata;
+	/** Set when callback asked to stop. */
+	int stopped;
+	/** If not NULL, array is searched for only after this string (e.g. key of array in enclosing object). */
+	const char * marker;
+	/** Number of marker characters matched so far. */
+	size_t marker_pos;
+	/** If not NULL, elements are decoded by worker pool instead of tok. */
+	struct riak_decoder * dec;
+	/** If not NULL, body is also kept in this flight for threads running identical job. */
+	struct riak_mapred_flight * flight;
+};
+
+/** Chunk of elements is handed to workers when its text reaches this size. */
+#define RIAK_DECODE_CHUNK (64*1024)
+/** Upper limit of decoding worker threads. */
+#define RIAK_DECODE_MAX_THREADS 64
+/** Chunks in flight per worker thread; bounds memory used by one decoder. */
+#define RIAK_DECODE_PER_THREAD 4
+
+/**
+ * \brief Run of consecutive array elements decoded by one worker.
+ */
+struct riak_decode_chunk {
+	/** Texts of elements, each terminated with '\0'. Pool buffer. */
+	char * text;
+	/** Used bytes of text. */
+	size_t len;
+	/** Allocated size of text. */
+	size_t alloc;
+	/** Offsets of elements in text. */
+	size_t * starts;
+	/** Number of complete elements. */
+	int n;
+	/** Allocated size of starts. */
+	int alloc_n;
+	/** Decoded elements, filled by worker; NULL for element which isn't valid JSON. */
+	json_object ** elems;
+	/** Set by worker when elems are ready. */
+	int done;
+	/** Decoder which chunk belongs to. */
+	struct riak_decoder * dec;
+	/** Next chunk of the same decoder, in order of arrival. */
+	struct riak_decode_chunk * next;
+	/** Next chunk in queue of workers. */
+	struct riak_decode_chunk * next_job;
+};
+
+/**
+ * \brief Parallel decoder of JSON array elements.
+ *
+ * Element boundaries are found by light scan (only strings and nesting are tracked), texts of elements
+ * are grouped into chunks and decoded by shared worker pool while transfer goes on. Thread feeding
+ * the stream passes decoded elements to callback in original order.
+ */
+struct riak_decoder {
+	/** Chunk being filled. */
+	struct riak_decode_chunk * fill;
+	/** Oldest submitted chunk which wasn't delivered yet. */
+	struct riak_decode_chunk * head;
+	/** Newest submitted chunk. */
+	struct riak_decode_chunk * tail;
+	/** Number of submitted chunks which weren't delivered yet. */
+	int pending;
+	/** When pending reaches this limit, feeding thread waits for oldest chunk. */
+	int max_pending;
+	/** Signalled (with decode_lock held) when chunk of this decoder is done. */
+	pthread_cond_t cond;
+	/** Nesting depth in current element. */
+	int depth;
+	/** Non-zero inside string. */
+	int in_string;
+	/** Non-zero after backslash in string. */
+	int escape;
+};
+
+/** Guards queue of workers and chunk lists of all decoders. */
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when chunk is queued. */
+static pthread_cond_t decode_work = PTHREAD_COND_INITIALIZER;
+/** Queue of chunks waiting for worker. */
+static struct riak_decode_chunk * decode_queue = NULL;
+/** Last chunk in decode_queue. */
+static struct riak_decode_chunk * decode_queue_tail = NULL;
+/** Number of started worker threads. */
+static int decode_threads = 0;
+
+/**	\fn void * riak_decode_worker(void * arg)
+ * 	\brief Worker thread decoding queued chunks. Runs until process exits.
+ */
+static void * riak_decode_worker(void * arg) {
+	struct json_tokener * tok = json_tokener_new();
+	struct riak_decode_chunk * chunk;
+	size_t end;
+	int i;
+
+	for(;;) {
+		pthread_mutex_lock(&decode_lock);
+		while(decode_queue == NULL)
+			pthread_cond_wait(&decode_work, &decode_lock);
+		chunk = decode_queue;
+		if((decode_queue = chunk->next_job) == NULL)
+			decode_queue_tail = NULL;
+		pthread_mutex_unlock(&decode_lock);
+
+		for(i = 0; i < chunk->n; i++) {
+			end = i+1 < chunk->n ? chunk->starts[i+1] : chunk->len;
+			json_tokener_reset(tok);
+			/* Length includes terminating '\0', which ends numbers and literals */
+			chunk->elems[i] = json_tokener_parse_ex(tok, chunk->text+chunk->starts[i], end-chunk->starts[i]);
+		}
+
+		pthread_mutex_lock(&decode_lock);
+		chunk->done = 1;
+		pthread_cond_signal(&chunk->dec->cond);
+		pthread_mutex_unlock(&decode_lock);
+	}
+
+	return NULL;
+}
+
+/**	\fn struct riak_decoder * riak_decoder_new(int threads)
+ * 	\brief Creates parallel decoder, starting worker threads if pool has less than threads of them.
+ *
+ * @return decoder; NULL if no worker could be started (elements should be decoded in place then)
+ */
+static struct riak_decoder * riak_decoder_new(int threads) {
+	struct riak_decoder * dec;
+	pthread_t thread;
+
+	if(threads > RIAK_DECODE_MAX_THREADS)
+		threads = RIAK_DECODE_MAX_THREADS;
+
+	pthread_mutex_lock(&decode_lock);
+	while(decode_threads < threads) {
+		if(pthread_create(&thread, NULL, riak_decode_worker, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		decode_threads++;
+	}
+	pthread_mutex_unlock(&decode_lock);
+
+	if(decode_threads == 0 || (dec = calloc(1, sizeof(struct riak_decoder))) == NULL)
+		return NULL;
+	pthread_cond_init(&dec->cond, NULL);
+	dec->max_pending = RIAK_DECODE_PER_THREAD*threads;
+
+	return dec;
+}
+
+/**	\fn void riak_decode_chunk_free(struct riak_decode_chunk * chunk)
+ * 	\brief Frees chunk, but not decoded elements.
+ */
+static void riak_decode_chunk_free(struct riak_decode_chunk * chunk) {
+	riak_buf_free(chunk->text);
+	free(chunk->starts);
+	free(chunk->elems);
+	free(chunk);
+}
+
+/**	\fn int riak_decoder_begin(struct riak_decoder * dec)
+ * 	\brief Starts new element in chunk being filled.
+ *
+ * @return 0 on success, 1 on allocation failure
+ */
+static int riak_decoder_begin(struct riak_decoder * dec) {
+	struct riak_decode_chunk * chunk;
+	size_t * tmp;
+
+	if(dec->fill == NULL) {
+		if((chunk = calloc(1, sizeof(struct riak_decode_chunk))) == NULL)
+			return 1;
+		chunk->dec = dec;
+		chunk->alloc = RIAK_DECODE_CHUNK;
+		chunk->alloc_n = 64;
+		chunk->text = riak_buf_alloc(chunk->alloc);
+		chunk->starts = malloc(chunk->alloc_n*sizeof(size_t));
+		if(chunk->text == NULL || chunk->starts == NULL) {
+			riak_decode_chunk_free(chunk);
+			return 1;
+		}
+		dec->fill = chunk;
+	}
+	chunk = dec->fill;
+
+	if(chunk->n == chunk->alloc_n) {
+		if((tmp = realloc(chunk->starts, 2*chunk->alloc_n*sizeof(size_t))) == NULL)
+			return 1;
+		chunk->starts = tmp;
+		chunk->alloc_n *= 2;
+	}
+	chunk->starts[chunk->n] = chunk->len;
+	dec->depth = 0;
+	dec->in_string = 0;
+	dec->escape = 0;
+
+	return 0;
+}
+
+/**	\fn size_t riak_decoder_scan(struct riak_decoder * dec, const char * data, size_t len, int * complete)
+ * 	\brief Finds end of current element.
+ *
+ * @param complete set to 1 if element ends in data
+ *
+ * @return number of bytes of data belonging to element
+ */
+static size_t riak_decoder_scan(struct riak_decoder * dec, const char * data, size_t len, int * complete) {
+	size_t i;
+
+	*complete = 0;
+	for(i = 0; i < len; i++) {
+		if(dec->in_string) {
+			if(dec->escape)
+				dec->escape = 0;
+			else if(data[i] == '\\')
+				dec->escape = 1;
+			else if(data[i] == '"')
+				dec->in_string = 0;
+			continue;
+		}
+		switch(data[i]) {
+		case '"':
+			dec->in_string = 1;
+			break;
+		case '{':
+		case '[':
+			dec->depth++;
+			break;
+		case '}':
+		case ']':
+			/* At depth 0 it closes whole array, after scalar element */
+			if(dec->depth == 0) {
+				*complete = 1;
+				return i;
+			}
+			if(--dec->depth == 0) {
+				*complete = 1;
+				return i+1;
+			}
+			break;
+		case ',':
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			if(dec->depth == 0) {
+				*complete = 1;
+				return i;
+			}
+			break;
+		}
+	}
+
+	return len;
+}
+
+/**	\fn int riak_decoder_append(struct riak_decoder * dec, const char * data, size_t len)
+ * 	\brief Appends part of element text to chunk being filled, leaving room for terminating '\0'.
+ *
+ * @return 0 on success, 1 on allocation failure
+ */
+static int riak_decoder_append(struct riak_decoder * dec, const char * data, size_t len) {
+	struct riak_decode_chunk * chunk = dec->fill;
+	size_t size;
+	char * tmp;
+
+	if(chunk->len+len+1 > chunk->alloc) {
+		for(size = 2*chunk->alloc; size < chunk->len+len+1; size *= 2)
+			;
+		if((tmp = riak_buf_realloc(chunk->text, size)) == NULL)
+			return 1;
+		chunk->text = tmp;
+		chunk->alloc = size;
+	}
+	memcpy(chunk->text+chunk->len, data, len);
+	chunk->len += len;
+
+	return 0;
+}
+
+/**	\fn int riak_decoder_deliver(struct riak_json_stream * js, int max_left)
+ * 	\brief Passes elements of decoded chunks to callback, in order.
+ *
+ * Stops at first chunk which isn't decoded yet, unless more than max_left chunks are pending - then waits for it.
+ * Elements following error or stop requested by callback are freed.
+ *
+ * @return 0 if decoding should continue, 1 if callback asked to stop or element isn't valid JSON
+ */
+static int riak_decoder_deliver(struct riak_json_stream * js, int max_left) {
+	struct riak_decoder * dec = js->dec;
+	struct riak_decode_chunk * chunk;
+	int i;
+
+	pthread_mutex_lock(&decode_lock);
+	while(dec->head != NULL) {
+		if(!dec->head->done) {
+			if(dec->pending <= max_left)
+				break;
+			pthread_cond_wait(&dec->cond, &decode_lock);
+			continue;
+		}
+		chunk = dec->head;
+		if((dec->head = chunk->next) == NULL)
+			dec->tail = NULL;
+		dec->pending--;
+		pthread_mutex_unlock(&decode_lock);
+
+		for(i = 0; i < chunk->n; i++) {
+			if(js->stopped || js->state == RIAK_JSON_ERROR)
+				json_object_put(chunk->elems[i]);
+			else if(chunk->elems[i] == NULL)
+				js->state = RIAK_JSON_ERROR;
+			else if(js->callback(chunk->elems[i], js->userdata) != 0)
+				js->stopped = 1;
+		}
+		riak_decode_chunk_free(chunk);
+
+		pthread_mutex_lock(&decode_lock);
+	}
+	pthread_mutex_unlock(&decode_lock);
+
+	return js->stopped || js->state == RIAK_JSON_ERROR;
+}
+
+/**	\fn int riak_decoder_submit(struct riak_json_stream * js)
+ * 	\brief Hands chunk being filled to workers, then delivers chunks which are already decoded.
+ *
+ * @return 0 if decoding should continue, 1 if it should stop
+ */
+static int riak_decoder_submit(struct riak_json_stream * js) {
+	struct riak_decoder * dec = js->dec;
+	struct riak_decode_chunk * chunk = dec->fill;
+
+	if(chunk == NULL)
+		return 0;
+	dec->fill = NULL;
+	if(chunk->n == 0) {
+		riak_decode_chunk_free(chunk);
+		return 0;
+	}
+	if((chunk->elems = malloc(chunk->n*sizeof(json_object *))) == NULL) {
+		riak_decode_chunk_free(chunk);
+		js->state = RIAK_JSON_ERROR;
+		return 1;
+	}
+
+	pthread_mutex_lock(&decode_lock);
+	if(dec->tail != NULL)
+		dec->tail->next = chunk;
+	else
+		dec->head = chunk;
+	dec->tail = chunk;
+	dec->pending++;
+	if(decode_queue_tail != NULL)
+		decode_queue_tail->next_job = chunk;
+	else
+		decode_queue = chunk;
+	decode_queue_tail = chunk;
+	pthread_cond_signal(&decode_work);
+	pthread_mutex_unlock(&decode_lock);
+
+	return riak_decoder_deliver(js, dec->max_pending-1);
+}
+
+/**	\fn int riak_decoder_end(struct riak_json_stream * js)
+ * 	\brief Finishes current element; submits chunk if it is big enough.
+ *
+ * @return 0 if decoding should continue, 1 if it should stop
+ */
+static int riak_decoder_end(struct riak_json_stream * js) {
+	struct riak_decode_chunk * chunk = js->dec->fill;
+
+	/* Only stray closing bracket gives empty element */
+	if(chunk->len == chunk->starts[chunk->n]) {
+		js->state = RIAK_JSON_ERROR;
+		return 1;
+	}
+	chunk->text[chunk->len++] = '\0';
+	chunk->n++;
+
+	if(chunk->len < RIAK_DECODE_CHUNK)
+		return 0;
+	return riak_decoder_submit(js);
+}
+
+/**	\fn void riak_decoder_free(struct riak_decoder * dec)
+ * 	\brief Waits for workers to finish chunks of decoder and frees it with all undelivered elements.
+ */
+static void riak_decoder_free(struct riak_decoder * dec) {
+	struct riak_decode_chunk * chunk;
+	int i;
+
+	pthread_mutex_lock(&decode_lock);
+	while((chunk = dec->head) != NULL) {
+		if(!chunk->done) {
+			pthread_cond_wait(&dec->cond, &decode_lock);
+			continue;
+		}
+		dec->head = chunk->next;
+		for(i = 0; i < chunk->n; i++)
+			json_object_put(chunk->elems[i]);
+		riak_decode_chunk_free(chunk);
+	}
+	pthread_mutex_unlock(&decode_lock);
+
+	if(dec->fill != NULL)
+		riak_decode_chunk_free(dec->fill);
+	pthread_cond_destroy(&dec->cond);
+	free(dec);
+}
+
+/**	\fn int riak_json_stream_feed(struct riak_json_stream * js, const char * data, size_t len)
+ * 	\brief Feeds next part of body to streaming JSON decoder.
+ *
+ * @return 0 if decoding should continue, 1 if it is finished, stopped by callback or failed
+ */
+static int riak_json_stream_feed(struct riak_json_stream * js, const char * data, size_t len) {
+	const char * end = data+len;
+	json_object * elem;
+	int complete;
+	size_t n;
+
+	while(data < end) {
+		switch(js->state) {
+		case RIAK_JSON_BEFORE_ARRAY:
+			while(js->marker != NULL && js->marker[js->marker_pos] != '\0') {
+				if(data == end)
+					return 0;
+				if(*data == js->marker[js->marker_pos])
+					js->marker_pos++;
+				else
+					js->marker_pos = (*data == js->marker[0]);
+				data++;
+			}
+			if((data = memchr(data, '[', end-data)) == NULL)
+				return 0;
+			data++;
+			js->state = RIAK_JSON_BETWEEN;
+			break;
+		case RIAK_JSON_BETWEEN:
+			if(*data == ']') {
+				js->state = RIAK_JSON_DONE;
+			} else if(*data != ',' && *data != ' ' && *data != '\t' && *data != '\r' && *data != '\n') {
+				if(js->dec != NULL) {
+					if(riak_decoder_begin(js->dec) != 0) {
+						js->state = RIAK_JSON_ERROR;
+						return 1;
+					}
+				} else {
+					json_tokener_reset(js->tok);
+				}
+				js->state = RIAK_JSON_ELEMENT;
+				continue;
+			}
+			data++;
+			break;
+		case RIAK_JSON_ELEMENT:
+			if(js->dec != NULL) {
+				n = riak_decoder_scan(js->dec, data, end-data, &complete);
+				if(riak_decoder_append(js->dec, data, n) != 0) {
+					js->state = RIAK_JSON_ERROR;
+					return 1;
+				}
+				data += n;
+				if(!complete)
+					return 0;
+				js->state = RIAK_JSON_BETWEEN;
+				if(riak_decoder_end(js) != 0)
+					return 1;
+				break;
+			}
+			elem = json_tokener_parse_ex(js->tok, data, end-data);
+			if(elem == NULL) {
+				if(js->tok->err != json_tokener_continue) {
+					js->state = RIAK_JSON_ERROR;
+					return 1;
+				}
+				/* Element continues in next part of body */
+				return 0;
+			}
+			data += js->tok->char_offset;
+			js->state = RIAK_JSON_BETWEEN;
+			if(js->callback(elem, js->userdata) != 0) {
+				js->stopped = 1;
+				return 1;
+			}
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	return js->state == RIAK_JSON_DONE;
+}
+
+/** Largest MapReduce result body kept for threads waiting for identical job; bigger jobs aren't shared. */
+#define RIAK_MAPRED_SHARE_MAX (4*1024*1024)
+
+/**
+ * \brief MapReduce job in progress, shared by threads sending identical statement to the same server.
+ *
+ * Thread which sent the job (leader) keeps copy of response body. Threads which want to run the same job
+ * meanwhile wait for it and decode kept body themselves, instead of sending job again.
+ */
+struct riak_mapred_flight {
+	/** Next flight in mapred_flights. */
+	struct riak_mapred_flight * next;
+	/** Broadcast when result is set. */
+	pthread_cond_t done;
+	/** 0 while job runs, 1 if body is complete, -1 if job failed or body was too big to keep. */
+	int result;
+	/** Non-zero while flight is on mapred_flights and can be joined. */
+	int listed;
+	/** Number of threads holding flight (leader and waiters); last one frees it. */
+	int refs;
+	/** Hash of address and statement. */
+	unsigned long hash;
+	/** Kept response body (pool buffer). */
+	char * body;
+	/** Length of body. */
+	size_t body_len;
+	/** Allocated size of body. */
+	size_t body_alloc;
+	/** Length of server address. */
+	size_t addr_len;
+	/** Length of statement. */
+	size_t statement_len;
+	/** Server address, then statement. */
+	char data[];
+};
+
+/** Guards mapred_flights and all flights on it. */
+static pthread_mutex_t mapred_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+/** MapReduce jobs which can be joined. */
+static struct riak_mapred_flight * mapred_flights = NULL;
+
+/**	\fn void riak_mapred_release(struct riak_mapred_flight * f)
+ * 	\brief Drops reference to flight, freeing it if it was the last one. mapred_flight_lock must be held.
+ */
+static void riak_mapred_release(struct riak_mapred_flight * f) {
+	if(--f->refs > 0)
+		return;
+	riak_buf_free(f->body);
+	pthread_cond_destroy(&f->done);
+	free(f);
+}
+
+/**	\fn void riak_mapred_land(struct riak_mapred_flight * f, int result)
+ * 	\brief Sets result of flight led by caller, wakes threads waiting for it and drops leader's reference.
+ */
+static void riak_mapred_land(struct riak_mapred_flight * f, int result) {
+	struct riak_mapred_flight ** link;
+
+	pthread_mutex_lock(&mapred_flight_lock);
+	if(f->listed) {
+		for(link = &mapred_flights; *link != f; link = &(*link)->next)
+			;
+		*link = f->next;
+		f->listed = 0;
+	}
+	f->result = result;
+	pthread_cond_broadcast(&f->done);
+	riak_mapred_release(f);
+	pthread_mutex_unlock(&mapred_flight_lock);
+}
+
+/**	\fn struct riak_mapred_flight * riak_mapred_join(RIAK_CONN * connstruct, const char * statement, size_t statement_len, int share, int * shared)
+ * 	\brief Waits for identical job sent to the same server by other thread, or starts flight of caller's job.
+ *
+ * @param share if 0, caller neither waits for other jobs nor lets others wait for its own; flight only keeps body
+ * 		(for memoizing it)
+ * @param shared set to 1 if job of other thread finished and its body (f->body) should be decoded by caller,
+ * 		which then must release flight; 0 if caller leads returned flight and must land it
+ *
+ * @return flight; NULL if job isn't shared (also when job waited for failed - caller sends its own)
+ */
+static struct riak_mapred_flight * riak_mapred_join(RIAK_CONN * connstruct, const char * statement, size_t statement_len,
+		int share, int * shared) {
+	struct riak_mapred_flight * f;
+	unsigned long hash = 5381;
+	size_t i;
+
+	*shared = 0;
+	for(i = 0; i < connstruct->addr_len; i++)
+		hash = hash*33 + (unsigned char)connstruct->addr[i];
+	for(i = 0; i < statement_len; i++)
+		hash = hash*33 + (unsigned char)statement[i];
+
+	pthread_mutex_lock(&mapred_flight_lock);
+	for(f = share ? mapred_flights : NULL; f != NULL; f = f->next) {
+		if(f->hash == hash && f->addr_len == connstruct->addr_len && f->statement_len == statement_len
+				&& memcmp(f->data, connstruct->addr, f->addr_len) == 0
+				&& memcmp(f->data+f->addr_len, statement, statement_len) == 0)
+			break;
+	}
+
+	if(f != NULL) {
+		f->refs++;
+		while(f->result == 0)
+			pthread_cond_wait(&f->done, &mapred_flight_lock);
+		if(f->result > 0) {
+			/* Body doesn't change any more, and is kept by our reference */
+			*shared = 1;
+		} else {
+			riak_mapred_release(f);
+			f = NULL;
+		}
+		pthread_mutex_unlock(&mapred_flight_lock);
+		return f;
+	}
+
+	if((f = malloc(sizeof(struct riak_mapred_flight) + connstruct->addr_len + statement_len)) != NULL) {
+		pthread_cond_init(&f->done, NULL);
+		f->result = 0;
+		f->listed = share;
+		f->refs = 1;
+		f->hash = hash;
+		f->body = NULL;
+		f->body_len = 0;
+		f->body_alloc = 0;
+		f->addr_len = connstruct->addr_len;
+		f->statement_len = statement_len;
+		memcpy(f->data, connstruct->addr, connstruct->addr_len);
+		memcpy(f->data+f->addr_len, statement, statement_len);
+		f->next = share ? mapred_flights : NULL;
+		if(share)
+			mapred_flights = f;
+	}
+	pthread_mutex_unlock(&mapred_flight_lock);
+
+	return f;
+}
+
+/**	\fn int riak_mapred_keep(struct riak_mapred_flight * f, const char * data, size_t len)
+ * 	\brief Appends part of body to flight. Only leader writes body, so no lock is needed.
+ *
+ * @return 0 on success, 1 if body is too big to keep or out of memory
+ */
+static int riak_mapred_keep(struct riak_mapred_flight * f, const char * data, size_t len) {
+	size_t size;
+	char * tmp;
+
+	if(f->body_len + len > RIAK_MAPRED_SHARE_MAX)
+		return 1;
+	if(f->body_len + len > f->body_alloc) {
+		for(size = f->body_alloc ? f->body_alloc : 16384; size < f->body_len + len; size *= 2)
+			;
+		if((tmp = riak_buf_realloc(f->body, size)) == NULL)
+			return 1;
+		f->body = tmp;
+		f->body_alloc = size;
+	}
+	memcpy(f->body+f->body_len, data, len);
+	f->body_len += len;
+
+	return 0;
+}
+
+/**	\fn size_t riak_json_stream_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief cURL write function feeding body to struct riak_json_stream.
+ *
+ * Returns 0 (which makes cURL abort transfer) when callback asked to stop or body isn't valid JSON.
+ */
+static size_t riak_json_stream_write(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct riak_json_stream * js = (struct riak_json_stream *)userdata;
+
+	if(js->flight != NULL && riak_mapred_keep(js->flight, ptr, size*nmemb) != 0) {
+		/* Waiting threads send their own jobs rather than wait for body which can't be kept */
+		riak_mapred_land(js->flight, -1);
+		js->flight = NULL;
+	}
+	if(js->state == RIAK_JSON_DONE)
+		return size*nmemb;
+	if(riak_json_stream_feed(js, ptr, size*nmemb) != 0 && js->state != RIAK_JSON_DONE)
+		return 0;
+
+	return size*nmemb;
+}
+
+/**	\fn long long riak_now_ms(void)
+ * 	\brief Returns monotonic time in milliseconds.
+ */
+static long long riak_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/** Memoized result is refreshed in background during last 1/RIAK_MAPRED_REFRESH_PART of its time to live. */
+#define RIAK_MAPRED_REFRESH_PART 5
+
+/**
+ * \brief Memoized result of MapReduce job.
+ *
+ * Raw response body is kept and decoded anew for every caller: callers own decoded elements and may change them,
+ * and reference counts of json-c objects aren't thread-safe, so decoded elements can't be handed out twice.
+ */
+struct riak_mapred_result {
+	/** Previous result on LRU list of cache (more recently used). */
+	struct riak_mapred_result * prev;
+	/** Next result on LRU list of cache (less recently used). */
+	struct riak_mapred_result * next;
+	/** Hash of key. */
+	unsigned long hash;
+	/** Time when body was received (riak_now_ms). */
+	long long stored;
+	/** Non-zero while background refresh of result runs. */
+	int refreshing;
+	/** Number of holders: list of cache and callers decoding body. Last one frees result. */
+	int refs;
+	/** Length of key. */
+	size_t key_len;
+	/** Length of body. */
+	size_t body_len;
+	/** Key (see riak_mapred_key), then body. */
+	char data[];
+};
+
+/**
+ * \brief Cache of MapReduce results (RIAK_MAPRED_CACHE).
+ */
+struct riak_mapred_cache {
+	/** Guards all fields of cache and of its results. */
+	pthread_mutex_t lock;
+	/** Most recently used result. */
+	struct riak_mapred_result * head;
+	/** Least recently used result, evicted first. */
+	struct riak_mapred_result * tail;
+	/** Memory taken by results on list. */
+	size_t bytes;
+	/** Limit of bytes. */
+	size_t max_bytes;
+	/** Time to live of results in milliseconds. */
+	unsigned int ttl_ms;
+	/** Owner and running background refreshes; last one frees cache. */
+	int refs;
+	/** Set by riak_mapred_cache_free; refreshes finishing later drop their results. */
+	int freed;
+};
+
+/**
+ * \brief Background refresh of memoized result.
+ */
+struct riak_mapred_refresh {
+	/** Cache to which result is stored. */
+	RIAK_MAPRED_CACHE * cache;
+	/** Non-zero if response may be compressed. */
+	int compression;
+	/** Hash of key. */
+	unsigned long hash;
+	/** Length of server address at the beginning of key. */
+	size_t addr_len;
+	/** Length of key. */
+	size_t key_len;
+	/** Key, then job address (server address and "/mapred", null-terminated). */
+	char data[];
+};
+
+/**	\fn char * riak_mapred_key(const char * addr, size_t addr_len, const char * statement, size_t statement_len, size_t * key_len, unsigned long * hash)
+ * 	\brief Builds key of memoized result: server address, newline and statement normalized by dropping whitespace
+ * outside of JSON strings, so that jobs differing only in formatting share result.
+ *
+ * Normalized statement is equivalent to original one, so background refresh sends it as job.
+ *
+ * @return key, which should be freed with free; NULL if out of memory
+ */
+static char * riak_mapred_key(const char * addr, size_t addr_len, const char * statement, size_t statement_len,
+		size_t * key_len, unsigned long * hash) {
+	unsigned long h = 5381;
+	int in_string = 0, escaped = 0;
+	char * key, * out;
+	size_t i;
+	char c;
+
+	if((key = malloc(addr_len + 1 + statement_len)) == NULL)
+		return NULL;
+	memcpy(key, addr, addr_len);
+	out = key+addr_len;
+	*out++ = '\n';
+	for(i = 0; i < statement_len; i++) {
+		c = statement[i];
+		if(in_string) {
+			if(escaped)
+				escaped = 0;
+			else if(c == '\\')
+				escaped = 1;
+			else if(c == '"')
+				in_string = 0;
+		} else if(c == '"') {
+			in_string = 1;
+		} else if(c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			continue;
+		}
+		*out++ = c;
+	}
+	*key_len = out-key;
+
+	for(i = 0; i < *key_len; i++)
+		h = h*33 + (unsigned char)key[i];
+	*hash = h;
+
+	return key;
+}
+
+/**	\fn void riak_mapred_result_release(struct riak_mapred_result * r)
+ * 	\brief Drops reference to result, freeing it if it was the last one. Lock of cache must be held.
+ */
+static void riak_mapred_result_release(struct riak_mapred_result * r) {
+	if(--r->refs == 0)
+		free(r);
+}
+
+/**	\fn void riak_mapred_result_unlink(RIAK_MAPRED_CACHE * cache, struct riak_mapred_result * r)
+ * 	\brief Takes result off LRU list, without dropping reference of list. Lock of cache must be held.
+ */
+static void riak_mapred_result_unlink(RIAK_MAPRED_CACHE * cache, struct riak_mapred_result * r) {
+	if(r->prev != NULL)
+		r->prev->next = r->next;
+	else
+		cache->head = r->next;
+	if(r->next != NULL)
+		r->next->prev = r->prev;
+	else
+		cache->tail = r->prev;
+}
+
+/**	\fn void riak_mapred_result_drop(RIAK_MAPRED_CACHE * cache, struct riak_mapred_result * r)
+ * 	\brief Removes result from cache. Callers still decoding it keep it until they are done. Lock of cache must be held.
+ */
+static void riak_mapred_result_drop(RIAK_MAPRED_CACHE * cache, struct riak_mapred_result * r) {
+	riak_mapred_result_unlink(cache, r);
+	cache->bytes -= sizeof(struct riak_mapred_result) + r->key_len + r->body_len;
+	riak_mapred_result_release(r);
+}
+
+/**	\fn struct riak_mapred_result * riak_mapred_result_find(RIAK_MAPRED_CACHE * cache, const char * key, size_t key_len, unsigned long hash)
+ * 	\brief Finds result by key. Lock of cache must be held.
+ *
+ * Cache holds results of few distinct jobs, so list is simply scanned.
+ *
+ * @return result; NULL if there is none
+ */
+static struct riak_mapred_result * riak_mapred_result_find(RIAK_MAPRED_CACHE * cache, const char * key, size_t key_len,
+		unsigned long hash) {
+	struct riak_mapred_result * r;
+
+	for(r = cache->head; r != NULL; r = r->next) {
+		if(r->hash == hash && r->key_len == key_len && memcmp(r->data, key, key_len) == 0)
+			return r;
+	}
+	return NULL;
+}
+
+/**	\fn void riak_mapred_cache_store(RIAK_MAPRED_CACHE * cache, const char * key, size_t key_len, unsigned long hash, const char * body, size_t body_len)
+ * 	\brief Memoizes complete response body of job, replacing previous result and evicting least recently used ones
+ * to stay within limit of cache.
+ */
+static void riak_mapred_cache_store(RIAK_MAPRED_CACHE * cache, const char * key, size_t key_len, unsigned long hash,
+		const char * body, size_t body_len) {
+	size_t size = sizeof(struct riak_mapred_result) + key_len + body_len;
+	struct riak_mapred_result * r, * old;
+
+	if(size > cache->max_bytes || (r = malloc(size)) == NULL)
+		return;
+	r->prev = NULL;
+	r->hash = hash;
+	r->stored = riak_now_ms();
+	r->refreshing = 0;
+	r->refs = 1;
+	r->key_len = key_len;
+	r->body_len = body_len;
+	memcpy(r->data, key, key_len);
+	memcpy(r->data+key_len, body, body_len);
+
+	pthread_mutex_lock(&cache->lock);
+	if(cache->freed) {
+		pthread_mutex_unlock(&cache->lock);
+		free(r);
+		return;
+	}
+	if((old = riak_mapred_result_find(cache, key, key_len, hash)) != NULL)
+		riak_mapred_result_drop(cache, old);
+	r->next = cache->head;
+	if(cache->head != NULL)
+		cache->head->prev = r;
+	else
+		cache->tail = r;
+	cache->head = r;
+	cache->bytes += size;
+	while(cache->bytes > cache->max_bytes)
+		riak_mapred_result_drop(cache, cache->tail);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**	\fn void riak_mapred_cache_destroy(RIAK_MAPRED_CACHE * cache)
+ * 	\brief Frees cache after its last reference was dropped. Results are already dropped by riak_mapred_cache_free.
+ */
+static void riak_mapred_cache_destroy(RIAK_MAPRED_CACHE * cache) {
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/**	\fn int riak_mapred_discard(json_object * elem, void * userdata)
+ * 	\brief Callback of riak_json_stream which only frees elements; used to validate body.
+ */
+static int riak_mapred_discard(json_object * elem, void * userdata) {
+	json_object_put(elem);
+	return 0;
+}
+
+/**	\fn void * riak_mapred_refresh_run(void * arg)
+ * 	\brief Thread running background refresh (struct riak_mapred_refresh) of memoized result.
+ *
+ * Job is sent through its own cURL handle. Only complete result which decodes correctly replaces the one being
+ * served; on failure result is left to expire, and next caller near its expiry starts another refresh.
+ */
+static void * riak_mapred_refresh_run(void * arg) {
+	struct riak_mapred_refresh * job = (struct riak_mapred_refresh *)arg;
+	RIAK_MAPRED_CACHE * cache = job->cache;
+	struct buffered_char body = { NULL, 0, 0 };
+	struct riak_mapred_result * r;
+	struct curl_slist * headers;
+	struct riak_json_stream js;
+	CURLcode res = CURLE_FAILED_INIT;
+	long status = 0;
+	int done = 0, last;
+	CURL * curl;
+
+	if((curl = curl_easy_init()) != NULL) {
+		riak_curl_setup(curl);
+		headers = curl_slist_append(NULL, "Content-type: application/json");
+		headers = curl_slist_append(headers, "Expect:");
+		curl_easy_setopt(curl, CURLOPT_URL, job->data+job->key_len);
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, job->data+job->addr_len+1);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(job->key_len-job->addr_len-1));
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+		if(job->compression)
+			curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+		res = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+		curl_slist_free_all(headers);
+		curl_easy_cleanup(curl);
+	}
+
+	if(res == CURLE_OK && status == 200 && body.pointer <= RIAK_MAPRED_SHARE_MAX) {
+		js.tok = json_tokener_new();
+		js.state = RIAK_JSON_BEFORE_ARRAY;
+		js.callback = riak_mapred_discard;
+		js.userdata = NULL;
+		js.stopped = 0;
+		js.marker = NULL;
+		js.dec = NULL;
+		js.flight = NULL;
+		riak_json_stream_feed(&js, body.buffer, body.pointer);
+		done = js.state == RIAK_JSON_DONE;
+		json_tokener_free(js.tok);
+	}
+	if(done)
+		riak_mapred_cache_store(cache, job->data, job->key_len, job->hash, body.buffer, body.pointer);
+	riak_buf_free(body.buffer);
+
+	pthread_mutex_lock(&cache->lock);
+	if(!done && (r = riak_mapred_result_find(cache, job->data, job->key_len, job->hash)) != NULL)
+		r->refreshing = 0;
+	last = --cache->refs == 0;
+	pthread_mutex_unlock(&cache->lock);
+	if(last)
+		riak_mapred_cache_destroy(cache);
+
+	free(job);
+	return NULL;
+}
+
+/**	\fn int riak_mapred_refresh_start(RIAK_MAPRED_CACHE * cache, RIAK_CONN * connstruct, const char * key, size_t key_len, unsigned long hash)
+ * 	\brief Starts detached thread refreshing memoized result. Caller has already taken reference of cache for it.
+ *
+ * @return 0 if thread was started, not 0 on error
+ */
+static int riak_mapred_refresh_start(RIAK_MAPRED_CACHE * cache, RIAK_CONN * connstruct, const char * key, size_t key_len,
+		unsigned long hash) {
+	static const char path[] = "/mapred";
+	struct riak_mapred_refresh * job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if((job = malloc(sizeof(struct riak_mapred_refresh) + key_len + connstruct->addr_len + sizeof(path))) == NULL)
+		return 1;
+	job->cache = cache;
+	job->compression = connstruct->compression;
+	job->hash = hash;
+	job->addr_len = connstruct->addr_len;
+	job->key_len = key_len;
+	memcpy(job->data, key, key_len);
+	memcpy(job->data+key_len, connstruct->addr, connstruct->addr_len);
+	memcpy(job->data+key_len+connstruct->addr_len, path, sizeof(path));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, riak_mapred_refresh_run, job);
+	pthread_attr_destroy(&attr);
+	if(err != 0) {
+		free(job);
+		return 1;
+	}
+	return 0;
+}
+
+/**	\fn struct riak_mapred_result * riak_mapred_cache_get(RIAK_MAPRED_CACHE * cache, RIAK_CONN * connstruct, const char * key, size_t key_len, unsigned long hash)
+ * 	\brief Looks memoized result of job up, starting its background refresh when it is about to expire.
+ *
+ * Only one refresh of result runs at a time. While it runs, result is served even after it expired (for at most
+ * another time to live), so callers don't wait for slow jobs.
+ *
+ * @return result held for caller, which should drop it with riak_mapred_result_release; NULL on miss
+ */
+static struct riak_mapred_result * riak_mapred_cache_get(RIAK_MAPRED_CACHE * cache, RIAK_CONN * connstruct,
+		const char * key, size_t key_len, unsigned long hash) {
+	long long ttl = cache->ttl_ms;
+	long long age;
+	struct riak_mapred_result * r;
+	int refresh = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if((r = riak_mapred_result_find(cache, key, key_len, hash)) != NULL) {
+		age = riak_now_ms() - r->stored;
+		if(age >= ttl && !(r->refreshing && age < 2*ttl)) {
+			riak_mapred_result_drop(cache, r);
+			r = NULL;
+		} else {
+			r->refs++;
+			if(r != cache->head) {
+				riak_mapred_result_unlink(cache, r);
+				r->prev = NULL;
+				r->next = cache->head;
+				cache->head->prev = r;
+				cache->head = r;
+			}
+			if(!r->refreshing && age >= ttl - ttl/RIAK_MAPRED_REFRESH_PART) {
+				r->refreshing = 1;
+				cache->refs++;
+				refresh = 1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if(refresh && riak_mapred_refresh_start(cache, connstruct, key, key_len, hash) != 0) {
+		/* Cache is still owned by connection's user, so this isn't the last reference */
+		pthread_mutex_lock(&cache->lock);
+		r->refreshing = 0;
+		cache->refs--;
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return r;
+}
+
+/**	\fn RIAK_MAPRED_CACHE * riak_http_mapred_cache_new(size_t max_bytes, unsigned int ttl_ms)
+ * 	\brief Implementation of riak_mapred_cache_new.
+ */
+static RIAK_MAPRED_CACHE * riak_http_mapred_cache_new(size_t max_bytes, unsigned int ttl_ms) {
+	RIAK_MAPRED_CACHE * cache;
+
+	if((cache = calloc(1, sizeof(RIAK_MAPRED_CACHE))) == NULL)
+		return NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->max_bytes = max_bytes;
+	cache->ttl_ms = ttl_ms;
+	cache->refs = 1;
+
+	return cache;
+}
+
+/**	\fn void riak_http_mapred_cache_clear(RIAK_MAPRED_CACHE * cache)
+ * 	\brief Implementation of riak_mapred_cache_clear.
+ */
+static void riak_http_mapred_cache_clear(RIAK_MAPRED_CACHE * cache) {
+	pthread_mutex_lock(&cache->lock);
+	while(cache->head != NULL)
+		riak_mapred_result_drop(cache, cache->head);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**	\fn void riak_http_mapred_cache_free(RIAK_MAPRED_CACHE * cache)
+ * 	\brief Implementation of riak_mapred_cache_free. Background refreshes still running free cache when they finish.
+ */
+static void riak_http_mapred_cache_free(RIAK_MAPRED_CACHE * cache) {
+	int last;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->freed = 1;
+	while(cache->head != NULL)
+		riak_mapred_result_drop(cache, cache->head);
+	last = --cache->refs == 0;
+	pthread_mutex_unlock(&cache->lock);
+	if(last)
+		riak_mapred_cache_destroy(cache);
+}
+
+/**	\fn int riak_http_mapred_json_stream(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, riak_json_callback callback, void * userdata)
+ * 	\brief Implementation of riak_mapred_json_stream.
+ */
+static int riak_http_mapred_json_stream(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, void * userdata) {
+	char * address;
+	CURLcode res;
+	long status = 0;
+	struct riak_json_stream js;
+	struct riak_mapred_result * memo;
+	unsigned long memo_hash = 0;
+	char * memo_key = NULL;
+	size_t memo_key_len = 0;
+	CURL * curl;
+	int shared = 0, done;
+
+	connstruct->last_error = RERR_OK;
+	if(mapred_statement == NULL || callback == NULL)
+		return 1;
+	if((curl = riak_curl_handle(connstruct)) == NULL)
+		return 1;
+
+	if((address = riak_conn_url(connstruct, "/mapred", "", 0)) == NULL)
+		return 1;
+
+	js.tok = json_tokener_new();
+	js.state = RIAK_JSON_BEFORE_ARRAY;
+	js.callback = callback;
+	js.userdata = userdata;
+	js.stopped = 0;
+	js.marker = NULL;
+	/* Without workers elements are decoded in place */
+	js.dec = connstruct->decode_threads > 0 ? riak_decoder_new(connstruct->decode_threads) : NULL;
+	js.flight = NULL;
+
+	if(connstruct->mapred_cache != NULL && (memo_key = riak_mapred_key(connstruct->addr, connstruct->addr_len,
+			mapred_statement, statement_len, &memo_key_len, &memo_hash)) != NULL
+			&& (memo = riak_mapred_cache_get(connstruct->mapred_cache, connstruct, memo_key, memo_key_len,
+			memo_hash)) != NULL) {
+		/* Memoized result is decoded as if it was received */
+		riak_json_stream_feed(&js, memo->data+memo->key_len, memo->body_len);
+		pthread_mutex_lock(&connstruct->mapred_cache->lock);
+		riak_mapred_result_release(memo);
+		pthread_mutex_unlock(&connstruct->mapred_cache->lock);
+		res = CURLE_OK;
+		status = 200;
+		goto finish;
+	}
+
+	/* Body is kept for threads running identical job, and for memoizing it */
+	if(connstruct->coalesce || memo_key != NULL)
+		js.flight = riak_mapred_join(connstruct, mapred_statement, statement_len, connstruct->coalesce, &shared);
+
+	if(shared) {
+		/* Identical job of other thread has just finished - its body is decoded as if it was received */
+		riak_json_stream_feed(&js, js.flight->body, js.flight->body_len);
+		pthread_mutex_lock(&mapred_flight_lock);
+		riak_mapred_release(js.flight);
+		pthread_mutex_unlock(&mapred_flight_lock);
+		res = CURLE_OK;
+		status = 200;
+		goto finish;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_URL, address);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, connstruct->json_headers);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, mapred_statement);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)statement_len);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &js);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, riak_json_stream_write);
+	riak_curl_compression(connstruct, curl);
+
+	res = curl_easy_perform(curl);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+	/* Body is complete only if whole array arrived; otherwise waiting threads try themselves */
+	if(js.flight != NULL) {
+		done = res == CURLE_OK && status == 200 && js.state == RIAK_JSON_DONE;
+		if(done && memo_key != NULL)
+			riak_mapred_cache_store(connstruct->mapred_cache, memo_key, memo_key_len, memo_hash,
+					js.flight->body, js.flight->body_len);
+		riak_mapred_land(js.flight, done ? 1 : -1);
+	}
+
+finish:
+	free(memo_key);
+	if(js.dec != NULL) {
+		/* Deliver rest of elements, unless transfer failed */
+		if(!js.stopped && js.state == RIAK_JSON_DONE && riak_decoder_submit(&js) == 0)
+			riak_decoder_deliver(&js, 0);
+		riak_decoder_free(js.dec);
+	}
+
+	if(js.stopped) {
+		/* Stopped by user - not an error */
+	} else if(res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+		connstruct->last_error = RERR_HTTP;
+	} else if(status != 200) {
+		connstruct->last_error = RERR_HTTP;
+	} else if(js.state != RIAK_JSON_DONE) {
+		connstruct->last_error = RERR_JSON;
+	}
+
+	json_tokener_free(js.tok);
+
+	return connstruct->last_error != RERR_OK;
+}
+
+/**
+ * \brief Helper structure for collecting JSON elements into array in riak_get_json_mapred.
+ */
+struct json_collector {
+	/** Collected elements. */
+	json_object ** tab;
+	/** Number of collected elements. */
+	int len;
+	/** Allocated size of tab. */
+	int alloc;
+};
+
+/**	\fn int riak_collect_json(json_object * elem, void * userdata)
+ * 	\brief Callback for riak_mapred_json_stream which appends elements to struct json_collector.
+ */
+static int riak_collect_json(json_object * elem, void * userdata) {
+	struct json_collector * coll = (struct json_collector *)userdata;
+	json_object ** tmp;
+
+	if(coll->len == coll->alloc) {
+		coll->alloc = coll->alloc ? coll->alloc*2 : 16;
+		if((tmp = realloc(coll->tab, coll->alloc*sizeof(json_object *))) == NULL) {
+			json_object_put(elem);
+			return 1;
+		}
+		coll->tab = tmp;
+	}
+	coll->tab[coll->len++] = elem;
+	return 0;
+}
+
+/**	\fn json_object ** riak_http_get_json_mapred_len(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, int *ret_len)
+ * 	\brief Implementation of riak_get_json_mapred_len.
+ */
+static json_object ** riak_http_get_json_mapred_len(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, int *ret_len) {
+	struct json_collector coll = { NULL, 0, 0 };
+
+	if((mapred_statement == NULL)||(ret_len == NULL))
+		return NULL;
+
+	riak_http_mapred_json_stream(connstruct, mapred_statement, statement_len, riak_collect_json, &coll);
+	*ret_len = coll.len;
+
+	/* Caller expects non-NULL array for empty result */
+	if(coll.tab == NULL)
+		coll.tab = calloc(1, sizeof(json_object *));
+
+	return coll.tab;
+}
+
+/**
+ * \brief Helper structure passing user callback to cURL write function in riak_search_stream.
+ */
+struct data_stream {
+	/** User callback. */
+	riak_data_callback callback;
+	/** Pointer passed to callback. */
+	void * userdata;
+	/** Number of bytes received so far. */
+	size_t total;
+	/** Set when callback asked to stop. */
+	int stopped;
+};
+
+/**	\fn size_t riak_data_stream_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+ * 	\brief cURL write function passing body chunks to struct data_stream callback.
+ */
+static size_t riak_data_stream_write(void *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct data_stream * ds = (struct data_stream *)userdata;
+
+	ds->total += size*nmemb;
+	if(ds->callback(ptr, size*nmemb, ds->userdata) != 0) {
+		ds->stopped = 1;
+		return 0;
+	}
+
+	return size*nmemb;
+}
+
+/**	\fn int riak_http_search_stream(RIAK_CONN * connstruct, const char * query, size_t query_len, riak_data_callback callback, void * userdata, size_t * total)
+ * 	\brief Implementation of riak_search_stream.
+ */
+static int riak_http_search_stream(RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, void * userdata, size_t * total) {
+	char * address;
+	CURLcode res;
+	long status = 0;
+	struct data_stream ds;
+	CURL * curl;
+
+	connstruct->last_error = RERR_OK;
+	if(query == NULL || callback == NULL)
+		return 1;
+	if((curl = riak_curl_handle(connstruct)) == NULL)
+		return 1;
+
+	if((address = riak_conn_url(connstruct, "/solr/", query, query_len)) == NULL)
+		return 1;
+
+	ds.callback = callback;
+	ds.userdata = userdata;
+	ds.total = 0;
+	ds.stopped = 0;
+
+	curl_easy_setopt(curl, CURLOPT_URL, address);
+	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ds);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, riak_data_stream_write);
+	riak_curl_compression(connstruct, curl);
+
+	res = curl_easy_perform(curl);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+	/* Stopping by user is not an error */
+	if(!ds.stopped && (res != CURLE_OK || status != 200))
+		connstruct->last_error = RERR_HTTP;
+	if(total != NULL)
+		*total = ds.total;
+
+	return connstruct->last_error != RERR_OK;
+}
+
+/**	\fn int riak_collect_data(const char * data, size_t len, void * userdata)
+ * 	\brief Callback for riak_search_stream which appends data to struct buffered_char.
+ */
+static int riak_collect_data(const char * data, size_t len, void * userdata) {
+	return writefunc((void *)data, 1, len, userdata) != len;
+}
+
+/**	\fn char * riak_http_get_raw_rs_len(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len)
+ * 	\brief Implementation of riak_get_raw_rs_len.
+ */
+static char * riak_http_get_raw_rs_len(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len) {
+	struct buffered_char retdata;
+
+	if(!query)
+		return NULL;
+
+	retdata.buffer = NULL;
+	retdata.pointer = 0;
+	retdata.length = 0;
+
+	if(riak_http_search_stream(connstruct, query, query_len, riak_collect_data, &retdata, NULL) != 0) {
+		riak_buf_free(retdata.buffer);
+		return NULL;
+	}
+	/* Empty body */
+	if(retdata.buffer == NULL && (retdata.buffer = riak_buf_alloc(1)) == NULL)
+		return NULL;
+
+	retdata.buffer[retdata.pointer] = '\0';
+	if(ret_len != NULL)
+		*ret_len = retdata.pointer;
+
+	return retdata.buffer;
+}
+
+/**
+ * \brief File descriptor registered in event loop.
+ */
+struct riak_loop_fd {
+	/** File descriptor. */
+	int fd;
+	/** Events to wait for (POLLIN/POLLOUT). */
+	short events;
+	/** Non-zero for sockets managed by cURL multi handle. */
+	int is_curl;
+	/** Function called when fd is ready (for fds registered by user). */
+	riak_fd_callback callback;
+	/** Pointer passed to callback. */
+	void * userdata;
+};
+
+/**
+ * \brief Event loop driving asynchronous HTTP operations and user file descriptors.
+ */
+struct riak_loop {
+	/** cURL multi handle of all HTTP requests in flight. */
+	CURLM * multi;
+	/** Registered file descriptors. */
+	struct riak_loop_fd * fds;
+	/** Number of registered file descriptors. */
+	size_t n_fds;
+	/** Allocated size of fds. */
+	size_t alloc_fds;
+	/** Monotonic time (in ms) when cURL wants to be called; -1 if no timer is set. */
+	long long deadline;
+	/** Number of requests in flight. */
+	size_t pending;
+	/** Requests in flight. */
+	struct riak_async_req * active;
+	/** Easy handles of finished requests, kept for reuse. */
+	CURL * idle[8];
+	/** Number of idle easy handles. */
+	int n_idle;
+	/** Prebuilt header list for requests with JSON body. */
+	struct curl_slist * json_headers;
+};
+
+/**
+ * \brief Asynchronous HTTP request.
+ */
+struct riak_async_req {
+	/** Loop which executes request. */
+	RIAK_LOOP * loop;
+	/** cURL handle of request. */
+	CURL * easy;
+	/** JSON decoder (MapReduce requests). */
+	struct riak_json_stream js;
+	/** Raw body stream (search requests). */
+	struct data_stream ds;
+	/** Non-zero for MapReduce requests. */
+	int is_json;
+	/** Function called when request is finished. */
+	riak_done_callback done;
+	/** Pointer passed to done. */
+	void * userdata;
+	/** Previous request in list of requests in flight. */
+	struct riak_async_req * prev;
+	/** Next request in list of requests in flight. */
+	struct riak_async_req * next;
+};
+
+/**	\fn void riak_async_free(struct riak_async_req * req)
+ * 	\brief Frees asynchronous request (but not its easy handle).
+ */
+static void riak_async_free(struct riak_async_req * req) {
+	if(req->is_json)
+		json_tokener_free(req->js.tok);
+	free(req);
+}
+
+/**	\fn struct riak_loop_fd * riak_loop_find(RIAK_LOOP * loop, int fd)
+ * 	\brief Finds registration of fd in loop; NULL if fd isn't registered.
+ */
+static struct riak_loop_fd * riak_loop_find(RIAK_LOOP * loop, int fd) {
+	size_t i;
+
+	for(i=0; i<loop->n_fds; i++)
+		if(loop->fds[i].fd == fd)
+			return &loop->fds[i];
+	return NULL;
+}
+
+/**	\fn struct riak_loop_fd * riak_loop_register(RIAK_LOOP * loop, int fd)
+ * 	\brief Returns registration of fd in loop, adding new one if necessary.
+ */
+static struct riak_loop_fd * riak_loop_register(RIAK_LOOP * loop, int fd) {
+	struct riak_loop_fd * lfd, * tmp;
+	size_t alloc_fds;
+
+	if((lfd = riak_loop_find(loop, fd)) != NULL)
+		return lfd;
+	if(loop->n_fds == loop->alloc_fds) {
+		alloc_fds = loop->alloc_fds ? loop->alloc_fds*2 : 16;
+		if((tmp = realloc(loop->fds, alloc_fds*sizeof(struct riak_loop_fd))) == NULL)
+			return NULL;
+		loop->fds = tmp;
+		loop->alloc_fds = alloc_fds;
+	}
+	lfd = &loop->fds[loop->n_fds++];
+	memset(lfd, 0, sizeof(struct riak_loop_fd));
+	lfd->fd = fd;
+	return lfd;
+}
+
+/**	\fn void riak_loop_unregister(RIAK_LOOP * loop, int fd)
+ * 	\brief Removes fd from loop.
+ */
+static void riak_loop_unregister(RIAK_LOOP * loop, int fd) {
+	struct riak_loop_fd * lfd;
+
+	if((lfd = riak_loop_find(loop, fd)) != NULL)
+		*lfd = loop->fds[--loop->n_fds];
+}
+
+/**	\fn int riak_loop_socket_cb(CURL * easy, curl_socket_t s, int what, void * userp, void * socketp)
+ * 	\brief CURLMOPT_SOCKETFUNCTION - registers sockets of cURL in loop.
+ */
+static int riak_loop_socket_cb(CURL * easy, curl_socket_t s, int what, void * userp, void * socketp) {
+	RIAK_LOOP * loop = (RIAK_LOOP *)userp;
+	struct riak_loop_fd * lfd;
+
+	if(what == CURL_POLL_REMOVE) {
+		riak_loop_unregister(loop, s);
+		return 0;
+	}
+	if((lfd = riak_loop_register(loop, s)) == NULL)
+		return -1;
+	lfd->is_curl = 1;
+	lfd->events = ((what & CURL_POLL_IN) ? POLLIN : 0) | ((what & CURL_POLL_OUT) ? POLLOUT : 0);
+	return 0;
+}
+
+/**	\fn int riak_loop_timer_cb(CURLM * multi, long timeout_ms, void * userp)
+ * 	\brief CURLMOPT_TIMERFUNCTION - remembers when cURL wants to be called.
+ */
+static int riak_loop_timer_cb(CURLM * multi, long timeout_ms, void * userp) {
+	RIAK_LOOP * loop = (RIAK_LOOP *)userp;
+
+	loop->deadline = timeout_ms < 0 ? -1 : riak_now_ms() + timeout_ms;
+	return 0;
+}
+
+/**	\fn void riak_loop_finish(RIAK_LOOP * loop)
+ * 	\brief Completes requests which were finished by cURL.
+ */
+static void riak_loop_finish(RIAK_LOOP * loop) {
+	struct riak_async_req * req;
+	CURLMsg * msg;
+	long status = 0;
+	int left, error;
+
+	while((msg = curl_multi_info_read(loop->multi, &left)) != NULL) {
+		if(msg->msg != CURLMSG_DONE)
+			continue;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+
+		error = RERR_OK;
+		if(req->is_json && req->js.stopped) {
+			/* Stopped by user - not an error */
+		} else if(!req->is_json && req->ds.stopped) {
+			/* Stopped by user - not an error */
+		} else if((msg->data.result != CURLE_OK && msg->data.result != CURLE_WRITE_ERROR) || status != 200) {
+			error = RERR_HTTP;
+		} else if(req->is_json && req->js.state != RIAK_JSON_DONE) {
+			error = RERR_JSON;
+		}
+
+		curl_multi_remove_handle(loop->multi, req->easy);
+		if(req->prev != NULL)
+			req->prev->next = req->next;
+		else
+			loop->active = req->next;
+		if(req->next != NULL)
+			req->next->prev = req->prev;
+		if(loop->n_idle < (int)(sizeof(loop->idle)/sizeof(loop->idle[0]))) {
+			curl_easy_reset(req->easy);
+			loop->idle[loop->n_idle++] = req->easy;
+		} else {
+			curl_easy_cleanup(req->easy);
+		}
+		loop->pending--;
+
+		if(req->done != NULL)
+			req->done(error, req->userdata);
+
+		riak_async_free(req);
+	}
+}
+
+/**	\fn RIAK_LOOP * riak_http_loop_new(void)
+ * 	\brief Implementation of riak_loop_new.
+ */
+static RIAK_LOOP * riak_http_loop_new(void) {
+	RIAK_LOOP * loop;
+
+	riak_curl_global_init();
+
+	if((loop = calloc(1, sizeof(RIAK_LOOP))) == NULL)
+		return NULL;
+	if((loop->multi = curl_multi_init()) == NULL) {
+		free(loop);
+		return NULL;
+	}
+	loop->deadline = -1;
+	loop->json_headers = curl_slist_append(NULL, "Content-type: application/json");
+	curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, riak_loop_socket_cb);
+	curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+	curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, riak_loop_timer_cb);
+	curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+
+	return loop;
+}
+
+/**	\fn void riak_http_loop_free(RIAK_LOOP * loop)
+ * 	\brief Implementation of riak_loop_free.
+ */
+static void riak_http_loop_free(RIAK_LOOP * loop) {
+	struct riak_async_req * req;
+
+	if(loop == NULL)
+		return;
+
+	/* Requests still in flight are cancelled */
+	while((req = loop->active) != NULL) {
+		curl_multi_remove_handle(loop->multi, req->easy);
+		curl_easy_cleanup(req->easy);
+		loop->active = req->next;
+		if(req->done != NULL)
+			req->done(RERR_CANCELLED, req->userdata);
+		riak_async_free(req);
+	}
+
+	while(loop->n_idle > 0)
+		curl_easy_cleanup(loop->idle[--loop->n_idle]);
+	curl_multi_cleanup(loop->multi);
+	curl_slist_free_all(loop->json_headers);
+	free(loop->fds);
+	free(loop);
+}
+
+/**	\fn int riak_http_loop_add_fd(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata)
+ * 	\brief Implementation of riak_loop_add_fd.
+ */
+static int riak_http_loop_add_fd(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata) {
+	struct riak_loop_fd * lfd;
+
+	if((lfd = riak_loop_register(loop, fd)) == NULL || lfd->is_curl)
+		return 1;
+	lfd->events = events;
+	lfd->callback = callback;
+	lfd->userdata = userdata;
+	return 0;
+}
+
+/**	\fn void riak_http_loop_remove_fd(RIAK_LOOP * loop, int fd)
+ * 	\brief Implementation of riak_loop_remove_fd.
+ */
+static void riak_http_loop_remove_fd(RIAK_LOOP * loop, int fd) {
+	struct riak_loop_fd * lfd;
+
+	if((lfd = riak_loop_find(loop, fd)) != NULL && !lfd->is_curl)
+		riak_loop_unregister(loop, fd);
+}
+
+/**	\fn int riak_http_loop_run_once(RIAK_LOOP * loop, int timeout_ms)
+ * 	\brief Implementation of riak_loop_run_once.
+ */
+static int riak_http_loop_run_once(RIAK_LOOP * loop, int timeout_ms) {
+	struct pollfd * pfds;
+	struct riak_loop_fd lfd;
+	long long now;
+	int n, running, flags;
+	size_t i, n_fds;
+
+	now = riak_now_ms();
+	if(loop->deadline >= 0 && (timeout_ms < 0 || loop->deadline - now < timeout_ms))
+		timeout_ms = loop->deadline > now ? loop->deadline - now : 0;
+
+	/* Snapshot, because callbacks may change registrations */
+	n_fds = loop->n_fds;
+	if((pfds = malloc((n_fds ? n_fds : 1)*sizeof(struct pollfd))) == NULL)
+		return -1;
+	for(i=0; i<n_fds; i++) {
+		pfds[i].fd = loop->fds[i].fd;
+		pfds[i].events = loop->fds[i].events;
+		pfds[i].revents = 0;
+	}
+
+	n = poll(pfds, n_fds, timeout_ms);
+	if(n < 0 && errno != EINTR) {
+		free(pfds);
+		return -1;
+	}
+
+	for(i=0; n > 0 && i<n_fds; i++) {
+		if(pfds[i].revents == 0 || riak_loop_find(loop, pfds[i].fd) == NULL)
+			continue;
+		lfd = *riak_loop_find(loop, pfds[i].fd);
+		if(lfd.is_curl) {
+			flags = ((pfds[i].revents & POLLIN) ? CURL_CSELECT_IN : 0)
+					| ((pfds[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0)
+					| ((pfds[i].revents & (POLLERR | POLLHUP)) ? CURL_CSELECT_ERR : 0);
+			curl_multi_socket_action(loop->multi, lfd.fd, flags, &running);
+		} else if(lfd.callback != NULL) {
+			lfd.callback(lfd.fd, pfds[i].revents, lfd.userdata);
+		}
+	}
+	free(pfds);
+
+	if(loop->deadline >= 0 && riak_now_ms() >= loop->deadline) {
+		loop->deadline = -1;
+		curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	}
+	riak_loop_finish(loop);
+
+	return loop->pending;
+}
+
+/**	\fn int riak_http_loop_run(RIAK_LOOP * loop)
+ * 	\brief Implementation of riak_loop_run.
+ */
+static int riak_http_loop_run(RIAK_LOOP * loop) {
+	while(loop->pending > 0)
+		if(riak_http_loop_run_once(loop, -1) < 0)
+			return 1;
+	return 0;
+}
+
+/**	\fn struct riak_async_req * riak_async_new(RIAK_LOOP * loop, riak_done_callback done, void * userdata)
+ * 	\brief Creates asynchronous request with easy handle taken from loop.
+ */
+static struct riak_async_req * riak_async_new(RIAK_LOOP * loop, riak_done_callback done, void * userdata) {
+	struct riak_async_req * req;
+
+	if((req = calloc(1, sizeof(struct riak_async_req))) == NULL)
+		return NULL;
+	req->loop = loop;
+	req->easy = loop->n_idle > 0 ? loop->idle[--loop->n_idle] : curl_easy_init();
+	if(req->easy == NULL) {
+		free(req);
+		return NULL;
+	}
+	req->done = done;
+	req->userdata = userdata;
+	riak_curl_setup(req->easy);
+	curl_easy_setopt(req->easy, CURLOPT_PRIVATE, req);
+	return req;
+}
+
+/**	\fn int riak_async_start(struct riak_async_req * req)
+ * 	\brief Adds request to multi handle of its loop.
+ */
+static int riak_async_start(struct riak_async_req * req) {
+	if(curl_multi_add_handle(req->loop->multi, req->easy) != CURLM_OK) {
+		curl_easy_cleanup(req->easy);
+		riak_async_free(req);
+		return 1;
+	}
+	req->next = req->loop->active;
+	if(req->next != NULL)
+		req->next->prev = req;
+	req->loop->active = req;
+	req->loop->pending++;
+	return 0;
+}
+
+/**	\fn int riak_http_async_mapred(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len, riak_json_callback callback, riak_done_callback done, void * userdata)
+ * 	\brief Implementation of riak_async_mapred.
+ */
+static int riak_http_async_mapred(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+		riak_json_callback callback, riak_done_callback done, void * userdata) {
+	struct riak_async_req * req;
+	char * address;
+
+	if(mapred_statement == NULL || callback == NULL || connstruct->addr == NULL)
+		return 1;
+	if((address = riak_conn_url(connstruct, "/mapred", "", 0)) == NULL)
+		return 1;
+	if((req = riak_async_new(loop, done, userdata)) == NULL)
+		return 1;
+
+	req->is_json = 1;
+	req->js.tok = json_tokener_new();
+	req->js.state = RIAK_JSON_BEFORE_ARRAY;
+	req->js.callback = callback;
+	req->js.userdata = userdata;
+
+	/* cURL copies address, so buffer of connection may be reused right away */
+	curl_easy_setopt(req->easy, CURLOPT_URL, address);
+	curl_easy_setopt(req->easy, CURLOPT_POST, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_HTTPHEADER, loop->json_headers);
+	curl_easy_setopt(req->easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)statement_len);
+	curl_easy_setopt(req->easy, CURLOPT_COPYPOSTFIELDS, mapred_statement);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &req->js);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, riak_json_stream_write);
+	riak_curl_compression(connstruct, req->easy);
+
+	return riak_async_start(req);
+}
+
+/**	\fn int riak_http_async_search(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len, riak_data_callback callback, riak_done_callback done, void * userdata)
+ * 	\brief Implementation of riak_async_search.
+ */
+static int riak_http_async_search(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len,
+		riak_data_callback callback, riak_done_callback done, void * userdata) {
+	struct riak_async_req * req;
+	char * address;
+
+	if(query == NULL || callback == NULL || connstruct->addr == NULL)
+		return 1;
+	if((address = riak_conn_url(connstruct, "/solr/", query, query_len)) == NULL)
+		return 1;
+	if((req = riak_async_new(loop, done, userdata)) == NULL)
+		return 1;
+
+	req->ds.callback = callback;
+	req->ds.userdata = userdata;
+
+	curl_easy_setopt(req->easy, CURLOPT_URL, address);
+	curl_easy_setopt(req->easy, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &req->ds);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, riak_data_stream_write);
+	riak_curl_compression(connstruct, req->easy);
+
+	return riak_async_start(req);
+}
+
+/**
+ * \brief One page of search results.
+ */
+struct riak_search_page {
+	/** Decoded documents. */
+	RIAK_SEARCH_DOC * docs;
+	/** Number of documents. */
+	size_t n_docs;
+	/** Allocated size of docs. */
+	size_t alloc_docs;
+	/** Set when request of page is finished. */
+	int done;
+	/** Error code of request. */
+	int error;
+};
+
+/**
+ * \brief Search cursor. Holds page being consumed and page being prefetched.
+ */
+struct riak_search_cursor {
+	/** Connection used for HTTP address and PB gets. */
+	RIAK_CONN * conn;
+	/** Loop downloading next page. */
+	RIAK_LOOP * loop;
+	/** Query path, everything except value of start parameter. */
+	char * query;
+	/** Page size. */
+	size_t rows;
+	/** Offset of next page to be requested. */
+	size_t start;
+	/** RIAK_SEARCH_* flags. */
+	int flags;
+	/** Page being consumed. */
+	struct riak_search_page cur;
+	/** Page being prefetched. */
+	struct riak_search_page next;
+	/** Index of next document of cur to return. */
+	size_t pos;
+	/** Set when next page was requested. */
+	int next_requested;
+	/** Error of fetching objects of page; once set, cursor returns no more documents. */
+	int error;
+};
+
+/**	\fn char * riak_json_string(json_object * obj, const char * name)
+ * 	\brief Returns newly allocated copy of string member of JSON object; NULL if it doesn't exist.
+ */
+static char * riak_json_string(json_object * obj, const char * name) {
+	json_object * member;
+	const char * str;
+	char * copy;
+
+	if((member = json_object_object_get(obj, name)) == NULL || (str = json_object_get_string(member)) == NULL)
+		return NULL;
+	if((copy = malloc(strlen(str)+1)) != NULL)
+		strcpy(copy, str);
+	return copy;
+}
+
+/**	\fn void riak_search_page_clear(struct riak_search_page * page)
+ * 	\brief Frees documents of page.
+ */
+static void riak_search_page_clear(struct riak_search_page * page) {
+	size_t i;
+
+	for(i=0; i<page->n_docs; i++) {
+		free(page->docs[i].id);
+		free(page->docs[i].index);
+		json_object_put(page->docs[i].doc);
+		riak_object_free(page->docs[i].object);
+	}
+	free(page->docs);
+	memset(page, 0, sizeof(struct riak_search_page));
+}
+
+/**	\fn int riak_search_collect(json_object * elem, void * userdata)
+ * 	\brief Callback of streaming JSON decoder, converting Solr documents into RIAK_SEARCH_DOC.
+ *
+ * Understands both Riak Search documents ({"id", "index", "fields", "props"}) and Solr documents
+ * of Riak 2.x ({"_yz_rk", "_yz_rb", "score", ...}).
+ */
+static int riak_search_collect(json_object * elem, void * userdata) {
+	struct riak_search_page * page = (struct riak_search_page *)userdata;
+	RIAK_SEARCH_DOC * doc, * tmp;
+	json_object * member;
+
+	if(page->n_docs == page->alloc_docs) {
+		page->alloc_docs = page->alloc_docs ? page->alloc_docs*2 : 16;
+		if((tmp = realloc(page->docs, page->alloc_docs*sizeof(RIAK_SEARCH_DOC))) == NULL) {
+			json_object_put(elem);
+			return 1;
+		}
+		page->docs = tmp;
+	}
+	doc = &page->docs[page->n_docs++];
+	memset(doc, 0, sizeof(RIAK_SEARCH_DOC));
+	doc->doc = elem;
+
+	if((doc->id = riak_json_string(elem, "id")) == NULL)
+		doc->id = riak_json_string(elem, "_yz_rk");
+	if((doc->index = riak_json_string(elem, "index")) == NULL)
+		doc->index = riak_json_string(elem, "_yz_rb");
+	if((member = json_object_object_get(elem, "score")) == NULL
+			&& (member = json_object_object_get(elem, "props")) != NULL)
+		member = json_object_object_get(member, "score");
+	doc->score = member != NULL ? json_object_get_double(member) : 0.0;
+	if((doc->fields = json_object_object_get(elem, "fields")) == NULL)
+		doc->fields = elem;
+
+	return 0;
+}
+
+/**	\fn void riak_search_page_done(int error, void * userdata)
+ * 	\brief Completion callback of page request.
+ */
+static void riak_search_page_done(int error, void * userdata) {
+	struct riak_search_page * page = (struct riak_search_page *)userdata;
+
+	page->done = 1;
+	page->error = error;
+}
+
+/**	\fn int riak_search_request(RIAK_SEARCH_CURSOR * cursor)
+ * 	\brief Starts download of page at cursor->start into cursor->next.
+ */
+static int riak_search_request(RIAK_SEARCH_CURSOR * cursor) {
+	struct riak_async_req * req;
+	char start[32];
+	char * address;
+	size_t query_len = strlen(cursor->query), start_len;
+
+	start_len = sprintf(start, "%lu", (unsigned long)cursor->start);
+	if((address = riak_conn_url(cursor->conn, "/solr/", NULL, query_len+start_len)) == NULL)
+		return 1;
+	memcpy(address+cursor->conn->addr_len+sizeof("/solr/")-1, cursor->query, query_len);
+	memcpy(address+cursor->conn->addr_len+sizeof("/solr/")-1+query_len, start, start_len);
+
+	if((req = riak_async_new(cursor->loop, riak_search_page_done, &cursor->next)) == NULL)
+		return 1;
+
+	req->is_json = 1;
+	req->js.tok = json_tokener_new();
+	req->js.state = RIAK_JSON_BEFORE_ARRAY;
+	req->js.callback = riak_search_collect;
+	req->js.userdata = &cursor->next;
+	req->js.marker = "\"docs\"";
+
+	curl_easy_setopt(req->easy, CURLOPT_URL, address);
+	curl_easy_setopt(req->easy, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &req->js);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, riak_json_stream_write);
+	riak_curl_compression(cursor->conn, req->easy);
+
+	if(riak_async_start(req) != 0)
+		return 1;
+	cursor->start += cursor->rows;
+	cursor->next_requested = 1;
+	return 0;
+}
+
+/**	\fn int riak_search_fetch(RIAK_SEARCH_CURSOR * cursor)
+ * 	\brief Fetches objects of all hits of current page with one batch get of core library (pipelined PB requests).
+ *
+ * Failure is remembered in cursor, so that hits without their objects aren't handed out.
+ */
+static int riak_search_fetch(RIAK_SEARCH_CURSOR * cursor) {
+	RIAK_SEARCH_DOC * docs = cursor->cur.docs;
+	RIAK_CORE_GET * gets;
+	size_t i, n;
+	int ret;
+
+	if(cursor->cur.n_docs == 0)
+		return 0;
+	if((gets = malloc(cursor->cur.n_docs*sizeof(RIAK_CORE_GET))) == NULL) {
+		cursor->error = cursor->conn->last_error = RERR_GET;
+		return 1;
+	}
+	for(i=0, n=0; i<cursor->cur.n_docs; i++) {
+		if(docs[i].id == NULL || docs[i].index == NULL)
+			continue;
+		gets[n].bucket = docs[i].index;
+		gets[n].bucket_len = strlen(docs[i].index);
+		gets[n].key = docs[i].id;
+		gets[n].key_len = strlen(docs[i].id);
+		n++;
+	}
+	ret = core->get_batch(cursor->conn, gets, n);
+	for(i=0, n=0; i<cursor->cur.n_docs; i++)
+		if(docs[i].id != NULL && docs[i].index != NULL)
+			docs[i].object = gets[n++].obj;
+	free(gets);
+
+	if(ret != 0)
+		cursor->error = cursor->conn->last_error;
+	return ret;
+}
+
+static void riak_http_search_close(RIAK_SEARCH_CURSOR * cursor);
+
+/**	\fn RIAK_SEARCH_CURSOR * riak_http_search_open(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows, int flags)
+ * 	\brief Implementation of riak_search_open.
+ */
+static RIAK_SEARCH_CURSOR * riak_http_search_open(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows, int flags) {
+	RIAK_SEARCH_CURSOR * cursor;
+	char * eindex, * equery;
+
+	connstruct->last_error = RERR_OK;
+	if(index == NULL || query == NULL)
+		return NULL;
+	if(!(connstruct->transports & RIAK_TRANSPORT_HTTP)
+			|| ((flags & RIAK_SEARCH_FETCH) && !(connstruct->transports & RIAK_TRANSPORT_PB))) {
+		connstruct->last_error = RERR_NO_TRANSPORT;
+		return NULL;
+	}
+
+	if(riak_http_conn(connstruct) != 0)
+		return NULL;
+
+	if((cursor = calloc(1, sizeof(RIAK_SEARCH_CURSOR))) == NULL) {
+		connstruct->last_error = RERR_HTTP;
+		return NULL;
+	}
+	cursor->conn = connstruct;
+	cursor->rows = rows > 0 ? rows : 10;
+	cursor->flags = flags;
+	if((cursor->loop = riak_http_loop_new()) == NULL) {
+		free(cursor);
+		connstruct->last_error = RERR_CURL_INIT;
+		return NULL;
+	}
+
+	eindex = curl_easy_escape(connstruct->curlh, index, 0);
+	equery = curl_easy_escape(connstruct->curlh, query, 0);
+	if(eindex != NULL && equery != NULL
+			&& (cursor->query = malloc(strlen(eindex)+strlen(equery)+sizeof("/select?wt=json&q=&rows=&start=")+32)) != NULL)
+		sprintf(cursor->query, "%s/select?wt=json&q=%s&rows=%lu&start=", eindex, equery, (unsigned long)cursor->rows);
+	curl_free(eindex);
+	curl_free(equery);
+
+	if(cursor->query == NULL || riak_search_request(cursor) != 0) {
+		connstruct->last_error = RERR_HTTP;
+		riak_http_search_close(cursor);
+		return NULL;
+	}
+
+	return cursor;
+}
+
+/**	\fn RIAK_SEARCH_DOC * riak_http_search_next(RIAK_SEARCH_CURSOR * cursor)
+ * 	\brief Implementation of riak_search_next.
+ */
+static RIAK_SEARCH_DOC * riak_http_search_next(RIAK_SEARCH_CURSOR * cursor) {
+	cursor->conn->last_error = cursor->error;
+	if(cursor->error != RERR_OK)
+		return NULL;
+
+	if(cursor->pos < cursor->cur.n_docs) {
+		/* Let prefetch of next page progress without blocking */
+		riak_http_loop_run_once(cursor->loop, 0);
+		return &cursor->cur.docs[cursor->pos++];
+	}
+	if(!cursor->next_requested)
+		return NULL;
+
+	while(!cursor->next.done)
+		if(riak_http_loop_run_once(cursor->loop, -1) < 0) {
+			cursor->conn->last_error = RERR_HTTP;
+			return NULL;
+		}
+	cursor->next_requested = 0;
+	if(cursor->next.error != RERR_OK) {
+		cursor->conn->last_error = cursor->next.error;
+		return NULL;
+	}
+
+	riak_search_page_clear(&cursor->cur);
+	cursor->cur = cursor->next;
+	memset(&cursor->next, 0, sizeof(struct riak_search_page));
+	cursor->pos = 0;
+
+	/* Short page is the last one. Request of next one is sent right away, before caller gets the page */
+	if(cursor->cur.n_docs == cursor->rows) {
+		if(riak_search_request(cursor) != 0) {
+			cursor->conn->last_error = RERR_HTTP;
+			return NULL;
+		}
+		riak_http_loop_run_once(cursor->loop, 0);
+	}
+	if((cursor->flags & RIAK_SEARCH_FETCH) && riak_search_fetch(cursor) != 0)
+		return NULL;
+
+	if(cursor->cur.n_docs == 0)
+		return NULL;
+	return &cursor->cur.docs[cursor->pos++];
+}
+
+/**	\fn void riak_http_search_close(RIAK_SEARCH_CURSOR * cursor)
+ * 	\brief Implementation of riak_search_close.
+ */
+static void riak_http_search_close(RIAK_SEARCH_CURSOR * cursor) {
+	if(cursor == NULL)
+		return;
+	/* Cancels prefetch in flight */
+	riak_http_loop_free(cursor->loop);
+	riak_search_page_clear(&cursor->cur);
+	riak_search_page_clear(&cursor->next);
+	free(cursor->query);
+	free(cursor);
+}
+
+/**	\fn void riak_http_close_conn(RIAK_CONN * connstruct)
+ * 	\brief Frees HTTP part of connection. Called by riak_close.
+ */
+static void riak_http_close_conn(RIAK_CONN * connstruct) {
+	curl_easy_cleanup(connstruct->curlh);
+	curl_slist_free_all(connstruct->json_headers);
+	free(connstruct->url);
+	connstruct->curlh = NULL;
+	connstruct->json_headers = NULL;
+	connstruct->url = NULL;
+}
+
+/** Functions of module, handed to core library. */
+static const RIAK_HTTP_OPS http_ops = {
+	RIAK_HTTP_OPS_VERSION,
+	riak_http_close_conn,
+	riak_http_put,
+	riak_http_get_cond,
+	riak_http_put_json_len,
+	riak_http_mapred_json_stream,
+	riak_http_get_json_mapred_len,
+	riak_http_search_stream,
+	riak_http_get_raw_rs_len,
+	riak_http_loop_new,
+	riak_http_loop_free,
+	riak_http_loop_add_fd,
+	riak_http_loop_remove_fd,
+	riak_http_loop_run_once,
+	riak_http_loop_run,
+	riak_http_async_mapred,
+	riak_http_async_search,
+	riak_http_search_open,
+	riak_http_search_next,
+	riak_http_search_close,
+	riak_http_mapred_cache_new,
+	riak_http_mapred_cache_clear,
+	riak_http_mapred_cache_free
+};
+
+const RIAK_HTTP_OPS * RIAK_HTTP_ENTRY(const RIAK_CORE_OPS * core_ops) {
+	core = core_ops;
+	return &http_ops;
+}
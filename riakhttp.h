@@ -0,0 +1,111 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakhttp.h
+ *
+ * Internal interface between core library and HTTP module. Not installed.
+ */
+
+#ifndef __RIAKHTTP_H__
+
+#define __RIAKHTTP_H__
+
+#include "riakdrv.h"
+
+/** File name of HTTP module, passed to dlopen. */
+#ifndef RIAK_HTTP_MODULE
+#define RIAK_HTTP_MODULE "libriakdrv_http.so"
+#endif
+
+/** Entry point of HTTP module. */
+#define RIAK_HTTP_ENTRY riak_http_module
+/** Name of entry point, passed to dlsym. */
+#define RIAK_HTTP_ENTRY_NAME "riak_http_module"
+
+/** Version of RIAK_HTTP_OPS; module of other version is not used. */
+#define RIAK_HTTP_OPS_VERSION 3
+
+/**
+ * \brief One object of batch get (RIAK_CORE_OPS.get_batch).
+ */
+typedef struct {
+	const char * bucket;
+	size_t bucket_len;
+	const char * key;
+	size_t key_len;
+	/** Set to fetched object; NULL if object wasn't found or get failed. */
+	RIAK_OBJECT * obj;
+} RIAK_CORE_GET;
+
+/**
+ * \brief Functions of core library used by HTTP module.
+ */
+typedef struct {
+	/** Puts value via PB (or HTTP, if connection has no PB socket) with given content type. */
+	int (*put)(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+			const char * data, size_t data_len, const char * content_type);
+	/** Gets objects like riak_get_len (delayed puts, key filter, cache and value hashes included), pipelining PB
+	 *  requests. Returns 0 if success, 1 on error (first error in last_error). */
+	int (*get_batch)(RIAK_CONN * connstruct, RIAK_CORE_GET * gets, size_t n);
+} RIAK_CORE_OPS;
+
+/**
+ * \brief Functions of HTTP module. Apart from close_conn and put, they implement public functions of the same names.
+ */
+typedef struct {
+	/** Must be RIAK_HTTP_OPS_VERSION. */
+	int version;
+	/** Frees HTTP part of connection. */
+	void (*close_conn)(RIAK_CONN * connstruct);
+	/** Puts value via HTTP. */
+	int (*put)(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+			const char * data, size_t len, const char * content_type);
+	int (*get_cond)(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+			RIAK_OBJECT ** obj);
+	int (*put_json_len)(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+			json_object * elem);
+	int (*mapred_json_stream)(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+			riak_json_callback callback, void * userdata);
+	json_object ** (*get_json_mapred_len)(RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+			int * ret_len);
+	int (*search_stream)(RIAK_CONN * connstruct, const char * query, size_t query_len,
+			riak_data_callback callback, void * userdata, size_t * total);
+	char * (*get_raw_rs_len)(RIAK_CONN * connstruct, const char * query, size_t query_len, size_t * ret_len);
+	RIAK_LOOP * (*loop_new)(void);
+	void (*loop_free)(RIAK_LOOP * loop);
+	int (*loop_add_fd)(RIAK_LOOP * loop, int fd, short events, riak_fd_callback callback, void * userdata);
+	void (*loop_remove_fd)(RIAK_LOOP * loop, int fd);
+	int (*loop_run_once)(RIAK_LOOP * loop, int timeout_ms);
+	int (*loop_run)(RIAK_LOOP * loop);
+	int (*async_mapred)(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * mapred_statement, size_t statement_len,
+			riak_json_callback callback, riak_done_callback done, void * userdata);
+	int (*async_search)(RIAK_LOOP * loop, RIAK_CONN * connstruct, const char * query, size_t query_len,
+			riak_data_callback callback, riak_done_callback done, void * userdata);
+	RIAK_SEARCH_CURSOR * (*search_open)(RIAK_CONN * connstruct, const char * index, const char * query, size_t rows,
+			int flags);
+	RIAK_SEARCH_DOC * (*search_next)(RIAK_SEARCH_CURSOR * cursor);
+	void (*search_close)(RIAK_SEARCH_CURSOR * cursor);
+	RIAK_MAPRED_CACHE * (*mapred_cache_new)(size_t max_bytes, unsigned int ttl_ms);
+	void (*mapred_cache_clear)(RIAK_MAPRED_CACHE * cache);
+	void (*mapred_cache_free)(RIAK_MAPRED_CACHE * cache);
+} RIAK_HTTP_OPS;
+
+/** \fn const RIAK_HTTP_OPS * riak_http_module(const RIAK_CORE_OPS * core_ops)
+ *  \brief Entry point of HTTP module. Remembers core functions and returns module functions.
+ */
+const RIAK_HTTP_OPS * RIAK_HTTP_ENTRY(const RIAK_CORE_OPS * core_ops);
+
+#endif
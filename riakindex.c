@@ -0,0 +1,734 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakindex.c
+ *
+ * Sorted index of keys of bucket, for prefix and range scans which Riak doesn't have.
+ *
+ * Snapshot of keys is kept in file, which is mapped read-only. Keys are sorted and front-coded: each key is stored
+ * as length of prefix shared with previous key, length of rest and rest. Every RIAK_INDEX_BLOCK-th key is stored
+ * whole, and table of offsets of these keys allows binary search. Writes made after snapshot are kept in memory,
+ * in sorted table of changes, which scans merge with snapshot.
+ *
+ * File layout: struct riak_index_header, table of n_blocks 64-bit offsets of blocks (relative to start of keys),
+ * name of bucket, keys.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "riakdrv.h"
+
+/** "RKIX" */
+#define RIAK_INDEX_MAGIC 0x524B4958u
+/** Version of file layout. */
+#define RIAK_INDEX_VERSION 1
+/** Number of keys in block; first of them is stored whole. */
+#define RIAK_INDEX_BLOCK 16
+/** Largest number of keys passed to callback at once. */
+#define RIAK_INDEX_CHUNK 256
+
+/**
+ * \brief Header of index file.
+ */
+struct riak_index_header {
+	/** RIAK_INDEX_MAGIC */
+	__uint32_t magic;
+	/** RIAK_INDEX_VERSION */
+	__uint32_t version;
+	/** Number of keys. */
+	__uint64_t n_keys;
+	/** Number of blocks. */
+	__uint64_t n_blocks;
+	/** Length of bucket name. */
+	__uint64_t bucket_len;
+	/** Size of keys in bytes. */
+	__uint64_t data_size;
+};
+
+/**
+ * \brief Key written or deleted after snapshot was taken.
+ */
+struct riak_index_change {
+	/** Key. */
+	char * key;
+	/** Length of key. */
+	size_t key_len;
+	/** Non-zero if key was deleted. */
+	int removed;
+};
+
+struct riak_key_index {
+	/** Mapped file; NULL for index made by riak_key_index_new, whose bucket is allocated instead. */
+	void * map;
+	/** Size of mapping. */
+	size_t map_size;
+	/** Offsets of blocks. */
+	const __uint64_t * blocks;
+	/** Number of blocks. */
+	size_t n_blocks;
+	/** Name of bucket. */
+	const char * bucket;
+	/** Length of bucket name. */
+	size_t bucket_len;
+	/** Front-coded keys. */
+	const unsigned char * data;
+	/** Size of data. */
+	size_t data_size;
+	/** Guards changes. */
+	pthread_rwlock_t lock;
+	/** Changes sorted by key. */
+	struct riak_index_change * changes;
+	/** Number of changes. */
+	size_t n_changes;
+	/** Allocated size of changes. */
+	size_t changes_size;
+};
+
+/**
+ * \brief Keys collected for writing to file.
+ */
+struct riak_index_keys {
+	/** Keys, one after another. */
+	char * buf;
+	/** Used part of buf. */
+	size_t len;
+	/** Allocated size of buf. */
+	size_t size;
+	/** Positions of keys in buf. */
+	RIAK_SLICE * keys;
+	/** Number of keys. */
+	size_t n_keys;
+	/** Allocated size of keys. */
+	size_t keys_size;
+	/** Non-zero if memory ran out. */
+	int failed;
+};
+
+/**
+ * \brief Key being written to file.
+ */
+struct riak_index_key {
+	/** Key. */
+	const char * key;
+	/** Length of key. */
+	size_t len;
+};
+
+/**
+ * \brief Keys waiting to be passed to scan callback.
+ */
+struct riak_index_batch {
+	/** Keys, one after another. */
+	char * buf;
+	/** Used part of buf. */
+	size_t len;
+	/** Allocated size of buf. */
+	size_t size;
+	/** Positions of keys in buf. */
+	RIAK_SLICE keys[RIAK_INDEX_CHUNK];
+	/** Number of keys. */
+	size_t n_keys;
+	/** Callback of scan. */
+	riak_keys_callback callback;
+	/** Pointer passed to callback. */
+	void * userdata;
+	/** Non-zero when callback asked to stop. */
+	int stopped;
+};
+
+/**
+ * \brief Position in keys of snapshot.
+ */
+struct riak_index_cursor {
+	/** Next key to decode. */
+	const unsigned char * p;
+	/** End of keys. */
+	const unsigned char * end;
+	/** Current key. */
+	char * key;
+	/** Length of current key. */
+	size_t key_len;
+	/** Allocated size of key. */
+	size_t key_size;
+	/** Non-zero if key is valid (cursor isn't past last key). */
+	int valid;
+};
+
+/**	\fn int riak_index_cmp(const char * a, size_t a_len, const char * b, size_t b_len)
+ * 	\brief Compares keys bytewise; shorter key goes first when one is prefix of other.
+ */
+static inline int riak_index_cmp(const char * a, size_t a_len, const char * b, size_t b_len) {
+	size_t n = a_len < b_len ? a_len : b_len;
+	int c = n > 0 ? memcmp(a, b, n) : 0;
+
+	if(c != 0)
+		return c;
+	return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/**	\fn int riak_index_key_cmp(const void * a, const void * b)
+ * 	\brief Comparator of struct riak_index_key for qsort.
+ */
+static int riak_index_key_cmp(const void * a, const void * b) {
+	const struct riak_index_key * x = (const struct riak_index_key *)a, * y = (const struct riak_index_key *)b;
+
+	return riak_index_cmp(x->key, x->len, y->key, y->len);
+}
+
+/**	\fn size_t riak_index_put_varint(unsigned char * p, __uint64_t value)
+ * 	\brief Writes value as base 128 varint.
+ *
+ * @return number of bytes written
+ */
+static size_t riak_index_put_varint(unsigned char * p, __uint64_t value) {
+	size_t n = 0;
+
+	while(value >= 0x80) {
+		p[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	p[n++] = (unsigned char)value;
+	return n;
+}
+
+/**	\fn const unsigned char * riak_index_get_varint(const unsigned char * p, const unsigned char * end, __uint64_t * value)
+ * 	\brief Reads base 128 varint.
+ *
+ * @return position after varint; NULL if it runs past end
+ */
+static const unsigned char * riak_index_get_varint(const unsigned char * p, const unsigned char * end, __uint64_t * value) {
+	int shift = 0;
+
+	*value = 0;
+	while(p < end && shift < 64) {
+		*value |= (__uint64_t)(*p & 0x7F) << shift;
+		if(!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/**	\fn int riak_index_collect(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata)
+ * 	\brief Callback for riak_list_keys_stream and riak_key_index_scan which appends keys to struct riak_index_keys.
+ */
+static int riak_index_collect(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata) {
+	struct riak_index_keys * c = (struct riak_index_keys *)userdata;
+	RIAK_SLICE * tmp_keys;
+	char * tmp;
+	size_t i;
+
+	for(i = 0; i < n_keys; i++) {
+		if(c->len + keys[i].len > c->size) {
+			if((tmp = realloc(c->buf, (c->size + keys[i].len)*2)) == NULL) {
+				c->failed = 1;
+				return 1;
+			}
+			c->buf = tmp;
+			c->size = (c->size + keys[i].len)*2;
+		}
+		if(c->n_keys == c->keys_size) {
+			if((tmp_keys = realloc(c->keys, (c->keys_size*2 + 64)*sizeof(RIAK_SLICE))) == NULL) {
+				c->failed = 1;
+				return 1;
+			}
+			c->keys = tmp_keys;
+			c->keys_size = c->keys_size*2 + 64;
+		}
+		if(keys[i].len > 0)
+			memcpy(c->buf + c->len, msg + keys[i].offset, keys[i].len);
+		c->keys[c->n_keys].offset = c->len;
+		c->keys[c->n_keys].len = keys[i].len;
+		c->n_keys++;
+		c->len += keys[i].len;
+	}
+	return 0;
+}
+
+/**	\fn int riak_index_write(const char * path, const char * bucket, size_t bucket_len, struct riak_index_keys * c)
+ * 	\brief Sorts collected keys and writes them to index file, replacing it atomically. Duplicates are dropped.
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_index_write(const char * path, const char * bucket, size_t bucket_len, struct riak_index_keys * c) {
+	struct riak_index_header hdr;
+	struct riak_index_key * sorted;
+	__uint64_t * blocks = NULL;
+	unsigned char * data = NULL, * p;
+	size_t i, shared, prev = 0, n = 0, tmp_len = strlen(path);
+	char * tmp_path;
+	FILE * f = NULL;
+	int fd, ret = 1;
+
+	if((sorted = malloc((c->n_keys > 0 ? c->n_keys : 1)*sizeof(struct riak_index_key))) == NULL)
+		return 1;
+	for(i = 0; i < c->n_keys; i++) {
+		sorted[i].key = c->buf + c->keys[i].offset;
+		sorted[i].len = c->keys[i].len;
+	}
+	qsort(sorted, c->n_keys, sizeof(struct riak_index_key), riak_index_key_cmp);
+
+	/* Two varints per key take at most 20 bytes */
+	if((data = malloc(c->len + c->n_keys*20 + 1)) == NULL
+			|| (blocks = malloc((c->n_keys/RIAK_INDEX_BLOCK + 1)*sizeof(__uint64_t))) == NULL
+			|| (tmp_path = malloc(tmp_len + 8)) == NULL)
+		goto out;
+	p = data;
+	for(i = 0; i < c->n_keys; i++) {
+		if(n > 0 && riak_index_cmp(sorted[i].key, sorted[i].len, sorted[prev].key, sorted[prev].len) == 0)
+			continue;
+		shared = 0;
+		if(n % RIAK_INDEX_BLOCK == 0) {
+			blocks[n / RIAK_INDEX_BLOCK] = p - data;
+		} else {
+			while(shared < sorted[i].len && shared < sorted[prev].len && sorted[i].key[shared] == sorted[prev].key[shared])
+				shared++;
+		}
+		p += riak_index_put_varint(p, shared);
+		p += riak_index_put_varint(p, sorted[i].len - shared);
+		if(sorted[i].len > shared)
+			memcpy(p, sorted[i].key + shared, sorted[i].len - shared);
+		p += sorted[i].len - shared;
+		prev = i;
+		n++;
+	}
+
+	hdr.magic = RIAK_INDEX_MAGIC;
+	hdr.version = RIAK_INDEX_VERSION;
+	hdr.n_keys = n;
+	hdr.n_blocks = (n + RIAK_INDEX_BLOCK-1) / RIAK_INDEX_BLOCK;
+	hdr.bucket_len = bucket_len;
+	hdr.data_size = p - data;
+
+	/* New file is written aside and renamed over old one, which processes may still have mapped */
+	memcpy(tmp_path, path, tmp_len);
+	memcpy(tmp_path + tmp_len, ".XXXXXX", 8);
+	if((fd = mkstemp(tmp_path)) < 0) {
+		free(tmp_path);
+		goto out;
+	}
+	if((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+	} else if(fwrite(&hdr, sizeof(hdr), 1, f) == 1
+			&& fwrite(blocks, sizeof(__uint64_t), hdr.n_blocks, f) == hdr.n_blocks
+			&& fwrite(bucket, 1, bucket_len, f) == bucket_len
+			&& fwrite(data, 1, hdr.data_size, f) == hdr.data_size
+			&& fflush(f) == 0 && fsync(fd) == 0) {
+		ret = 0;
+	}
+	if(f != NULL && fclose(f) != 0)
+		ret = 1;
+	if(ret == 0 && rename(tmp_path, path) != 0)
+		ret = 1;
+	if(ret != 0)
+		unlink(tmp_path);
+	free(tmp_path);
+
+out:
+	free(blocks);
+	free(data);
+	free(sorted);
+	return ret;
+}
+
+/**	\fn int riak_index_next(struct riak_index_cursor * cur)
+ * 	\brief Moves cursor to next key of snapshot.
+ *
+ * @return 0 if success, not 0 if memory ran out (cursor becomes invalid past last key too, without error)
+ */
+static int riak_index_next(struct riak_index_cursor * cur) {
+	__uint64_t shared, len;
+	const unsigned char * p;
+	char * tmp;
+
+	cur->valid = 0;
+	if(cur->p >= cur->end)
+		return 0;
+	if((p = riak_index_get_varint(cur->p, cur->end, &shared)) == NULL || (p = riak_index_get_varint(p, cur->end, &len)) == NULL
+			|| shared > cur->key_len || len > (__uint64_t)(cur->end - p))
+		return 0;
+	if(shared + len > cur->key_size) {
+		if((tmp = realloc(cur->key, (shared + len)*2)) == NULL)
+			return 1;
+		cur->key = tmp;
+		cur->key_size = (shared + len)*2;
+	}
+	if(len > 0)
+		memcpy(cur->key + shared, p, len);
+	cur->key_len = shared + len;
+	cur->p = p + len;
+	cur->valid = 1;
+	return 0;
+}
+
+/**	\fn int riak_index_seek(RIAK_KEY_INDEX * index, struct riak_index_cursor * cur, const char * from, size_t from_len)
+ * 	\brief Sets cursor to first key of snapshot not less than from.
+ *
+ * @return 0 if success, not 0 if memory ran out or block is damaged (cursor is invalid then)
+ */
+static int riak_index_seek(RIAK_KEY_INDEX * index, struct riak_index_cursor * cur, const char * from, size_t from_len) {
+	size_t lo = 0, hi = index->n_blocks, mid;
+	const unsigned char * p, * end = index->data + index->data_size;
+	__uint64_t shared, len;
+
+	/* Last block whose first key isn't greater than from */
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		p = index->data + index->blocks[mid];
+		if((p = riak_index_get_varint(p, end, &shared)) == NULL || (p = riak_index_get_varint(p, end, &len)) == NULL
+				|| shared != 0 || len > (__uint64_t)(end - p)) {
+			cur->valid = 0;
+			return 1;
+		}
+		if(riak_index_cmp((const char *)p, len, from, from_len) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	cur->p = index->data + (index->n_blocks > 0 ? index->blocks[lo] : 0);
+	cur->end = end;
+	cur->key_len = 0;
+	do {
+		if(riak_index_next(cur) != 0) {
+			cur->valid = 0;
+			return 1;
+		}
+	} while(cur->valid && riak_index_cmp(cur->key, cur->key_len, from, from_len) < 0);
+	return 0;
+}
+
+/**	\fn int riak_index_emit(struct riak_index_batch * batch, const char * key, size_t key_len)
+ * 	\brief Adds key to batch, passing full batch to callback first.
+ *
+ * @return 0 if success, not 0 if memory ran out
+ */
+static int riak_index_emit(struct riak_index_batch * batch, const char * key, size_t key_len) {
+	char * tmp;
+
+	if(batch->n_keys == RIAK_INDEX_CHUNK) {
+		batch->stopped = batch->callback(batch->buf, batch->keys, batch->n_keys, batch->userdata);
+		batch->n_keys = batch->len = 0;
+	}
+	if(batch->len + key_len > batch->size) {
+		if((tmp = realloc(batch->buf, (batch->size + key_len)*2)) == NULL)
+			return 1;
+		batch->buf = tmp;
+		batch->size = (batch->size + key_len)*2;
+	}
+	if(key_len > 0)
+		memcpy(batch->buf + batch->len, key, key_len);
+	batch->keys[batch->n_keys].offset = batch->len;
+	batch->keys[batch->n_keys].len = key_len;
+	batch->n_keys++;
+	batch->len += key_len;
+	return 0;
+}
+
+/**	\fn void riak_index_change(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len, int removed)
+ * 	\brief Records write or delete of key, if it belongs to bucket of index.
+ */
+static void riak_index_change(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		int removed) {
+	struct riak_index_change * tmp;
+	size_t lo = 0, hi, mid;
+	char * copy;
+	int c;
+
+	if(bucket_len != index->bucket_len || memcmp(bucket, index->bucket, bucket_len) != 0)
+		return;
+
+	pthread_rwlock_wrlock(&index->lock);
+	hi = index->n_changes;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if((c = riak_index_cmp(index->changes[mid].key, index->changes[mid].key_len, key, key_len)) == 0) {
+			index->changes[mid].removed = removed;
+			pthread_rwlock_unlock(&index->lock);
+			return;
+		}
+		if(c < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+
+	if(index->n_changes == index->changes_size) {
+		if((tmp = realloc(index->changes, (index->changes_size*2 + 16)*sizeof(struct riak_index_change))) == NULL) {
+			pthread_rwlock_unlock(&index->lock);
+			return;
+		}
+		index->changes = tmp;
+		index->changes_size = index->changes_size*2 + 16;
+	}
+	if((copy = malloc(key_len > 0 ? key_len : 1)) == NULL) {
+		pthread_rwlock_unlock(&index->lock);
+		return;
+	}
+	memcpy(copy, key, key_len);
+	tmp = index->changes + lo;
+	memmove(tmp+1, tmp, (index->n_changes - lo)*sizeof(struct riak_index_change));
+	tmp->key = copy;
+	tmp->key_len = key_len;
+	tmp->removed = removed;
+	index->n_changes++;
+	pthread_rwlock_unlock(&index->lock);
+}
+
+int riak_key_index_build(RIAK_CONN * connstruct, const char * bucket, size_t bucket_len, const char * path) {
+	struct riak_index_keys c;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	if((ret = riak_list_keys_stream_len(connstruct, bucket, bucket_len, riak_index_collect, &c)) == 0
+			&& (c.failed || riak_index_write(path, bucket, bucket_len, &c) != 0)) {
+		connstruct->last_error = RERR_IO;
+		ret = 1;
+	}
+	free(c.keys);
+	free(c.buf);
+	return ret;
+}
+
+RIAK_KEY_INDEX * riak_key_index_open(const char * path) {
+	const struct riak_index_header * hdr;
+	const __uint64_t * blocks;
+	RIAK_KEY_INDEX * index;
+	struct stat st;
+	__uint64_t i, rest;
+	void * map;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct riak_index_header)
+			|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	hdr = (const struct riak_index_header *)map;
+	if(hdr->magic != RIAK_INDEX_MAGIC || hdr->version != RIAK_INDEX_VERSION)
+		goto fail;
+	/* Sizes are bounded one at a time, so that damaged header can't make their sum wrap */
+	rest = st.st_size - sizeof(struct riak_index_header);
+	if(hdr->n_blocks > rest / sizeof(__uint64_t))
+		goto fail;
+	rest -= hdr->n_blocks*sizeof(__uint64_t);
+	if(hdr->bucket_len > rest || hdr->data_size != rest - hdr->bucket_len
+			|| (hdr->n_blocks == 0) != (hdr->data_size == 0))
+		goto fail;
+	/* Blocks must be in order and inside keys, as scans jump to them without further checks */
+	blocks = (const __uint64_t *)(hdr+1);
+	for(i = 0; i < hdr->n_blocks; i++) {
+		if(blocks[i] >= hdr->data_size || (i == 0 ? blocks[i] != 0 : blocks[i] <= blocks[i-1]))
+			goto fail;
+	}
+	if((index = malloc(sizeof(RIAK_KEY_INDEX))) == NULL)
+		goto fail;
+	index->map = map;
+	index->map_size = st.st_size;
+	index->blocks = (const __uint64_t *)(hdr+1);
+	index->n_blocks = hdr->n_blocks;
+	index->bucket = (const char *)(index->blocks + hdr->n_blocks);
+	index->bucket_len = hdr->bucket_len;
+	index->data = (const unsigned char *)index->bucket + hdr->bucket_len;
+	index->data_size = hdr->data_size;
+	pthread_rwlock_init(&index->lock, NULL);
+	index->changes = NULL;
+	index->n_changes = index->changes_size = 0;
+
+	return index;
+
+fail:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+RIAK_KEY_INDEX * riak_key_index_new(const char * bucket, size_t bucket_len) {
+	RIAK_KEY_INDEX * index;
+	char * name;
+
+	if((index = malloc(sizeof(RIAK_KEY_INDEX))) == NULL)
+		return NULL;
+	if((name = malloc(bucket_len+1)) == NULL) {
+		free(index);
+		return NULL;
+	}
+	if(bucket_len > 0)
+		memcpy(name, bucket, bucket_len);
+	index->map = NULL;
+	index->map_size = 0;
+	index->blocks = NULL;
+	index->n_blocks = 0;
+	index->bucket = name;
+	index->bucket_len = bucket_len;
+	/* Empty snapshot, which ends where it starts */
+	index->data = (const unsigned char *)name + bucket_len;
+	index->data_size = 0;
+	pthread_rwlock_init(&index->lock, NULL);
+	index->changes = NULL;
+	index->n_changes = index->changes_size = 0;
+
+	return index;
+}
+
+int riak_key_index_scan(RIAK_KEY_INDEX * index, const char * from, size_t from_len, const char * to, size_t to_len,
+		riak_keys_callback callback, void * userdata) {
+	struct riak_index_change * changes, * ch;
+	struct riak_index_batch batch;
+	struct riak_index_cursor cur;
+	size_t i, lo, hi, n, bytes;
+	int base, c, err;
+	char * keys;
+
+	if(from == NULL)
+		from_len = 0;
+
+	/* Changes in range are copied, so that callback runs without lock and may write through the index */
+	pthread_rwlock_rdlock(&index->lock);
+	lo = 0;
+	hi = index->n_changes;
+	while(lo < hi) {
+		i = (lo + hi) / 2;
+		if(riak_index_cmp(index->changes[i].key, index->changes[i].key_len, from, from_len) < 0)
+			lo = i+1;
+		else
+			hi = i;
+	}
+	for(i = lo, bytes = 0; i < index->n_changes
+			&& (to == NULL || riak_index_cmp(index->changes[i].key, index->changes[i].key_len, to, to_len) < 0); i++)
+		bytes += index->changes[i].key_len;
+	n = i - lo;
+	changes = malloc((n > 0 ? n : 1)*sizeof(struct riak_index_change));
+	keys = malloc(bytes > 0 ? bytes : 1);
+	if(changes == NULL || keys == NULL) {
+		pthread_rwlock_unlock(&index->lock);
+		free(changes);
+		free(keys);
+		return 1;
+	}
+	for(i = 0, bytes = 0; i < n; i++) {
+		changes[i] = index->changes[lo+i];
+		changes[i].key = keys + bytes;
+		if(changes[i].key_len > 0)
+			memcpy(changes[i].key, index->changes[lo+i].key, changes[i].key_len);
+		bytes += changes[i].key_len;
+	}
+	pthread_rwlock_unlock(&index->lock);
+
+	batch.buf = NULL;
+	batch.len = batch.size = batch.n_keys = 0;
+	batch.callback = callback;
+	batch.userdata = userdata;
+	batch.stopped = 0;
+	cur.key = NULL;
+	cur.key_size = 0;
+
+	i = 0;
+	err = riak_index_seek(index, &cur, from, from_len);
+	while(!err && !batch.stopped) {
+		base = cur.valid && (to == NULL || riak_index_cmp(cur.key, cur.key_len, to, to_len) < 0);
+		ch = i < n ? changes + i : NULL;
+		if(!base && ch == NULL)
+			break;
+
+		c = base && ch != NULL ? riak_index_cmp(ch->key, ch->key_len, cur.key, cur.key_len) : (ch != NULL ? -1 : 1);
+		if(c <= 0) {
+			/* Change replaces key of snapshot */
+			if(!ch->removed)
+				err = riak_index_emit(&batch, ch->key, ch->key_len);
+			if(c == 0 && !err)
+				err = riak_index_next(&cur);
+			i++;
+		} else {
+			if((err = riak_index_emit(&batch, cur.key, cur.key_len)) == 0)
+				err = riak_index_next(&cur);
+		}
+	}
+	if(!err && !batch.stopped && batch.n_keys > 0)
+		callback(batch.buf, batch.keys, batch.n_keys, userdata);
+
+	free(cur.key);
+	free(batch.buf);
+	free(changes);
+	free(keys);
+	return err;
+}
+
+int riak_key_index_prefix(RIAK_KEY_INDEX * index, const char * prefix, size_t prefix_len,
+		riak_keys_callback callback, void * userdata) {
+	size_t to_len = prefix_len;
+	char * to;
+	int ret;
+
+	/* Keys with prefix are below prefix with its last byte, which isn't 0xFF, incremented */
+	while(to_len > 0 && (unsigned char)prefix[to_len-1] == 0xFF)
+		to_len--;
+	if(to_len == 0)
+		return riak_key_index_scan(index, prefix, prefix_len, NULL, 0, callback, userdata);
+	if((to = malloc(to_len)) == NULL)
+		return 1;
+	memcpy(to, prefix, to_len);
+	to[to_len-1]++;
+	ret = riak_key_index_scan(index, prefix, prefix_len, to, to_len, callback, userdata);
+	free(to);
+	return ret;
+}
+
+void riak_key_index_add(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	riak_index_change(index, bucket, bucket_len, key, key_len, 0);
+}
+
+void riak_key_index_remove(RIAK_KEY_INDEX * index, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	riak_index_change(index, bucket, bucket_len, key, key_len, 1);
+}
+
+int riak_key_index_save(RIAK_KEY_INDEX * index, const char * path) {
+	struct riak_index_keys c;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	ret = riak_key_index_scan(index, NULL, 0, NULL, 0, riak_index_collect, &c) != 0 || c.failed
+			|| riak_index_write(path, index->bucket, index->bucket_len, &c) != 0;
+	free(c.keys);
+	free(c.buf);
+	return ret;
+}
+
+void riak_key_index_free(RIAK_KEY_INDEX * index) {
+	size_t i;
+
+	if(index == NULL)
+		return;
+	for(i = 0; i < index->n_changes; i++)
+		free(index->changes[i].key);
+	free(index->changes);
+	pthread_rwlock_destroy(&index->lock);
+	if(index->map != NULL)
+		munmap(index->map, index->map_size);
+	else
+		free((char *)index->bucket);
+	free(index);
+}
@@ -0,0 +1,367 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakpool.c
+ *
+ * Driver-wide pool of buffers used for frames, packed messages and HTTP responses.
+ *
+ * Buffers are grouped in power-of-two size classes. Every thread keeps small magazine of free buffers
+ * per class, so most allocations don't take any lock. Magazines exchange buffers with shared depot.
+ * Magazines are bounded by bytes, so big classes have few slots or none, and buffers kept in magazines
+ * count against limit of depot - free buffers over the limit go back to the heap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "riakdrv.h"
+
+/** Size of smallest class is 1 << RIAK_POOL_MIN_SHIFT bytes. */
+#define RIAK_POOL_MIN_SHIFT 6
+/** Largest number of buffers kept in one thread magazine. */
+#define RIAK_POOL_MAG_SIZE 16
+/** Bytes kept in one thread magazine at most; classes over 16 KB get fewer slots, over 256 KB none. */
+#define RIAK_POOL_MAG_BYTES (256*1024)
+/** Default limit of bytes kept in depot (all classes together). */
+#define RIAK_POOL_DEFAULT_LIMIT (64*1024*1024)
+/** Class index marking buffers allocated directly from the heap. */
+#define RIAK_POOL_LARGE 0xFFFF
+
+/**
+ * \brief Header placed before every buffer. Padded to 16 bytes to keep buffers aligned.
+ */
+union riak_buf_header {
+	struct {
+		/** Size class of buffer or RIAK_POOL_LARGE. */
+		unsigned int cls;
+		/** Requested size, kept for large buffers only. */
+		size_t size;
+	} h;
+	long double align;
+};
+
+/**
+ * \brief Shared store of free buffers of one class.
+ */
+struct riak_depot {
+	/** Free buffers (pointing at headers). */
+	union riak_buf_header ** bufs;
+	/** Number of buffers in depot. */
+	size_t count;
+	/** Maximum number of buffers in depot. */
+	size_t max;
+	/** Buffers handed out to users. */
+	size_t in_use;
+	/** Free buffers kept in depot and thread magazines together; updated atomically, as it is checked without lock. */
+	size_t cached;
+	/** Buffers obtained from heap since start. */
+	size_t allocated;
+};
+
+/**
+ * \brief Per-thread cache of free buffers of one class.
+ */
+struct riak_magazine {
+	/** Free buffers. */
+	union riak_buf_header * bufs[RIAK_POOL_MAG_SIZE];
+	/** Number of buffers in magazine. */
+	int count;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static struct riak_depot depots[RIAK_POOL_CLASSES];
+static size_t large_in_use = 0;
+static size_t pool_limit = RIAK_POOL_DEFAULT_LIMIT;
+
+static __thread struct riak_magazine mags[RIAK_POOL_CLASSES];
+static __thread int mags_registered = 0;
+
+/**	\fn int riak_pool_mag_slots(unsigned int cls)
+ * 	\brief Returns number of buffers of class kept in thread magazine.
+ */
+static inline int riak_pool_mag_slots(unsigned int cls) {
+	size_t slots = RIAK_POOL_MAG_BYTES >> (cls+RIAK_POOL_MIN_SHIFT);
+
+	return slots < RIAK_POOL_MAG_SIZE ? (int)slots : RIAK_POOL_MAG_SIZE;
+}
+
+/**	\fn void riak_pool_drain(struct riak_magazine * m, unsigned int cls, int keep)
+ * 	\brief Moves buffers from magazine to depot until keep remain. Buffers over depot limit go back to the heap.
+ *
+ * Must be called with pool_lock held.
+ */
+static void riak_pool_drain(struct riak_magazine * m, unsigned int cls, int keep) {
+	while(m->count > keep) {
+		m->count--;
+		if(depots[cls].count < depots[cls].max) {
+			depots[cls].bufs[depots[cls].count++] = m->bufs[m->count];
+		} else {
+			free(m->bufs[m->count]);
+			__sync_fetch_and_sub(&depots[cls].cached, 1);
+		}
+	}
+}
+
+/**	\fn void riak_pool_thread_exit(void * arg)
+ * 	\brief Returns buffers from magazines of finishing thread to depot.
+ */
+static void riak_pool_thread_exit(void * arg) {
+	struct riak_magazine * m = (struct riak_magazine *)arg;
+	int cls;
+
+	pthread_mutex_lock(&pool_lock);
+	for(cls = 0; cls < RIAK_POOL_CLASSES; cls++)
+		riak_pool_drain(&m[cls], cls, 0);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**	\fn void riak_pool_register(void)
+ * 	\brief Makes sure magazines of current thread will be returned to depot when it exits.
+ */
+static inline void riak_pool_register(void) {
+	if(!mags_registered) {
+		pthread_setspecific(pool_key, mags);
+		mags_registered = 1;
+	}
+}
+
+/**	\fn void riak_pool_init(void)
+ * 	\brief Initializes depots. Called once.
+ */
+static void riak_pool_init(void) {
+	int cls;
+
+	pthread_key_create(&pool_key, riak_pool_thread_exit);
+	for(cls = 0; cls < RIAK_POOL_CLASSES; cls++) {
+		depots[cls].max = pool_limit / RIAK_POOL_CLASSES / ((size_t)1 << (cls+RIAK_POOL_MIN_SHIFT));
+		/* Without array depot keeps nothing; riak_pool_set_limit may allocate it later */
+		if((depots[cls].bufs = malloc((depots[cls].max+1)*sizeof(union riak_buf_header *))) == NULL)
+			depots[cls].max = 0;
+	}
+}
+
+/**	\fn int riak_pool_class(size_t size)
+ * 	\brief Returns index of smallest class holding size bytes, or RIAK_POOL_LARGE.
+ */
+static inline unsigned int riak_pool_class(size_t size) {
+	unsigned int cls = 0;
+
+	size = (size-1) >> RIAK_POOL_MIN_SHIFT;
+	while(size > 0) {
+		size >>= 1;
+		cls++;
+	}
+	return cls < RIAK_POOL_CLASSES ? cls : RIAK_POOL_LARGE;
+}
+
+void * riak_buf_alloc(size_t size) {
+	union riak_buf_header * hdr;
+	struct riak_magazine * m;
+	unsigned int cls;
+	int n, refill;
+
+	if(size == 0)
+		size = 1;
+	cls = riak_pool_class(size);
+
+	if(cls == RIAK_POOL_LARGE) {
+		if((hdr = malloc(sizeof(union riak_buf_header)+size)) == NULL)
+			return NULL;
+		hdr->h.cls = RIAK_POOL_LARGE;
+		hdr->h.size = size;
+		__sync_fetch_and_add(&large_in_use, size);
+		return hdr+1;
+	}
+
+	pthread_once(&pool_once, riak_pool_init);
+	m = &mags[cls];
+
+	/* Magazine empty - refill half of it from depot; class without magazine takes just buffer it needs */
+	if(m->count == 0) {
+		riak_pool_register();
+		refill = riak_pool_mag_slots(cls)/2;
+		if(refill == 0)
+			refill = 1;
+		pthread_mutex_lock(&pool_lock);
+		for(n = 0; n < refill && depots[cls].count > 0; n++)
+			m->bufs[m->count++] = depots[cls].bufs[--depots[cls].count];
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	if(m->count > 0) {
+		hdr = m->bufs[--m->count];
+		__sync_fetch_and_sub(&depots[cls].cached, 1);
+	} else {
+		if((hdr = malloc(sizeof(union riak_buf_header)+((size_t)1 << (cls+RIAK_POOL_MIN_SHIFT)))) == NULL)
+			return NULL;
+		hdr->h.cls = cls;
+		__sync_fetch_and_add(&depots[cls].allocated, 1);
+	}
+	__sync_fetch_and_add(&depots[cls].in_use, 1);
+
+	return hdr+1;
+}
+
+void riak_buf_free(void * buf) {
+	union riak_buf_header * hdr;
+	struct riak_magazine * m;
+	unsigned int cls;
+	int slots;
+
+	if(buf == NULL)
+		return;
+
+	hdr = (union riak_buf_header *)buf - 1;
+	cls = hdr->h.cls;
+	if(cls == RIAK_POOL_LARGE) {
+		__sync_fetch_and_sub(&large_in_use, hdr->h.size);
+		free(hdr);
+		return;
+	}
+
+	m = &mags[cls];
+	slots = riak_pool_mag_slots(cls);
+	riak_pool_register();
+	__sync_fetch_and_sub(&depots[cls].in_use, 1);
+
+	/* Buffers in magazines count against limit too, so pool may be full even if depot isn't */
+	if(__sync_fetch_and_add(&depots[cls].cached, 1) >= __atomic_load_n(&depots[cls].max, __ATOMIC_RELAXED)) {
+		__sync_fetch_and_sub(&depots[cls].cached, 1);
+		free(hdr);
+		return;
+	}
+
+	/* Magazine full - move half of it to depot; class without magazine goes to depot directly */
+	if(m->count >= slots) {
+		pthread_mutex_lock(&pool_lock);
+		riak_pool_drain(m, cls, slots/2);
+		if(slots == 0) {
+			if(depots[cls].count < depots[cls].max) {
+				depots[cls].bufs[depots[cls].count++] = hdr;
+			} else {
+				free(hdr);
+				__sync_fetch_and_sub(&depots[cls].cached, 1);
+			}
+		}
+		pthread_mutex_unlock(&pool_lock);
+		if(slots == 0)
+			return;
+	}
+
+	m->bufs[m->count++] = hdr;
+}
+
+void * riak_buf_realloc(void * buf, size_t size) {
+	union riak_buf_header * hdr;
+	size_t old_size;
+	void * tmp;
+
+	if(buf == NULL)
+		return riak_buf_alloc(size);
+
+	hdr = (union riak_buf_header *)buf - 1;
+	/* Large buffer staying large - let the heap grow it in place if it can */
+	if(hdr->h.cls == RIAK_POOL_LARGE && riak_pool_class(size) == RIAK_POOL_LARGE) {
+		old_size = hdr->h.size;
+		if((tmp = realloc(hdr, sizeof(union riak_buf_header)+size)) == NULL)
+			return NULL;
+		hdr = tmp;
+		hdr->h.size = size;
+		__sync_fetch_and_add(&large_in_use, size - old_size);
+		return hdr+1;
+	}
+	if(hdr->h.cls == RIAK_POOL_LARGE)
+		old_size = hdr->h.size;
+	else
+		old_size = (size_t)1 << (hdr->h.cls+RIAK_POOL_MIN_SHIFT);
+	/* Buffer is already big enough */
+	if(size <= old_size)
+		return buf;
+
+	if((tmp = riak_buf_alloc(size)) == NULL)
+		return NULL;
+	memcpy(tmp, buf, old_size < size ? old_size : size);
+	riak_buf_free(buf);
+
+	return tmp;
+}
+
+void riak_pool_set_limit(size_t max_bytes) {
+	union riak_buf_header ** tmp;
+	size_t max;
+	int cls;
+
+	pthread_once(&pool_once, riak_pool_init);
+
+	pthread_mutex_lock(&pool_lock);
+	pool_limit = max_bytes;
+	for(cls = 0; cls < RIAK_POOL_CLASSES; cls++) {
+		max = pool_limit / RIAK_POOL_CLASSES / ((size_t)1 << (cls+RIAK_POOL_MIN_SHIFT));
+		/* Magazines of calling thread go through depot, so they are trimmed to new limit too */
+		riak_pool_drain(&mags[cls], cls, 0);
+		while(depots[cls].count > max) {
+			free(depots[cls].bufs[--depots[cls].count]);
+			__sync_fetch_and_sub(&depots[cls].cached, 1);
+		}
+		/* Array which couldn't grow still holds old limit, smaller one is always fine */
+		if((tmp = realloc(depots[cls].bufs, (max+1)*sizeof(union riak_buf_header *))) != NULL) {
+			depots[cls].bufs = tmp;
+			__atomic_store_n(&depots[cls].max, max, __ATOMIC_RELAXED);
+		} else if(max < depots[cls].max) {
+			__atomic_store_n(&depots[cls].max, max, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void riak_pool_trim(void) {
+	int cls;
+
+	pthread_once(&pool_once, riak_pool_init);
+
+	pthread_mutex_lock(&pool_lock);
+	for(cls = 0; cls < RIAK_POOL_CLASSES; cls++) {
+		/* Magazines of calling thread are emptied first, through depot */
+		riak_pool_drain(&mags[cls], cls, 0);
+		while(depots[cls].count > 0) {
+			free(depots[cls].bufs[--depots[cls].count]);
+			__sync_fetch_and_sub(&depots[cls].cached, 1);
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void riak_pool_stats(RIAK_POOL_STATS * stats) {
+	int cls;
+
+	pthread_once(&pool_once, riak_pool_init);
+
+	memset(stats, 0, sizeof(RIAK_POOL_STATS));
+	pthread_mutex_lock(&pool_lock);
+	for(cls = 0; cls < RIAK_POOL_CLASSES; cls++) {
+		stats->classes[cls].size = (size_t)1 << (cls+RIAK_POOL_MIN_SHIFT);
+		stats->classes[cls].in_use = depots[cls].in_use;
+		stats->classes[cls].cached = depots[cls].cached;
+		stats->classes[cls].allocated = depots[cls].allocated;
+		stats->bytes_in_use += stats->classes[cls].in_use * stats->classes[cls].size;
+		stats->bytes_cached += stats->classes[cls].cached * stats->classes[cls].size;
+	}
+	stats->large_bytes_in_use = large_in_use;
+	pthread_mutex_unlock(&pool_lock);
+}
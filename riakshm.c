@@ -0,0 +1,569 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakshm.c
+ *
+ * Shared-memory backend of object cache: table of cached objects in file mapped by all processes using it.
+ *
+ * Table is set-associative: object may be held by any of RIAK_SHM_WAYS consecutive slots chosen by its hash.
+ * Slots have fixed size, so objects bigger than slot aren't cached. Readers take no locks: every slot has
+ * sequence number, odd while slot is written, and reader retries if it changed during copying. Writers take
+ * process-shared robust mutexes of all slots of the set, so process killed while writing doesn't block others -
+ * slot it was writing is simply emptied. Times are kept as wall clock, which means the same in every process,
+ * so entries stay valid for processes started later.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "riakdrv.h"
+#include "riakcache.h"
+#include "riakshm.h"
+
+/** Marks initialized file ("RKSH"). */
+#define RIAK_SHM_MAGIC 0x524B5348u
+/** Layout version of file. */
+#define RIAK_SHM_VERSION 1
+/** Number of slots which may hold an object; must be power of two. */
+#define RIAK_SHM_WAYS 4
+/** Number of invalidation epochs; must be power of two. */
+#define RIAK_SHM_EPOCHS 1024
+/** Attempts to read slot consistently before lookup gives up (and reports miss). */
+#define RIAK_SHM_READ_TRIES 16
+/** Slot holds not-found result. */
+#define RIAK_SHM_NEGATIVE 1
+
+/**
+ * \brief Lengths of names and parts of object held by slot.
+ */
+struct riak_shm_lens {
+	/** Length of bucket name. */
+	__uint32_t bucket_len;
+	/** Length of key. */
+	__uint32_t key_len;
+	/** Length of value. */
+	__uint32_t value_len;
+	/** Length of content type with terminator; 0 if not set. */
+	__uint32_t ctype_len;
+	/** Length of vtag with terminator; 0 if not set. */
+	__uint32_t vtag_len;
+	/** Length of vector clock; 0 if not set. */
+	__uint32_t vclock_len;
+};
+
+/**
+ * \brief Beginning of mapped file.
+ */
+struct riak_shm_header {
+	/** RIAK_SHM_MAGIC once file is initialized. */
+	unsigned int magic;
+	/** RIAK_SHM_VERSION. */
+	unsigned int version;
+	/** Size of slot. */
+	size_t slot_size;
+	/** Number of slots; power of two. */
+	size_t n_slots;
+	/** Incremented by invalidations of objects of their part of table. */
+	unsigned int epochs[RIAK_SHM_EPOCHS];
+} __attribute__((aligned(64)));
+
+/**
+ * \brief Slot of table.
+ */
+struct riak_shm_slot {
+	/** Held by writers. */
+	pthread_mutex_t lock;
+	/** Odd while slot is written. */
+	unsigned int seq;
+	/** RIAK_SHM_* flags. */
+	unsigned int flags;
+	/** Hash of bucket and key; 0 if slot is empty. */
+	__uint64_t hash;
+	/** Expiration time (wall clock, ms). */
+	long long expires;
+	/** Last modification time of object (seconds part). */
+	__uint32_t last_mod;
+	/** Last modification time of object (microseconds part). */
+	__uint32_t last_mod_usecs;
+	/** Number of siblings of object. */
+	__uint32_t n_siblings;
+	/** Lengths of data. */
+	struct riak_shm_lens lens;
+	/** Bucket name, key, value, content type, vtag, then vector clock. */
+	char data[];
+};
+
+struct riak_shm {
+	/** Mapped file. */
+	struct riak_shm_header * hdr;
+	/** Size of mapping. */
+	size_t map_size;
+	/** Size of slot. */
+	size_t slot_size;
+	/** Number of slots minus one. */
+	size_t mask;
+	/** Bytes of data slot can hold. */
+	size_t capacity;
+};
+
+/**	\fn long long riak_shm_now(void)
+ * 	\brief Returns wall clock time in milliseconds.
+ */
+static inline long long riak_shm_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**	\fn struct riak_shm_slot * riak_shm_slot(RIAK_SHM * shm, size_t i)
+ * 	\brief Returns i-th slot.
+ */
+static inline struct riak_shm_slot * riak_shm_slot(RIAK_SHM * shm, size_t i) {
+	return (struct riak_shm_slot *)((char *)shm->hdr + sizeof(struct riak_shm_header) + i*shm->slot_size);
+}
+
+/**	\fn unsigned int * riak_shm_epoch_of(RIAK_SHM * shm, __uint64_t hash)
+ * 	\brief Returns invalidation epoch covering set of given hash.
+ */
+static inline unsigned int * riak_shm_epoch_of(RIAK_SHM * shm, __uint64_t hash) {
+	return &shm->hdr->epochs[((hash & shm->mask) / RIAK_SHM_WAYS) & (RIAK_SHM_EPOCHS-1)];
+}
+
+/**	\fn size_t riak_shm_total(const struct riak_shm_lens * lens)
+ * 	\brief Returns number of data bytes described by lens.
+ */
+static inline size_t riak_shm_total(const struct riak_shm_lens * lens) {
+	return (size_t)lens->bucket_len + lens->key_len + lens->value_len + lens->ctype_len + lens->vtag_len
+			+ lens->vclock_len;
+}
+
+/**	\fn void riak_shm_begin(struct riak_shm_slot * s)
+ * 	\brief Makes sequence number of slot odd before it is written. Slot must be locked.
+ */
+static inline void riak_shm_begin(struct riak_shm_slot * s) {
+	/* Number may already be odd if previous writer died */
+	__atomic_store_n(&s->seq, (s->seq+1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**	\fn void riak_shm_end(struct riak_shm_slot * s)
+ * 	\brief Makes sequence number of slot even after it was written. Slot must be locked.
+ */
+static inline void riak_shm_end(struct riak_shm_slot * s) {
+	__atomic_store_n(&s->seq, s->seq+1, __ATOMIC_RELEASE);
+}
+
+/**	\fn int riak_shm_lock(struct riak_shm_slot * s)
+ * 	\brief Locks slot for writing. Slot left by process which died while writing it is emptied.
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_shm_lock(struct riak_shm_slot * s) {
+	int err;
+
+	if((err = pthread_mutex_lock(&s->lock)) == EOWNERDEAD) {
+		riak_shm_begin(s);
+		s->hash = 0;
+		riak_shm_end(s);
+		pthread_mutex_consistent(&s->lock);
+		err = 0;
+	}
+	return err;
+}
+
+/**	\fn int riak_shm_lock_set(RIAK_SHM * shm, __uint64_t hash, struct riak_shm_slot ** set)
+ * 	\brief Locks all slots which may hold object of given hash, always in the same order.
+ *
+ * @param set filled with RIAK_SHM_WAYS slots
+ *
+ * @return 0 if success, not 0 on error
+ */
+static int riak_shm_lock_set(RIAK_SHM * shm, __uint64_t hash, struct riak_shm_slot ** set) {
+	size_t first = hash & shm->mask & ~(size_t)(RIAK_SHM_WAYS-1);
+	int i;
+
+	for(i = 0; i < RIAK_SHM_WAYS; i++) {
+		set[i] = riak_shm_slot(shm, first+i);
+		if(riak_shm_lock(set[i]) != 0) {
+			while(i-- > 0)
+				pthread_mutex_unlock(&set[i]->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**	\fn void riak_shm_unlock_set(struct riak_shm_slot ** set)
+ * 	\brief Unlocks slots locked by riak_shm_lock_set.
+ */
+static void riak_shm_unlock_set(struct riak_shm_slot ** set) {
+	int i;
+
+	for(i = RIAK_SHM_WAYS-1; i >= 0; i--)
+		pthread_mutex_unlock(&set[i]->lock);
+}
+
+/**	\fn int riak_shm_match(struct riak_shm_slot * s, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ * 	\brief Checks whether slot holds given object. Slot must be locked.
+ */
+static int riak_shm_match(struct riak_shm_slot * s, __uint64_t hash, const char * bucket, size_t bucket_len,
+		const char * key, size_t key_len) {
+	return s->hash == hash && s->lens.bucket_len == bucket_len && s->lens.key_len == key_len
+			&& memcmp(s->data, bucket, bucket_len) == 0 && memcmp(s->data+bucket_len, key, key_len) == 0;
+}
+
+/**	\fn int riak_shm_rank(struct riak_shm_slot * s, long long now)
+ * 	\brief Returns how valuable content of slot is: 0 if slot is empty or expired, 1 for not-found result, 2 for object.
+ */
+static int riak_shm_rank(struct riak_shm_slot * s, long long now) {
+	if(s->hash == 0 || s->expires <= now)
+		return 0;
+	return (s->flags & RIAK_SHM_NEGATIVE) ? 1 : 2;
+}
+
+/**	\fn char * riak_shm_dup(const char * src, size_t len, int terminated)
+ * 	\brief Copies len bytes of slot data; if terminated is set, last byte is terminator and is overwritten with one,
+ * otherwise terminator is appended. Slot may be written meanwhile, so copy is checked by caller.
+ */
+static char * riak_shm_dup(const char * src, size_t len, int terminated) {
+	char * dst;
+
+	if((dst = malloc(terminated ? len : len+1)) == NULL)
+		return NULL;
+	memcpy(dst, src, len);
+	dst[terminated ? len-1 : len] = '\0';
+
+	return dst;
+}
+
+/**	\fn RIAK_OBJECT * riak_shm_copy(struct riak_shm_slot * s, const struct riak_shm_lens * lens)
+ * 	\brief Copies object out of slot, using lengths read before. Returns NULL if out of memory.
+ */
+static RIAK_OBJECT * riak_shm_copy(struct riak_shm_slot * s, const struct riak_shm_lens * lens) {
+	const char * p = s->data + lens->bucket_len + lens->key_len;
+	RIAK_OBJECT * obj;
+
+	if((obj = calloc(1, sizeof(RIAK_OBJECT))) == NULL)
+		return NULL;
+	obj->value = riak_shm_dup(p, lens->value_len, 0);
+	obj->value_len = lens->value_len;
+	p += lens->value_len;
+	if(lens->ctype_len > 0)
+		obj->content_type = riak_shm_dup(p, lens->ctype_len, 1);
+	p += lens->ctype_len;
+	if(lens->vtag_len > 0)
+		obj->vtag = riak_shm_dup(p, lens->vtag_len, 1);
+	p += lens->vtag_len;
+	if(lens->vclock_len > 0)
+		obj->vclock = riak_shm_dup(p, lens->vclock_len, 0);
+	obj->vclock_len = lens->vclock_len;
+	obj->last_mod = s->last_mod;
+	obj->last_mod_usecs = s->last_mod_usecs;
+	obj->n_siblings = s->n_siblings;
+	if(obj->value == NULL || (lens->ctype_len > 0 && obj->content_type == NULL)
+			|| (lens->vtag_len > 0 && obj->vtag == NULL) || (lens->vclock_len > 0 && obj->vclock == NULL)) {
+		riak_object_free(obj);
+		return NULL;
+	}
+
+	return obj;
+}
+
+/**	\fn int riak_shm_read(RIAK_SHM * shm, struct riak_shm_slot * s, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len, long long now, RIAK_OBJECT ** obj)
+ * 	\brief Reads slot without locking it, retrying while it is written.
+ *
+ * @return RIAK_CACHE_HIT (obj set), RIAK_CACHE_ABSENT, or RIAK_CACHE_MISS if slot doesn't hold live copy of object
+ */
+static int riak_shm_read(RIAK_SHM * shm, struct riak_shm_slot * s, __uint64_t hash, const char * bucket, size_t bucket_len,
+		const char * key, size_t key_len, long long now, RIAK_OBJECT ** obj) {
+	struct riak_shm_lens lens;
+	RIAK_OBJECT * copy;
+	unsigned int seq;
+	int tries, ret;
+
+	for(tries = 0; tries < RIAK_SHM_READ_TRIES; tries++) {
+		if((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+			continue;
+		if(s->hash != hash)
+			return RIAK_CACHE_MISS;
+
+		copy = NULL;
+		ret = RIAK_CACHE_MISS;
+		/* Lengths are read once - data may change under us, but must never be read out of slot */
+		lens = s->lens;
+		if(s->expires > now && lens.bucket_len == bucket_len && lens.key_len == key_len
+				&& riak_shm_total(&lens) <= shm->capacity
+				&& memcmp(s->data, bucket, bucket_len) == 0 && memcmp(s->data+bucket_len, key, key_len) == 0) {
+			if(s->flags & RIAK_SHM_NEGATIVE)
+				ret = RIAK_CACHE_ABSENT;
+			else if((copy = riak_shm_copy(s, &lens)) != NULL)
+				ret = RIAK_CACHE_HIT;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+			if(ret == RIAK_CACHE_HIT)
+				*obj = copy;
+			return ret;
+		}
+		riak_object_free(copy);
+	}
+
+	/* Slot keeps being rewritten - fetching object is cheaper than waiting */
+	return RIAK_CACHE_MISS;
+}
+
+RIAK_SHM * riak_shm_open(const char * path, size_t max_bytes, size_t max_object) {
+	size_t slot_size = (sizeof(struct riak_shm_slot) + max_object + 63) & ~(size_t)63;
+	struct riak_shm_header * hdr;
+	pthread_mutexattr_t attr;
+	size_t n_slots, size, i;
+	struct stat st;
+	RIAK_SHM * shm;
+	void * map;
+	int fd;
+
+	if(path == NULL || max_bytes / slot_size < RIAK_SHM_WAYS)
+		return NULL;
+	for(n_slots = RIAK_SHM_WAYS; n_slots*2 <= max_bytes / slot_size; n_slots *= 2)
+		;
+	size = sizeof(struct riak_shm_header) + n_slots*slot_size;
+
+	if((shm = malloc(sizeof(RIAK_SHM))) == NULL)
+		return NULL;
+	if((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		free(shm);
+		return NULL;
+	}
+	/* Processes started together mustn't initialize file at the same time */
+	if(flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0)
+		goto fail;
+	/* File of other size belongs to processes using other sizes - it can't be shared */
+	if(st.st_size != (off_t)size && (st.st_size != 0 || ftruncate(fd, size) != 0))
+		goto fail;
+	if((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+
+	hdr = (struct riak_shm_header *)map;
+	if(hdr->magic != RIAK_SHM_MAGIC) {
+		/* New file, or its creator died before initializing it */
+		memset(map, 0, size);
+		hdr->version = RIAK_SHM_VERSION;
+		hdr->slot_size = slot_size;
+		hdr->n_slots = n_slots;
+		shm->hdr = hdr;
+		shm->slot_size = slot_size;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		for(i = 0; i < n_slots; i++)
+			pthread_mutex_init(&riak_shm_slot(shm, i)->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		__atomic_store_n(&hdr->magic, RIAK_SHM_MAGIC, __ATOMIC_RELEASE);
+	} else if(hdr->version != RIAK_SHM_VERSION || hdr->slot_size != slot_size || hdr->n_slots != n_slots) {
+		munmap(map, size);
+		goto fail;
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	shm->hdr = hdr;
+	shm->map_size = size;
+	shm->slot_size = slot_size;
+	shm->mask = n_slots-1;
+	shm->capacity = slot_size - sizeof(struct riak_shm_slot);
+
+	return shm;
+
+fail:
+	close(fd);
+	free(shm);
+	return NULL;
+}
+
+void riak_shm_close(RIAK_SHM * shm) {
+	munmap(shm->hdr, shm->map_size);
+	free(shm);
+}
+
+unsigned int riak_shm_epoch(RIAK_SHM * shm, __uint64_t hash) {
+	return __atomic_load_n(riak_shm_epoch_of(shm, hash), __ATOMIC_ACQUIRE);
+}
+
+int riak_shm_lookup(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj) {
+	size_t first = hash & shm->mask & ~(size_t)(RIAK_SHM_WAYS-1);
+	long long now = riak_shm_now();
+	int i, ret;
+
+	if(hash == 0)
+		hash = 1;
+	for(i = 0; i < RIAK_SHM_WAYS; i++) {
+		ret = riak_shm_read(shm, riak_shm_slot(shm, first+i), hash, bucket, bucket_len, key, key_len, now, obj);
+		if(ret != RIAK_CACHE_MISS)
+			return ret;
+	}
+	return RIAK_CACHE_MISS;
+}
+
+int riak_shm_store(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const RIAK_OBJECT * obj, unsigned int ttl_ms, unsigned int epoch) {
+	struct riak_shm_slot * set[RIAK_SHM_WAYS], * s, * victim = NULL;
+	long long now = riak_shm_now();
+	struct riak_shm_lens lens;
+	int i, rank, evicted = 0;
+	char * p;
+
+	memset(&lens, 0, sizeof(lens));
+	lens.bucket_len = bucket_len;
+	lens.key_len = key_len;
+	if(obj != NULL) {
+		lens.value_len = obj->value_len;
+		lens.ctype_len = obj->content_type ? strlen(obj->content_type)+1 : 0;
+		lens.vtag_len = obj->vtag ? strlen(obj->vtag)+1 : 0;
+		lens.vclock_len = obj->vclock ? obj->vclock_len : 0;
+	}
+	if(riak_shm_total(&lens) > shm->capacity)
+		return 0;
+	if(hash == 0)
+		hash = 1;
+
+	if(riak_shm_lock_set(shm, hash, set) != 0)
+		return 0;
+	/* Object was fetched before some write was noticed - it may be stale */
+	if(__atomic_load_n(riak_shm_epoch_of(shm, hash), __ATOMIC_ACQUIRE) != epoch)
+		goto unlock;
+
+	/* Previous copy of object is replaced, otherwise least valuable slot, expiring first */
+	for(i = 0; i < RIAK_SHM_WAYS; i++) {
+		s = set[i];
+		if(riak_shm_match(s, hash, bucket, bucket_len, key, key_len)) {
+			victim = s;
+			break;
+		}
+		if(victim == NULL || riak_shm_rank(s, now) < riak_shm_rank(victim, now)
+				|| (riak_shm_rank(s, now) == riak_shm_rank(victim, now) && s->expires < victim->expires))
+			victim = s;
+	}
+	if(i == RIAK_SHM_WAYS && (rank = riak_shm_rank(victim, now)) > 0) {
+		/* Not-found results never push objects out */
+		if(obj == NULL && rank == 2)
+			goto unlock;
+		evicted = 1;
+	}
+
+	riak_shm_begin(victim);
+	victim->flags = obj != NULL ? 0 : RIAK_SHM_NEGATIVE;
+	victim->hash = hash;
+	victim->expires = now + ttl_ms;
+	victim->last_mod = obj != NULL ? obj->last_mod : 0;
+	victim->last_mod_usecs = obj != NULL ? obj->last_mod_usecs : 0;
+	victim->n_siblings = obj != NULL ? obj->n_siblings : 0;
+	victim->lens = lens;
+	p = victim->data;
+	memcpy(p, bucket, bucket_len);
+	p += bucket_len;
+	memcpy(p, key, key_len);
+	p += key_len;
+	if(obj != NULL) {
+		memcpy(p, obj->value, lens.value_len);
+		p += lens.value_len;
+		if(lens.ctype_len > 0)
+			memcpy(p, obj->content_type, lens.ctype_len);
+		p += lens.ctype_len;
+		if(lens.vtag_len > 0)
+			memcpy(p, obj->vtag, lens.vtag_len);
+		p += lens.vtag_len;
+		if(lens.vclock_len > 0)
+			memcpy(p, obj->vclock, lens.vclock_len);
+	}
+	riak_shm_end(victim);
+
+unlock:
+	riak_shm_unlock_set(set);
+	return evicted;
+}
+
+void riak_shm_invalidate(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len) {
+	struct riak_shm_slot * set[RIAK_SHM_WAYS];
+	int i;
+
+	if(hash == 0)
+		hash = 1;
+	/* Bumped before slot is emptied, so that get which read old epoch can't store object afterwards */
+	__atomic_add_fetch(riak_shm_epoch_of(shm, hash), 1, __ATOMIC_ACQ_REL);
+	if(riak_shm_lock_set(shm, hash, set) != 0)
+		return;
+	for(i = 0; i < RIAK_SHM_WAYS; i++) {
+		if(riak_shm_match(set[i], hash, bucket, bucket_len, key, key_len)) {
+			riak_shm_begin(set[i]);
+			set[i]->hash = 0;
+			riak_shm_end(set[i]);
+		}
+	}
+	riak_shm_unlock_set(set);
+}
+
+void riak_shm_clear(RIAK_SHM * shm) {
+	struct riak_shm_slot * set[RIAK_SHM_WAYS];
+	size_t first;
+	int i;
+
+	for(i = 0; i < RIAK_SHM_EPOCHS; i++)
+		__atomic_add_fetch(&shm->hdr->epochs[i], 1, __ATOMIC_ACQ_REL);
+	for(first = 0; first <= shm->mask; first += RIAK_SHM_WAYS) {
+		if(riak_shm_lock_set(shm, first, set) != 0)
+			continue;
+		for(i = 0; i < RIAK_SHM_WAYS; i++) {
+			if(set[i]->hash != 0) {
+				riak_shm_begin(set[i]);
+				set[i]->hash = 0;
+				riak_shm_end(set[i]);
+			}
+		}
+		riak_shm_unlock_set(set);
+	}
+}
+
+void riak_shm_stats(RIAK_SHM * shm, RIAK_CACHE_STATS * stats) {
+	long long now = riak_shm_now();
+	struct riak_shm_slot * s;
+	size_t i;
+
+	for(i = 0; i <= shm->mask; i++) {
+		s = riak_shm_slot(shm, i);
+		switch(riak_shm_rank(s, now)) {
+		case 1:
+			stats->negative_entries++;
+			break;
+		case 2:
+			stats->entries++;
+			break;
+		default:
+			continue;
+		}
+		stats->bytes += sizeof(struct riak_shm_slot) + riak_shm_total(&s->lens);
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ * riakshm.h
+ *
+ * Internal interface of shared-memory backend of object cache. Not installed.
+ */
+
+#ifndef __RIAKSHM_H__
+
+#define __RIAKSHM_H__
+
+#include "riakdrv.h"
+
+/** Table of cached objects in file mapped by many processes. */
+typedef struct riak_shm RIAK_SHM;
+
+/** \fn RIAK_SHM * riak_shm_open(const char * path, size_t max_bytes, size_t max_object)
+ *  \brief Maps table from file, creating and initializing file if it doesn't exist yet.
+ *
+ *  @return table; NULL on error (also when existing file was created with other sizes)
+ */
+RIAK_SHM * riak_shm_open(const char * path, size_t max_bytes, size_t max_object);
+
+/** \fn void riak_shm_close(RIAK_SHM * shm)
+ *  \brief Unmaps table. File and its entries stay for other processes.
+ */
+void riak_shm_close(RIAK_SHM * shm);
+
+/** \fn unsigned int riak_shm_epoch(RIAK_SHM * shm, __uint64_t hash)
+ *  \brief Returns invalidation epoch of part of table holding object of given hash, for riak_shm_store.
+ */
+unsigned int riak_shm_epoch(RIAK_SHM * shm, __uint64_t hash);
+
+/** \fn int riak_shm_lookup(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len, RIAK_OBJECT ** obj)
+ *  \brief Looks object up without taking any lock.
+ *
+ *  @param obj on hit, set to newly allocated copy of object
+ *
+ *  @return RIAK_CACHE_HIT, RIAK_CACHE_ABSENT or RIAK_CACHE_MISS
+ */
+int riak_shm_lookup(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		RIAK_OBJECT ** obj);
+
+/** \fn int riak_shm_store(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len, const RIAK_OBJECT * obj, unsigned int ttl_ms, unsigned int epoch)
+ *  \brief Stores copy of object, or not-found result if obj is NULL.
+ *
+ *  Nothing is stored if object is bigger than slot, or if its part of table was invalidated since epoch was read.
+ *
+ *  @return 1 if other live entry was evicted, 0 otherwise
+ */
+int riak_shm_store(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len,
+		const RIAK_OBJECT * obj, unsigned int ttl_ms, unsigned int epoch);
+
+/** \fn void riak_shm_invalidate(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len)
+ *  \brief Drops object, and makes gets of it started before (in any process) not store their results.
+ */
+void riak_shm_invalidate(RIAK_SHM * shm, __uint64_t hash, const char * bucket, size_t bucket_len, const char * key, size_t key_len);
+
+/** \fn void riak_shm_clear(RIAK_SHM * shm)
+ *  \brief Drops all entries.
+ */
+void riak_shm_clear(RIAK_SHM * shm);
+
+/** \fn void riak_shm_stats(RIAK_SHM * shm, RIAK_CACHE_STATS * stats)
+ *  \brief Adds numbers of live entries and their bytes to stats. Counts are approximate while table is written.
+ */
+void riak_shm_stats(RIAK_SHM * shm, RIAK_CACHE_STATS * stats);
+
+#endif
@@ -18,14 +18,178 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "riakdrv.h"
 
+#define TEST_INDEX_FILE "test.idx"
+
+/**
+ * \brief Keys which scan of index should pass, in order; only their number is checked if keys is NULL.
+ */
+struct expected_keys {
+	const char ** keys;
+	size_t n_keys;
+	size_t pos;
+	int failed;
+};
+
+/**	\fn int compare_keys(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata)
+ * 	\brief Callback for riak_key_index_scan which compares keys with struct expected_keys.
+ */
+static int compare_keys(const char * msg, const RIAK_SLICE * keys, size_t n_keys, void * userdata) {
+	struct expected_keys * exp = (struct expected_keys *)userdata;
+	size_t i;
+
+	for(i = 0; i < n_keys; i++, exp->pos++) {
+		if(exp->keys == NULL)
+			continue;
+		if(exp->pos >= exp->n_keys || keys[i].len != strlen(exp->keys[exp->pos])
+				|| memcmp(msg+keys[i].offset, exp->keys[exp->pos], keys[i].len) != 0)
+			exp->failed = 1;
+	}
+	return 0;
+}
+
+/**	\fn int scan_gives(RIAK_KEY_INDEX * index, const char * from, const char * to, const char ** keys, size_t n_keys)
+ * 	\brief Checks keys of range [from, to) of index; NULL bound means start or end of index.
+ */
+static int scan_gives(RIAK_KEY_INDEX * index, const char * from, const char * to, const char ** keys, size_t n_keys) {
+	struct expected_keys exp = { keys, n_keys, 0, 0 };
+
+	if(riak_key_index_scan(index, from, from ? strlen(from) : 0, to, to ? strlen(to) : 0, compare_keys, &exp) != 0)
+		return 0;
+	return !exp.failed && exp.pos == n_keys;
+}
+
+/**	\fn int prefix_gives(RIAK_KEY_INDEX * index, const char * prefix, const char ** keys, size_t n_keys)
+ * 	\brief Checks keys of index starting with prefix.
+ */
+static int prefix_gives(RIAK_KEY_INDEX * index, const char * prefix, const char ** keys, size_t n_keys) {
+	struct expected_keys exp = { keys, n_keys, 0, 0 };
+
+	if(riak_key_index_prefix(index, prefix, strlen(prefix), compare_keys, &exp) != 0)
+		return 0;
+	return !exp.failed && exp.pos == n_keys;
+}
+
+/**	\fn int check_index(void)
+ * 	\brief Builds key index from fixed keys, saves and reopens it, and checks range and prefix scans over
+ * 	snapshot and over changes made after it.
+ */
+static int check_index(void) {
+	static const char * added[] = { "b", "l", "k\xff\xff", "a", "k", "\xff", "ka", "k\xff", "\xff\xff", "k\xff\x01", "a" };
+	static const char * all[] = { "a", "b", "k", "ka", "k\xff", "k\xff\x01", "k\xff\xff", "l", "\xff", "\xff\xff" };
+	static const char * range[] = { "b", "k", "ka", "k\xff", "k\xff\x01", "k\xff\xff" };
+	static const char * prefix_ff[] = { "k\xff", "k\xff\x01", "k\xff\xff" };
+	static const char * prefix_k[] = { "k", "ka", "k\xff", "k\xff\x01", "k\xff\xff" };
+	static const char * top[] = { "\xff", "\xff\xff" };
+	static const char * numbered[] = { "n050", "n051", "n052" };
+	static const char * merged[] = { "b", "k", "kb", "k\xff", "k\xff\x01", "k\xff\xff" };
+	RIAK_KEY_INDEX * index;
+	char key[8];
+	size_t i;
+	int ok;
+
+	printf("\tkey index... ");
+	if((index = riak_key_index_new("idx", 3)) == NULL) {
+		printf("ERROR\n");
+		return 1;
+	}
+	for(i = 0; i < sizeof(added)/sizeof(added[0]); i++)
+		riak_key_index_add(index, "idx", 3, added[i], strlen(added[i]));
+	/* Keys of other buckets are ignored */
+	riak_key_index_add(index, "other", 5, "c", 1);
+	ok = scan_gives(index, NULL, NULL, all, 10);
+
+	/* Enough keys for many blocks of snapshot */
+	for(i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "n%03u", (unsigned int)i);
+		riak_key_index_add(index, "idx", 3, key, strlen(key));
+	}
+	ok = ok && riak_key_index_save(index, TEST_INDEX_FILE) == 0;
+	riak_key_index_free(index);
+
+	if(!ok || (index = riak_key_index_open(TEST_INDEX_FILE)) == NULL) {
+		printf("ERROR\n");
+		unlink(TEST_INDEX_FILE);
+		return 1;
+	}
+	ok = scan_gives(index, NULL, NULL, NULL, 110)
+			&& scan_gives(index, NULL, "b", all, 1)
+			&& scan_gives(index, "b", "l", range, 6)
+			&& scan_gives(index, "n050", "n053", numbered, 3)
+			&& scan_gives(index, "\xff", NULL, top, 2)
+			&& prefix_gives(index, "k\xff", prefix_ff, 3)
+			&& prefix_gives(index, "k", prefix_k, 5)
+			&& prefix_gives(index, "\xff", top, 2)
+			&& prefix_gives(index, "n1", NULL, 0);
+
+	/* Changes are merged with snapshot, and saved with it */
+	riak_key_index_remove(index, "idx", 3, "ka", 2);
+	riak_key_index_remove(index, "idx", 3, "a", 1);
+	riak_key_index_add(index, "idx", 3, "kb", 2);
+	ok = ok && scan_gives(index, NULL, "l", merged, 6) && scan_gives(index, NULL, NULL, NULL, 109)
+			&& riak_key_index_save(index, TEST_INDEX_FILE) == 0;
+	riak_key_index_free(index);
+	if(ok && (index = riak_key_index_open(TEST_INDEX_FILE)) != NULL) {
+		ok = scan_gives(index, NULL, "l", merged, 6) && scan_gives(index, NULL, NULL, NULL, 109);
+		riak_key_index_free(index);
+	} else {
+		ok = 0;
+	}
+
+	unlink(TEST_INDEX_FILE);
+	printf("%s\n", ok ? "OK" : "ERROR");
+	return !ok;
+}
+
+/**	\fn int check_filter(void)
+ * 	\brief Checks that filter of bucket whose keys were all added finds absent keys, without false negatives.
+ */
+static int check_filter(void) {
+	RIAK_KEY_FILTER * filter;
+	char key[24];
+	int i, ok, absent = 0;
+
+	printf("\tkey filter... ");
+	if((filter = riak_key_filter_new(1000, 10)) == NULL) {
+		printf("ERROR\n");
+		return 1;
+	}
+	for(i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		riak_key_filter_add(filter, "f", 1, key, strlen(key));
+	}
+	/* Bucket which isn't loaded may hold any key */
+	ok = riak_key_filter_maybe(filter, "f", 1, "missing", 7) && riak_key_filter_mark(filter, "f", 1) == 0;
+
+	for(i = 0; i < 1000 && ok; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		ok = riak_key_filter_maybe(filter, "f", 1, key, strlen(key));
+	}
+	for(i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "absent%d", i);
+		absent += !riak_key_filter_maybe(filter, "f", 1, key, strlen(key));
+	}
+	/* 10 bits per key give about 1% of false positives */
+	ok = ok && absent >= 950 && riak_key_filter_maybe(filter, "g", 1, "absent0", 7);
+	riak_key_filter_free(filter);
+
+	printf("%s\n", ok ? "OK" : "ERROR");
+	return !ok;
+}
+
 int main() {
 	RIAK_CONN * conn;
-	char ** buckets;
-	int res, n_buckets, i;
+	char ** buckets, ** keys;
+	int res, n_buckets, n_keys, i;
+
+	/* Parts which don't need Riak */
+	printf("Offline checks:\n");
+	if(check_index() != 0 || check_filter() != 0)
+		return 1;
 
 	printf("Connecting... ");
 	conn = riak_init("127.0.0.1", 8087, 0, NULL);
@@ -55,6 +219,12 @@ int main() {
 	for(i=0; i<n_buckets; i++)
 		printf("\t%s\n", buckets[i]);
 
+	printf("Listing keys in bucket 'drvbucket':\n");
+	keys = riak_list_keys(conn, "drvbucket", &n_keys);
+	for(i=0; keys != NULL && i<n_keys; i++)
+		printf("\t%s\n", keys[i]);
+	free(keys);
+
 	printf("Closing connection... ");
 	riak_close(conn);
 	printf("OK\n");
@@ -0,0 +1,172 @@
+/*
+ *  Copyright 2011 Piotr Nosek & Erlang Solutions Ltd.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+*/
+
+/*
+ * Checks of driver parts which need no Riak, through internal interfaces. Built with "make unittest";
+ * exits with non-zero status if any check fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "riakdrv.h"
+#include "riakcache.h"
+#include "riakdigest.h"
+
+#define TEST_SHM_FILE "unittest.shm"
+#define TEST_CACHE_FILE "unittest.cache"
+
+/**	\fn void cache_fill(RIAK_CACHE * cache, const char * bucket, const char * key, const char * value)
+ * 	\brief Stores object in cache, as get which missed it does.
+ */
+static void cache_fill(RIAK_CACHE * cache, const char * bucket, const char * key, const char * value) {
+	RIAK_CACHE_TICKET ticket;
+	RIAK_OBJECT obj, * cached = NULL;
+
+	if(riak_cache_lookup(cache, bucket, strlen(bucket), key, strlen(key), &cached, 0, &ticket) != RIAK_CACHE_MISS) {
+		riak_object_free(cached);
+		return;
+	}
+	memset(&obj, 0, sizeof(obj));
+	obj.value = (char *)value;
+	obj.value_len = strlen(value);
+	obj.n_siblings = 1;
+	riak_cache_store(cache, bucket, strlen(bucket), key, strlen(key), &obj, &ticket);
+}
+
+/**	\fn int cache_holds(RIAK_CACHE * cache, const char * bucket, const char * key, const char * value)
+ * 	\brief Checks that cache holds object with value, or doesn't hold object if value is NULL.
+ */
+static int cache_holds(RIAK_CACHE * cache, const char * bucket, const char * key, const char * value) {
+	RIAK_CACHE_TICKET ticket;
+	RIAK_OBJECT * obj = NULL;
+	int ret;
+
+	if(riak_cache_lookup(cache, bucket, strlen(bucket), key, strlen(key), &obj, 0, &ticket) != RIAK_CACHE_HIT) {
+		riak_cache_fail(cache, &ticket);
+		return value == NULL;
+	}
+	ret = value != NULL && obj->value_len == strlen(value) && memcmp(obj->value, value, obj->value_len) == 0;
+	riak_object_free(obj);
+	return ret;
+}
+
+/**	\fn int check_shared_cache(void)
+ * 	\brief Checks that objects cached through one handle of shared cache are hits in other one, and that
+ * 	invalidation is seen by both.
+ */
+static int check_shared_cache(void) {
+	RIAK_CACHE * first, * second;
+	int ok;
+
+	printf("\tshared cache... ");
+	unlink(TEST_SHM_FILE);
+	if((first = riak_cache_new_shared(TEST_SHM_FILE, 1 << 20, 1024, 60000)) == NULL
+			|| (second = riak_cache_new_shared(TEST_SHM_FILE, 1 << 20, 1024, 60000)) == NULL) {
+		riak_cache_free(first);
+		unlink(TEST_SHM_FILE);
+		printf("ERROR\n");
+		return 1;
+	}
+
+	cache_fill(first, "shm", "k1", "v1");
+	ok = cache_holds(second, "shm", "k1", "v1") && cache_holds(second, "shm", "k2", NULL);
+	riak_cache_invalidate(second, "shm", 3, "k1", 2);
+	ok = ok && cache_holds(first, "shm", "k1", NULL);
+
+	/* Entries outlive handles */
+	cache_fill(first, "shm", "k3", "v3");
+	riak_cache_free(first);
+	riak_cache_free(second);
+	ok = ok && (first = riak_cache_new_shared(TEST_SHM_FILE, 1 << 20, 1024, 60000)) != NULL
+			&& cache_holds(first, "shm", "k3", "v3");
+	riak_cache_free(first);
+
+	unlink(TEST_SHM_FILE);
+	printf("%s\n", ok ? "OK" : "ERROR");
+	return !ok;
+}
+
+/**	\fn int check_cache(void)
+ * 	\brief Saves cache and loads it into new one, checking that objects which expired meanwhile are dropped.
+ */
+static int check_cache(void) {
+	RIAK_CACHE * cache, * loaded;
+	int ok;
+
+	printf("\tcache snapshot... ");
+	if((cache = riak_cache_new(1 << 20, 60000)) == NULL || (loaded = riak_cache_new(1 << 20, 60000)) == NULL) {
+		riak_cache_free(cache);
+		printf("ERROR\n");
+		return 1;
+	}
+	riak_cache_set_ttl(cache, "short", 5, 50);
+	riak_cache_set_ttl(loaded, "short", 5, 50);
+
+	cache_fill(cache, "long", "k1", "v1");
+	cache_fill(cache, "long", "k2", "");
+	cache_fill(cache, "short", "k1", "s1");
+	ok = cache_holds(cache, "short", "k1", "s1") && riak_cache_save(cache, TEST_CACHE_FILE) == 0;
+
+	/* Objects of "short" bucket expire before file is loaded */
+	usleep(100*1000);
+	ok = ok && riak_cache_load(loaded, TEST_CACHE_FILE) == 0
+			&& cache_holds(loaded, "long", "k1", "v1") && cache_holds(loaded, "long", "k2", "")
+			&& cache_holds(loaded, "short", "k1", NULL) && cache_holds(loaded, "long", "k3", NULL);
+
+	riak_cache_free(cache);
+	riak_cache_free(loaded);
+	unlink(TEST_CACHE_FILE);
+	printf("%s\n", ok ? "OK" : "ERROR");
+	return !ok;
+}
+
+/**	\fn int check_digests(void)
+ * 	\brief Checks that table of value hashes recognizes unchanged values and forgets them.
+ */
+static int check_digests(void) {
+	RIAK_DIGESTS * digests;
+	int ok;
+
+	printf("\tvalue digests... ");
+	if((digests = riak_digests_new(1024)) == NULL) {
+		printf("ERROR\n");
+		return 1;
+	}
+	riak_digest_set(digests, "d", 1, "k", 1, riak_digest_value("v1", 2));
+	ok = riak_digest_same(digests, "d", 1, "k", 1, riak_digest_value("v1", 2))
+			&& !riak_digest_same(digests, "d", 1, "k", 1, riak_digest_value("v2", 2))
+			&& !riak_digest_same(digests, "d", 1, "other", 5, riak_digest_value("v1", 2));
+	riak_digest_forget(digests, "d", 1, "k", 1);
+	ok = ok && !riak_digest_same(digests, "d", 1, "k", 1, riak_digest_value("v1", 2));
+	riak_digests_free(digests);
+
+	printf("%s\n", ok ? "OK" : "ERROR");
+	return !ok;
+}
+
+int main() {
+	int failed = 0;
+
+	printf("Unit checks:\n");
+	failed |= check_shared_cache();
+	failed |= check_cache();
+	failed |= check_digests();
+
+	return failed;
+}